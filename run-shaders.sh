@@ -8,10 +8,8 @@ export WRAP_GMEM_SIZE=0x100000
 
 export LD_LIBRARY_PATH=/system/lib64/:/system/vendor/lib64/
 
-for f in $*; do
-	echo "Running: $f"
-	n=`basename $f`
-	n=${n%%.shader_test}
-	TESTNUM=$n LD_PRELOAD=`pwd`/libwrapfake.so ./shader-runner $f
-done
+# shader-runner takes shader_test files and/or directories, and runs them
+# in a pool of JOBS workers (one per core by default), writing an rd file
+# per shader:
+LD_PRELOAD=`pwd`/libwrapfake.so ./shader-runner -j ${JOBS:-0} $*
 
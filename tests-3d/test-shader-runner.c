@@ -23,8 +23,11 @@
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <dirent.h>
+#include <getopt.h>
 
 #include <GLES3/gl32.h>
 #include "test-util-3d.h"
@@ -245,14 +248,39 @@ get_shaders(const char *text, size_t text_size, unsigned *num_shaders,
 static void setup(void);
 
 
+/* shared by all textures, since in batch mode many shaders are run: */
 static void *getpix(unsigned npix)
 {
-	uint32_t *pix = malloc(npix * 4);
-	for (unsigned i = 0; i < npix; i++)
-		pix[i] = i;
+	static uint32_t *pix;
+	static unsigned max;
+	if (npix > max) {
+		pix = realloc(pix, npix * 4);
+		for (unsigned i = max; i < npix; i++)
+			pix[i] = i;
+		max = npix;
+	}
 	return pix;
 }
 
+/* textures created for the current shader: */
+static GLuint *textures;
+static unsigned ntextures, textures_size;
+
+static GLuint new_texture(void)
+{
+	GLuint tex;
+
+	glGenTextures(1, &tex);
+
+	if (ntextures == textures_size) {
+		textures_size = textures_size ? textures_size * 2 : 32;
+		textures = realloc(textures, textures_size * sizeof(textures[0]));
+	}
+	textures[ntextures++] = tex;
+
+	return tex;
+}
+
 
 
 static int setup_tex2d(int program, const char *name, int unit, int image)
@@ -294,7 +322,7 @@ imageAtomicAdd(u_results, ivec2(gx % 64, gy), (gx*gx + gy*gy + gz*gz))));
 
 imageAtomicAdd(u_results, ivec2(gx % 64, gy), (gx*gx + gy*gy + gz*gz));
  */
-		glGenTextures(1, &tex);
+		tex = new_texture();
 
 		glActiveTexture(GL_TEXTURE0 + unit);
 		glBindTexture(GL_TEXTURE_2D, tex);
@@ -353,7 +381,7 @@ static int setup_tex3d(int program, const char *name, int unit, int image)
 
 		DEBUG_MSG("setup %s (%s,%s,%s)", name, formatname(fmt), formatname(ifmt), typename(type));
 
-		glGenTextures(1, &tex);
+		tex = new_texture();
 
 		glActiveTexture(GL_TEXTURE0 + unit);
 		glBindTexture(GL_TEXTURE_3D, tex);
@@ -390,7 +418,7 @@ static int setup_texcube(int program, const char *name, int unit)
 	if (handle >= 0) {
 		DEBUG_MSG("setup %s", name);
 
-		glGenTextures(1, &tex);
+		tex = new_texture();
 
 		glActiveTexture(GL_TEXTURE0 + unit);
 		glBindTexture(GL_TEXTURE_CUBE_MAP, tex);
@@ -443,17 +471,11 @@ static void setup_textures(GLint program)
 }
 
 
-static int test_compiler(const char *path)
+/* compile and draw with the shaders from one shader_test file: */
+static int run_shader(const char *path)
 {
-	static int nattr = 0;
 	int fd;
-	int i, ret;
-
-	char *name = getenv("TESTNAME");
-	if (!name)
-		name = "shader-runner";
-
-	RD_START(name, "%s", path);
+	int ret;
 
 	fd = open(path, 0);
 	if (fd == -1) {
@@ -461,8 +483,6 @@ static int test_compiler(const char *path)
 		return -1;
 	}
 
-	setup();
-
 	struct stat statbuf;
 
 	ret = fstat(fd, &statbuf);
@@ -479,6 +499,12 @@ static int test_compiler(const char *path)
 	struct shader *shader =
 		get_shaders(text, statbuf.st_size, &num_shaders, path, &binding);
 
+	if (!shader) {
+		munmap((void *)text, statbuf.st_size);
+		close(fd);
+		return -1;
+	}
+
 	GLuint prog = glCreateProgram();
 	GLint param;
 
@@ -527,14 +553,269 @@ static int test_compiler(const char *path)
 	ECHK(eglSwapBuffers(display, surface));
 	GCHK(glFlush());
 
+	/* clean up, for the next shader in batch mode: */
+	glDeleteTextures(ntextures, textures);
+	ntextures = 0;
+	glDeleteProgram(prog);
+	while (glGetError() != GL_NO_ERROR) {}
+
+	free(shader);
+	munmap((void *)text, statbuf.st_size);
+	close(fd);
+
+	return 0;
+}
+
+static void teardown(void)
+{
 	ECHK(eglDestroySurface(display, surface));
 	ECHK(eglTerminate(display));
+}
+
+static char * shader_name(const char *path, const char *root);
+
+static int test_compiler(const char *path)
+{
+	int ret;
+
+	/* name the rd file after the shader, as in batch mode: */
+	char *name = getenv("TESTNAME");
+	if (!name)
+		name = shader_name(path, NULL);
+	setenv("TESTNUM", "0", 0);
+
+	RD_START(name, "%s", path);
+
+	setup();
+
+	ret = run_shader(path);
+	if (ret)
+		return ret;
+
+	teardown();
 
 	RD_END();
 
 	return 0;
 }
 
+/*
+ * Batch mode:
+ *
+ * Rather than a process per shader_test, which pays for process startup
+ * plus EGL and compiler initialization each time, a pool of worker
+ * processes each initialize once and then run shaders from a shared queue.
+ * Each shader gets its own rd file, named after the shader_test's path
+ * relative to the directory given on the command line, plus its position
+ * in the queue, since corpora often reuse the same file names in different
+ * directories.  If a worker crashes, the shader it was running is reported,
+ * and a new worker takes its place.
+ */
+
+struct batch {
+	int next;              /* next shader to be run */
+	int current[];         /* per worker, shader being run, or -1 */
+};
+
+static const char **paths;
+static char **names;           /* per path, name for the rd file */
+static int npaths, paths_size;
+
+/* root is the directory given on the command line, or NULL for a file: */
+static char * shader_name(const char *path, const char *root)
+{
+	const char *rel = NULL;
+	char *name, *ext, *p;
+
+	if (root) {
+		rel = path + strlen(root);
+		while (*rel == '/')
+			rel++;
+	} else {
+		rel = strrchr(path, '/');
+		rel = rel ? rel + 1 : path;
+	}
+
+	name = strdup(rel);
+	ext = strstr(name, ".shader_test");
+	if (ext)
+		*ext = '\0';
+	for (p = name; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	return name;
+}
+
+static void add_path(const char *path, const char *root)
+{
+	if (npaths == paths_size) {
+		paths_size = paths_size ? paths_size * 2 : 256;
+		paths = realloc(paths, paths_size * sizeof(paths[0]));
+		names = realloc(names, paths_size * sizeof(names[0]));
+	}
+
+	paths[npaths] = path;
+	names[npaths] = shader_name(path, root);
+	npaths++;
+}
+
+static bool is_dir(const char *path)
+{
+	struct stat statbuf;
+	return !stat(path, &statbuf) && S_ISDIR(statbuf.st_mode);
+}
+
+/* add the shader_test files in a directory, recursively: */
+static void add_dir(const char *dir, const char *root)
+{
+	static const char *ext = ".shader_test";
+	struct dirent **entries;
+	int i, n;
+
+	n = scandir(dir, &entries, NULL, alphasort);
+	if (n < 0) {
+		perror(dir);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		const char *name = entries[i]->d_name;
+		size_t len = strlen(name);
+		char *path;
+
+		if (name[0] != '.') {
+			path = malloc(strlen(dir) + len + 2);
+			sprintf(path, "%s/%s", dir, name);
+
+			if (is_dir(path)) {
+				add_dir(path, root);
+				free(path);
+			} else if ((len > strlen(ext)) &&
+					!strcmp(name + len - strlen(ext), ext)) {
+				add_path(path, root);
+			} else {
+				free(path);
+			}
+		}
+
+		free(entries[i]);
+	}
+
+	free(entries);
+}
+
+static void batch_worker(struct batch *batch, int worker)
+{
+	int i;
+
+	setup();
+
+	while ((i = __sync_fetch_and_add(&batch->next, 1)) < npaths) {
+		char testnum[16];
+
+		batch->current[worker] = i;
+		printf("Running: %s\n", paths[i]);
+		fflush(stdout);
+
+		/* name the rd file <name>-NNNN.rd, rather than /sdcard/trace.rd: */
+		snprintf(testnum, sizeof(testnum), "%d", i);
+		setenv("TESTNUM", testnum, 1);
+
+		RD_START(names[i], "%s", paths[i]);
+		run_shader(paths[i]);
+		RD_END();
+
+		batch->current[worker] = -1;
+	}
+
+	teardown();
+}
+
+static int run_batch(int njobs)
+{
+	struct batch *batch;
+	pid_t *pids;
+	int i, live = 0, failed = 0, broken = 0;
+
+	batch = mmap(NULL, sizeof(*batch) + njobs * sizeof(batch->current[0]),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (batch == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	batch->next = 0;
+
+	pids = calloc(njobs, sizeof(pids[0]));
+
+	for (i = 0; i < njobs; i++)
+		batch->current[i] = -1;
+
+	for (;;) {
+		int status;
+		pid_t pid;
+
+		/* (re)start workers, while there is work left: */
+		for (i = 0; (i < njobs) && (batch->next < npaths) && !broken; i++) {
+			if (pids[i])
+				continue;
+
+			pid = fork();
+			if (pid == 0) {
+				batch_worker(batch, i);
+				exit(0);
+			} else if (pid < 0) {
+				perror("fork");
+				break;
+			}
+
+			pids[i] = pid;
+			live++;
+		}
+
+		if (!live)
+			break;
+
+		pid = wait(&status);
+		if (pid < 0) {
+			perror("wait");
+			return -1;
+		}
+
+		for (i = 0; i < njobs; i++)
+			if (pids[i] == pid)
+				break;
+		if (i == njobs)
+			continue;
+
+		pids[i] = 0;
+		live--;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			int cur = batch->current[i];
+			if (cur < 0) {
+				/* died in setup, so a new worker would too: */
+				fprintf(stderr, "ERROR: worker %d died outside of a shader\n", i);
+				broken = 1;
+				continue;
+			}
+			fprintf(stderr, "ERROR: worker %d died running %s\n", i, paths[cur]);
+			batch->current[i] = -1;
+			failed++;
+		}
+	}
+
+	if (broken) {
+		fprintf(stderr, "ERROR: giving up, %d of %d shaders not run\n",
+				npaths - MIN2(batch->next, npaths), npaths);
+		return 1;
+	}
+
+	printf("ran %d shaders, %d failed\n", npaths, failed);
+
+	return failed ? 1 : 0;
+}
+
 static void setup(void)
 {
 	GLint width, height;
@@ -581,11 +862,47 @@ static void setup(void)
 	GCHK(glFlush());
 }
 
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s FILE.shader_test\n", name);
+	fprintf(stderr, "       %s [-j JOBS] FILE.shader_test|DIR...\n", name);
+	exit(2);
+}
+
 int main(int argc, char *argv[])
 {
+	int opt, njobs = 0;
+
 	TEST_START();
-	test_compiler(argv[1]);
 
-	return 0;
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			njobs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+
+	/* a single shader_test runs in this process, as before: */
+	if (!njobs && (optind == (argc - 1)) && !is_dir(argv[optind]))
+		return test_compiler(argv[optind]) ? 1 : 0;
+
+	for (; optind < argc; optind++) {
+		if (is_dir(argv[optind]))
+			add_dir(argv[optind], argv[optind]);
+		else
+			add_path(argv[optind], NULL);
+	}
+
+	if (njobs <= 0)
+		njobs = sysconf(_SC_NPROCESSORS_ONLN);
+	njobs = MAX2(1, MIN2(njobs, npaths));
+
+	return run_batch(njobs);
 }
 
@@ -0,0 +1,162 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "redump.h"
+#include "rdbuf.h"
+
+struct rd_buffer {
+	uint64_t gpuaddr;
+	uint32_t len;
+	const void *data;
+	void    *copy;      /* private copy, once a delta has been applied */
+};
+
+struct rd_buffers {
+	struct rd_buffer *bufs;  /* sorted by gpuaddr */
+	int nbufs, maxbufs;
+};
+
+struct rd_buffers * rd_buffers_new(void)
+{
+	return calloc(1, sizeof(struct rd_buffers));
+}
+
+void rd_buffers_free(struct rd_buffers *bufs)
+{
+	int i;
+
+	if (!bufs)
+		return;
+
+	for (i = 0; i < bufs->nbufs; i++)
+		free(bufs->bufs[i].copy);
+	free(bufs->bufs);
+	free(bufs);
+}
+
+/* returns index of buffer at gpuaddr, or where it should be inserted: */
+static int find(struct rd_buffers *bufs, uint64_t gpuaddr)
+{
+	int lo = 0, hi = bufs->nbufs;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (bufs->bufs[mid].gpuaddr < gpuaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void rd_buffers_set(struct rd_buffers *bufs, uint64_t gpuaddr,
+		const void *data, uint32_t len)
+{
+	int i = find(bufs, gpuaddr);
+	struct rd_buffer *buf;
+
+	if ((i == bufs->nbufs) || (bufs->bufs[i].gpuaddr != gpuaddr)) {
+		if (bufs->nbufs == bufs->maxbufs) {
+			bufs->maxbufs = max(64, bufs->maxbufs * 2);
+			bufs->bufs = realloc(bufs->bufs,
+					bufs->maxbufs * sizeof(bufs->bufs[0]));
+		}
+		memmove(&bufs->bufs[i + 1], &bufs->bufs[i],
+				(bufs->nbufs - i) * sizeof(bufs->bufs[0]));
+		bufs->nbufs++;
+		buf = &bufs->bufs[i];
+		buf->gpuaddr = gpuaddr;
+		buf->copy = NULL;
+	} else {
+		buf = &bufs->bufs[i];
+	}
+
+	/* no need to copy until a delta is applied: */
+	free(buf->copy);
+	buf->copy = NULL;
+	buf->data = data;
+	buf->len = len;
+}
+
+const void * rd_buffers_apply_delta(struct rd_buffers *bufs, uint64_t gpuaddr,
+		const void *delta, uint32_t sz, uint32_t *len)
+{
+	int i = find(bufs, gpuaddr);
+	const uint8_t *p = delta, *end = p + sz;
+	struct rd_buffer *buf;
+
+	if ((i == bufs->nbufs) || (bufs->bufs[i].gpuaddr != gpuaddr))
+		return NULL;
+
+	buf = &bufs->bufs[i];
+
+	if (!buf->copy) {
+		/* a bit of zero padding, for decoders that peek past the end: */
+		buf->copy = calloc(1, buf->len + 32);
+		memcpy(buf->copy, buf->data, buf->len);
+		buf->data = buf->copy;
+	}
+
+	while ((p + 8) <= end) {
+		uint32_t off, n;
+
+		memcpy(&off, p + 0, 4);
+		memcpy(&n, p + 4, 4);
+		p += 8;
+
+		if ((off > buf->len) || (n > (buf->len - off)) ||
+				(ALIGN(n, 4) > (end - p)))
+			return NULL;
+
+		memcpy((uint8_t *)buf->copy + off, p, n);
+		p += ALIGN(n, 4);
+	}
+
+	*len = buf->len;
+
+	return buf->data;
+}
+
+const void * rd_buffers_find(struct rd_buffers *bufs, uint64_t gpuaddr,
+		uint64_t *base, uint32_t *len)
+{
+	/* the last buffer starting at or before gpuaddr: */
+	int i = find(bufs, gpuaddr + 1) - 1;
+	struct rd_buffer *buf;
+
+	if (i < 0)
+		return NULL;
+
+	buf = &bufs->bufs[i];
+	if ((gpuaddr - buf->gpuaddr) >= buf->len)
+		return NULL;
+
+	*base = buf->gpuaddr;
+	*len = buf->len;
+
+	return buf->data;
+}
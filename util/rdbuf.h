@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RDBUF_H_
+#define RDBUF_H_
+
+#include <stdint.h>
+
+/* Tracks the most recent contents of each buffer (by gpuaddr) seen in an
+ * rd file, so that RD_BUFFER_DELTA sections (see WRAP_DIRTY) can be turned
+ * back into full buffer contents.
+ */
+
+struct rd_buffers;
+
+struct rd_buffers * rd_buffers_new(void);
+void rd_buffers_free(struct rd_buffers *bufs);
+
+/* record the contents from a RD_BUFFER_CONTENTS section.  The data is not
+ * copied, so it must remain valid until the buffer is next updated:
+ */
+void rd_buffers_set(struct rd_buffers *bufs, uint64_t gpuaddr,
+		const void *data, uint32_t len);
+
+/* apply the changes from a RD_BUFFER_DELTA section, and return the updated
+ * contents and their size (valid until the buffer is next updated), or NULL
+ * if the buffer has not been seen or the delta is malformed:
+ */
+const void * rd_buffers_apply_delta(struct rd_buffers *bufs, uint64_t gpuaddr,
+		const void *delta, uint32_t sz, uint32_t *len);
+
+/* return the contents of the buffer containing gpuaddr, along with the
+ * buffer's gpuaddr and size, or NULL if there is no such buffer:
+ */
+const void * rd_buffers_find(struct rd_buffers *bufs, uint64_t gpuaddr,
+		uint64_t *base, uint32_t *len);
+
+#endif /* RDBUF_H_ */
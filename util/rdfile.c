@@ -0,0 +1,494 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "redump.h"
+#include "rdbuf.h"
+#include "rdfile.h"
+#include "rdz.h"
+
+struct rd_file {
+	const uint8_t *map;
+	uint64_t size, mapsize;
+	uint64_t off;            /* of the next section */
+	uint64_t end;            /* of the last complete section, before index */
+	uint64_t gpuaddr;        /* from the most recent RD_GPUADDR */
+	uint64_t *bufoffs;       /* payload offsets of RD_BUFFER_CONTENTS */
+	uint32_t nbufoffs, maxbufoffs;
+	struct rd_buffers *bufs; /* for reconstructing RD_BUFFER_DELTA */
+	struct rdz *z;           /* if compressed, to inflate blocks on demand */
+	struct rd_index_entry *index;
+	uint32_t nindex;
+	int indexed;             /* index is from the file, rather than built */
+};
+
+/* make sure the given range of a compressed file has been inflated: */
+static int fill(struct rd_file *f, uint64_t off, uint64_t len)
+{
+	if (!f->z)
+		return 0;
+	return rdz_fill(f->z, (void *)f->map, off, len);
+}
+
+static int fill_payload(struct rd_file *f, const struct rd_section *sect)
+{
+	return fill(f, (const uint8_t *)sect->payload - f->map, sect->size);
+}
+
+/* parse the section header at the given offset, returns 1 on success, 0 at
+ * the end of the file, or -1 if the section is truncated.  The payload is
+ * not filled, see fill_payload():
+ */
+static int parse(struct rd_file *f, uint64_t off, struct rd_section *sect)
+{
+	const uint32_t *hdr;
+	uint64_t start = off;
+
+	if ((off + 8) > f->size)
+		return (off == f->size) ? 0 : -1;
+
+	if (fill(f, off, 16))
+		return -1;
+
+	hdr = (const uint32_t *)(f->map + off);
+
+	/* older files don't have the 0xffffffff prefix: */
+	if ((hdr[0] == 0xffffffff) && (hdr[1] == 0xffffffff)) {
+		off += 8;
+		hdr += 2;
+		if ((off + 8) > f->size)
+			return -1;
+	}
+
+	off += 8;
+	if (hdr[1] > (f->size - off))
+		return -1;
+
+	sect->type    = hdr[0];
+	sect->size    = hdr[1];
+	sect->payload = f->map + off;
+	sect->gpuaddr = 0;
+	sect->offset  = start;
+	sect->end     = off + hdr[1];
+
+	return 1;
+}
+
+/* load the index from the end of the file, if there is one: */
+static void load_index(struct rd_file *f)
+{
+	struct rd_index_trailer trailer;
+	struct rd_section sect;
+	uint64_t sz;
+
+	if (f->size < sizeof(trailer))
+		return;
+
+	if (fill(f, f->size - sizeof(trailer), sizeof(trailer)))
+		return;
+
+	memcpy(&trailer, f->map + f->size - sizeof(trailer), sizeof(trailer));
+	if ((trailer.magic != RD_INDEX_MAGIC) || (trailer.offset >= f->size))
+		return;
+
+	sz = (uint64_t)trailer.count * sizeof(f->index[0]);
+	if ((parse(f, trailer.offset, &sect) != 1) ||
+			(sect.type != RD_INDEX) || (sect.end != f->size) ||
+			(sect.size != (sz + sizeof(trailer))) ||
+			fill_payload(f, &sect))
+		return;
+
+	/* copy, since the payload is only 4 byte aligned: */
+	f->index = malloc(sz);
+	memcpy(f->index, sect.payload, sz);
+	f->nindex = trailer.count;
+	f->end = trailer.offset;
+	f->indexed = 1;
+}
+
+/* build an index by scanning all the sections: */
+static void build_index(struct rd_file *f)
+{
+	struct rd_section sect;
+	uint64_t off = 0, gpuaddr = 0;
+	uint32_t len = 0, submit = 0, prev = RD_NONE, max = 0;
+	int seq = 0;
+
+	f->end = 0;
+
+	while (parse(f, off, &sect) == 1) {
+		struct rd_index_entry *e;
+		const uint32_t *p = sect.payload;
+
+		off = sect.end;
+
+		/* only the addresses are needed, not the buffer contents: */
+		if ((sect.type == RD_GPUADDR) || (sect.type == RD_CMDSTREAM_ADDR)) {
+			if (fill_payload(f, &sect))
+				break;
+			gpuaddr = p[0];
+			len = p[1];
+			if (sect.size >= 12)
+				gpuaddr |= (uint64_t)p[2] << 32;
+			if (sect.type == RD_CMDSTREAM_ADDR)
+				len *= 4;
+		}
+
+		if (sect.type == RD_SUBMIT_SEQ) {
+			/* newer files mark the start of each submit: */
+			seq = 1;
+			submit++;
+		} else if (!seq) {
+			/* otherwise, the buffers for a submit are dumped before
+			 * its cmdstream address(es), so a new submit starts with
+			 * the first section after those:
+			 */
+			if ((prev == RD_CMDSTREAM_ADDR) && (sect.type != RD_CMDSTREAM_ADDR))
+				submit++;
+			/* and anything up to the first cmdstream is part of the first: */
+			if ((submit == 0) && (sect.type == RD_CMDSTREAM_ADDR))
+				submit = 1;
+		}
+		prev = sect.type;
+
+		/* stale index, ie. file was appended to: */
+		if (sect.type == RD_INDEX)
+			continue;
+
+		if (f->nindex == max) {
+			max = max ? max * 2 : 4096;
+			f->index = realloc(f->index, max * sizeof(f->index[0]));
+		}
+
+		e = &f->index[f->nindex++];
+		e->offset = sect.offset;
+		e->type   = sect.type;
+		e->size   = sect.size;
+		e->submit = submit;
+
+		switch (sect.type) {
+		case RD_GPUADDR:
+		case RD_CMDSTREAM_ADDR:
+		case RD_BUFFER_CONTENTS:
+		case RD_BUFFER_REF:
+		case RD_BUFFER_DELTA:
+			e->gpuaddr = gpuaddr;
+			e->len = len;
+			break;
+		default:
+			e->gpuaddr = 0;
+			e->len = 0;
+			break;
+		}
+
+		f->end = off;
+	}
+}
+
+struct rd_file * rd_file_open(const char *path)
+{
+	uint64_t pagesize = sysconf(_SC_PAGESIZE);
+	struct rd_file *f;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	f = calloc(1, sizeof(*f));
+
+	if (rdz_compressed(fd)) {
+		/* blocks are inflated into the mapping as they are accessed: */
+		f->z = rdz_open(fd, &f->size);
+		if (!f->z) {
+			free(f);
+			return NULL;
+		}
+
+		f->mapsize = ALIGN(f->size, pagesize) + pagesize;
+		map = mmap(NULL, f->mapsize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			rdz_close(f->z);
+			free(f);
+			return NULL;
+		}
+	} else {
+		if (fstat(fd, &st)) {
+			close(fd);
+			free(f);
+			return NULL;
+		}
+
+		f->size = st.st_size;
+
+		/* map the file over a larger anonymous mapping, so that it is
+		 * followed by zeros rather than unmapped pages:
+		 */
+		f->mapsize = ALIGN(f->size, pagesize) + pagesize;
+		map = mmap(NULL, f->mapsize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if ((map != MAP_FAILED) && f->size &&
+				(mmap(map, f->size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+						fd, 0) == MAP_FAILED)) {
+			munmap(map, f->mapsize);
+			map = MAP_FAILED;
+		}
+
+		close(fd);
+
+		if (map == MAP_FAILED) {
+			free(f);
+			return NULL;
+		}
+	}
+
+	f->map = map;
+	f->end = f->size;
+	f->bufs = rd_buffers_new();
+
+	load_index(f);
+
+	return f;
+}
+
+void rd_file_close(struct rd_file *f)
+{
+	if (!f)
+		return;
+
+	munmap((void *)f->map, f->mapsize);
+	rdz_close(f->z);
+	rd_buffers_free(f->bufs);
+	free(f->bufoffs);
+	free(f->index);
+	free(f);
+}
+
+int rd_file_next_raw(struct rd_file *f, struct rd_section *sect)
+{
+	int ret = parse(f, f->off, sect);
+	if ((ret == 1) && fill_payload(f, sect))
+		return -1;
+	if (ret == 1)
+		f->off = sect->end;
+	return ret;
+}
+
+static void add_contents(struct rd_file *f, uint64_t off, uint32_t size)
+{
+	if (f->nbufoffs == f->maxbufoffs) {
+		f->maxbufoffs = max(64, f->maxbufoffs * 2);
+		f->bufoffs = realloc(f->bufoffs,
+				f->maxbufoffs * sizeof(f->bufoffs[0]));
+	}
+	f->bufoffs[f->nbufoffs++] = off;
+	rd_buffers_set(f->bufs, f->gpuaddr, f->map + off, size);
+}
+
+/* with WRAP_DEDUP, repeated buffer contents are written as a RD_BUFFER_REF
+ * to an earlier RD_BUFFER_CONTENTS section, so remember where those are and
+ * resolve references back into contents.  Likewise with WRAP_DIRTY, only the
+ * changes are written as a RD_BUFFER_DELTA, so keep track of the contents
+ * of each buffer to reconstruct it:
+ */
+static int resolve(struct rd_file *f, struct rd_section *sect)
+{
+	const uint32_t *p = sect->payload;
+
+	switch (sect->type) {
+	case RD_GPUADDR:
+		if (sect->size < 8)
+			break;
+		f->gpuaddr = p[0];
+		if (sect->size >= 12)
+			f->gpuaddr |= (uint64_t)p[2] << 32;
+		break;
+	case RD_BUFFER_CONTENTS:
+		add_contents(f, (const uint8_t *)sect->payload - f->map, sect->size);
+		break;
+	case RD_BUFFER_REF: {
+		uint32_t idx, len;
+
+		if ((sect->size < 8) || fill_payload(f, sect))
+			return -1;
+
+		idx = p[0];
+		len = p[1];
+
+		if ((idx >= f->nbufoffs) || (len > (f->size - f->bufoffs[idx]))) {
+			fprintf(stderr, "invalid buffer ref: %u\n", idx);
+			return -1;
+		}
+
+		sect->type    = RD_BUFFER_CONTENTS;
+		sect->size    = len;
+		sect->payload = f->map + f->bufoffs[idx];
+		rd_buffers_set(f->bufs, f->gpuaddr, sect->payload, sect->size);
+		break;
+	}
+	case RD_BUFFER_DELTA: {
+		uint64_t base;
+		uint32_t len;
+		const uint8_t *prev = rd_buffers_find(f->bufs, f->gpuaddr, &base, &len);
+		const void *contents;
+
+		/* the previous contents may be a section that was skipped over
+		 * by rd_file_seek_submit(), so not yet inflated:
+		 */
+		if (fill_payload(f, sect) ||
+				(prev && (prev >= f->map) && (prev < (f->map + f->size)) &&
+					fill(f, prev - f->map, len)))
+			return -1;
+
+		contents = rd_buffers_apply_delta(f->bufs, f->gpuaddr,
+				sect->payload, sect->size, &len);
+
+		if (!contents) {
+			fprintf(stderr, "invalid buffer delta: %016llx\n",
+					(unsigned long long)f->gpuaddr);
+			return -1;
+		}
+
+		sect->type    = RD_BUFFER_CONTENTS;
+		sect->size    = len;
+		sect->payload = contents;
+		break;
+	}
+	default:
+		return 0;
+	}
+
+	if (sect->type == RD_BUFFER_CONTENTS)
+		sect->gpuaddr = f->gpuaddr;
+
+	return 0;
+}
+
+int rd_file_next(struct rd_file *f, struct rd_section *sect)
+{
+	int ret = rd_file_next_raw(f, sect);
+	if ((ret == 1) && (resolve(f, sect) || fill_payload(f, sect)))
+		return -1;
+	return ret;
+}
+
+const struct rd_index_entry * rd_file_index(struct rd_file *f, uint32_t *count)
+{
+	if (!f->index)
+		build_index(f);
+	*count = f->nindex;
+	return f->index;
+}
+
+int rd_file_indexed(struct rd_file *f)
+{
+	return f->indexed;
+}
+
+uint64_t rd_file_end(struct rd_file *f)
+{
+	if (!f->index)
+		build_index(f);
+	return f->end;
+}
+
+uint64_t rd_file_size(struct rd_file *f)
+{
+	return f->size;
+}
+
+int rd_file_seek_submit(struct rd_file *f, uint32_t submit)
+{
+	const struct rd_index_entry *index;
+	uint32_t i, n, lo = 0, hi;
+
+	index = rd_file_index(f, &n);
+
+	/* submit numbers only increase, so binary search for the first: */
+	hi = n;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (index[mid].submit < submit)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if ((lo == n) || (index[lo].submit != submit))
+		return -1;
+
+	/* catch up on the buffer state, for any later REF/DELTA sections.  This
+	 * does not need the buffer contents, other than the previous contents
+	 * for a RD_BUFFER_DELTA, so for compressed files only those blocks are
+	 * inflated:
+	 */
+	f->gpuaddr = 0;
+	f->nbufoffs = 0;
+	rd_buffers_free(f->bufs);
+	f->bufs = rd_buffers_new();
+
+	for (i = 0; i < lo; i++) {
+		const struct rd_index_entry *e = &index[i];
+		struct rd_section sect;
+		uint64_t gap;
+
+		switch (e->type) {
+		case RD_GPUADDR:
+			f->gpuaddr = e->gpuaddr;
+			break;
+		case RD_BUFFER_CONTENTS:
+			/* the payload is at the end of the section, so if the next
+			 * section follows it, the header does not need to be read
+			 * (which would inflate the block it is in):
+			 */
+			gap = index[i + 1].offset - e->offset;
+			if ((gap == (e->size + 8)) || (gap == (e->size + 16))) {
+				add_contents(f, index[i + 1].offset - e->size, e->size);
+				break;
+			}
+			/* fallthrough */
+		case RD_BUFFER_REF:
+		case RD_BUFFER_DELTA:
+			if ((parse(f, e->offset, &sect) != 1) || resolve(f, &sect))
+				return -1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	f->off = index[lo].offset;
+
+	return 0;
+}
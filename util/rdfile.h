@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RDFILE_H_
+#define RDFILE_H_
+
+#include <stdint.h>
+
+#include "redump.h"
+
+/* Zero-copy reader for rd files.  The file is mmap'd (or for compressed files,
+ * blocks are inflated into an anonymous mapping as they are accessed), and
+ * sections are returned as views of the mapping rather than copied.  The mapping is followed by at least a page of zeros, so decoders
+ * can safely peek a few dwords past the end of a section.
+ *
+ * rd_file_next() resolves RD_BUFFER_REF and RD_BUFFER_DELTA sections (see
+ * WRAP_DEDUP and WRAP_DIRTY) back into RD_BUFFER_CONTENTS, while
+ * rd_file_next_raw() returns sections as they are in the file.
+ */
+
+struct rd_section {
+	enum rd_sect_type type;
+	uint32_t size;
+	const void *payload;   /* valid until the file is closed, except for
+	                        * reconstructed RD_BUFFER_DELTA contents, which
+	                        * are valid until the buffer is next updated */
+	uint64_t gpuaddr;      /* for buffer contents, from preceding RD_GPUADDR */
+	uint64_t offset;       /* start of section, including 0xffffffff prefix */
+	uint64_t end;          /* end of section, ie. offset of the next one */
+};
+
+struct rd_file;
+
+struct rd_file * rd_file_open(const char *path);
+void rd_file_close(struct rd_file *f);
+
+/* returns 1 if a section was read, 0 at end of file, or -1 if the file is
+ * truncated or corrupt:
+ */
+int rd_file_next(struct rd_file *f, struct rd_section *sect);
+int rd_file_next_raw(struct rd_file *f, struct rd_section *sect);
+
+/* returns the RD_INDEX entries.  If the file does not have an index (see
+ * rd_file_indexed()), one is built by scanning the file, in which case the
+ * submit numbers are inferred from the RD_CMDSTREAM_ADDR sections.
+ */
+const struct rd_index_entry * rd_file_index(struct rd_file *f, uint32_t *count);
+int rd_file_indexed(struct rd_file *f);
+
+/* offset of the end of the last complete section, not counting the index: */
+uint64_t rd_file_end(struct rd_file *f);
+
+/* size of the (uncompressed) file: */
+uint64_t rd_file_size(struct rd_file *f);
+
+/* skip ahead to the first section of the given submit, using the index.
+ * Returns 0 on success, or -1 if there is no such submit.
+ */
+int rd_file_seek_submit(struct rd_file *f, uint32_t submit);
+
+#endif /* RDFILE_H_ */
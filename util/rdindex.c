@@ -0,0 +1,270 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Query, or (re)build, the RD_INDEX of an rd file:
+ *
+ *   rdindex FILE               - list all indexed sections
+ *   rdindex -s SUBMIT FILE     - list the sections of the given submit
+ *   rdindex -a GPUADDR FILE    - list the buffer sections backing gpuaddr
+ *   rdindex -w FILE            - append an index to a file without one
+ *
+ * If the file has no index (ie. older files, or the process crashed before
+ * the file was closed), one is built by scanning the file.  In that case,
+ * submits are inferred from the RD_CMDSTREAM_ADDR sections.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "redump.h"
+#include "rdfile.h"
+
+static const char *sect_names[] = {
+		[RD_NONE]           = "none",
+		[RD_TEST]           = "test",
+		[RD_CMD]            = "cmd",
+		[RD_GPUADDR]        = "gpuaddr",
+		[RD_CONTEXT]        = "context",
+		[RD_CMDSTREAM]      = "cmdstream",
+		[RD_CMDSTREAM_ADDR] = "cmdstream-addr",
+		[RD_PARAM]          = "param",
+		[RD_FLUSH]          = "flush",
+		[RD_PROGRAM]        = "program",
+		[RD_VERT_SHADER]    = "vert-shader",
+		[RD_FRAG_SHADER]    = "frag-shader",
+		[RD_BUFFER_CONTENTS]= "buffer-contents",
+		[RD_GPU_ID]         = "gpu-id",
+		[RD_BUFFER_REF]     = "buffer-ref",
+		[RD_BUFFER_DELTA]   = "buffer-delta",
+		[RD_INDEX]          = "index",
+		[RD_SUBMIT_SEQ]     = "submit-seq",
+		[RD_IOCTL]          = "ioctl",
+};
+
+static const char *sect_name(uint32_t type)
+{
+	if ((type < ARRAY_SIZE(sect_names)) && sect_names[type])
+		return sect_names[type];
+	return "unknown";
+}
+
+static int write_all(int fd, const void *buf, uint64_t sz)
+{
+	const uint8_t *cbuf = buf;
+	while (sz > 0) {
+		ssize_t ret = write(fd, cbuf, sz);
+		if (ret < 0)
+			return -1;
+		cbuf += ret;
+		sz -= ret;
+	}
+	return 0;
+}
+
+/* append the index to the (possibly compressed) file: */
+static int write_index(const char *path, const struct rd_index_entry *entries,
+		uint32_t nentries, uint64_t end, uint64_t size)
+{
+	struct rd_index_trailer trailer = {
+			.offset = end,
+			.count  = nentries,
+			.magic  = RD_INDEX_MAGIC,
+	};
+	uint64_t sz = nentries * sizeof(entries[0]) + sizeof(trailer);
+	uint32_t hdr[4] = { ~0, ~0, RD_INDEX, sz }, magic;
+	uint8_t *buf;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "could not open: %s\n", path);
+		return -1;
+	}
+
+	buf = malloc(sizeof(hdr) + sz);
+	memcpy(buf, hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), entries, nentries * sizeof(entries[0]));
+	memcpy(buf + sizeof(hdr) + sz - sizeof(trailer), &trailer, sizeof(trailer));
+	sz += sizeof(hdr);
+
+	if ((pread(fd, &magic, sizeof(magic), 0) == sizeof(magic)) &&
+			(magic == RD_COMPRESSED_MAGIC)) {
+		/* compressed blocks are independent, so the index can just be
+		 * appended as more blocks:
+		 */
+		uint8_t *zbuf = malloc(compressBound(RD_COMPRESSED_BLOCK));
+		uint64_t off;
+
+		if (end != size) {
+			fprintf(stderr, "can't truncate compressed file\n");
+			ret = -1;
+		}
+
+		lseek(fd, 0, SEEK_END);
+		for (off = 0; !ret && (off < sz); off += RD_COMPRESSED_BLOCK) {
+			uint32_t zhdr[2] = { compressBound(RD_COMPRESSED_BLOCK),
+					min(sz - off, RD_COMPRESSED_BLOCK) };
+			uLongf zsz = zhdr[0];
+
+			if (compress2(zbuf, &zsz, buf + off, zhdr[1], Z_DEFAULT_COMPRESSION) != Z_OK) {
+				ret = -1;
+				break;
+			}
+			zhdr[0] = zsz;
+			ret = write_all(fd, zhdr, sizeof(zhdr)) ||
+					write_all(fd, zbuf, zsz);
+		}
+
+		free(zbuf);
+	} else {
+		/* drop any incomplete section at the end, so the index is found: */
+		ret = ftruncate(fd, end) ||
+				(lseek(fd, end, SEEK_SET) != end) ||
+				write_all(fd, buf, sz);
+	}
+
+	if (ret)
+		fprintf(stderr, "could not write index: %s\n", path);
+
+	free(buf);
+	close(fd);
+
+	return ret ? -1 : 0;
+}
+
+static void print_entry(const struct rd_index_entry *e)
+{
+	printf("%12"PRIu64" submit %-6u %-16s size %-8u", e->offset,
+			e->submit, sect_name(e->type), e->size);
+	if (e->gpuaddr || e->len)
+		printf(" gpuaddr %016"PRIx64" len %u", e->gpuaddr, e->len);
+	printf("\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s SUBMIT | -a GPUADDR | -w] FILE\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const struct rd_index_entry *entries;
+	uint64_t gpuaddr = 0, end, size;
+	int64_t submit = -1;
+	int opt, do_write = 0, found = 0, indexed;
+	struct rd_file *f;
+	uint32_t i, nentries;
+
+	while ((opt = getopt(argc, argv, "s:a:w")) != -1) {
+		switch (opt) {
+		case 's':
+			submit = strtoll(optarg, NULL, 0);
+			break;
+		case 'a':
+			gpuaddr = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			do_write = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != (argc - 1))
+		usage(argv[0]);
+
+	f = rd_file_open(argv[optind]);
+	if (!f) {
+		fprintf(stderr, "could not open: %s\n", argv[optind]);
+		return 1;
+	}
+
+	entries = rd_file_index(f, &nentries);
+	indexed = rd_file_indexed(f);
+	end = rd_file_end(f);
+	size = rd_file_size(f);
+
+	if (!indexed && (end != size)) {
+		fprintf(stderr, "warning: %"PRIu64" bytes of incomplete section at "
+				"end of file\n", size - end);
+	}
+
+	if (do_write) {
+		int ret = 0;
+
+		if (indexed) {
+			printf("%s: already indexed\n", argv[optind]);
+		} else if (write_index(argv[optind], entries, nentries, end, size)) {
+			ret = 1;
+		} else {
+			printf("%s: indexed %u sections\n", argv[optind], nentries);
+		}
+
+		rd_file_close(f);
+		return ret;
+	}
+
+	for (i = 0; i < nentries; i++) {
+		const struct rd_index_entry *e = &entries[i];
+
+		if ((submit >= 0) && (e->submit != submit))
+			continue;
+
+		if (gpuaddr) {
+			switch (e->type) {
+			case RD_GPUADDR:
+			case RD_BUFFER_CONTENTS:
+			case RD_BUFFER_REF:
+			case RD_BUFFER_DELTA:
+				break;
+			default:
+				continue;
+			}
+			if ((gpuaddr < e->gpuaddr) || (gpuaddr >= (e->gpuaddr + e->len)))
+				continue;
+		}
+
+		print_entry(e);
+		found++;
+	}
+
+	rd_file_close(f);
+
+	if (!found && ((submit >= 0) || gpuaddr)) {
+		fprintf(stderr, "no matching sections\n");
+		return 1;
+	}
+
+	return 0;
+}
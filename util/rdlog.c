@@ -0,0 +1,824 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Print the RD_IOCTL events logged by libwrap with WRAP_EVLOG, in the same
+ * format libwrap would have printed them as text:
+ *
+ *   rdlog FILE         - print the ioctls
+ *   rdlog -t FILE      - also print the time (relative to the first ioctl),
+ *                        the thread, and how long each ioctl took
+ *
+ * The arg structs are decoded the same as in libwrap, along with the extra
+ * data logged with them and the cmdstream of captured submits.  Which needs
+ * rdlog to be built for the same ABI as the traced process, otherwise only
+ * the hexdump of the arg structs is printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <getopt.h>
+
+#define __user
+#include "msm_kgsl.h"
+#include "z180.h"
+
+#include "redump.h"
+#include "rdfile.h"
+#include "rdbuf.h"
+
+#define IOCTL_INFO(n) \
+		[_IOC_NR(n)] = #n
+
+static const char *kgsl_3d_ioctls[_IOC_NR(0xffffffff)] = {
+		IOCTL_INFO(IOCTL_KGSL_DEVICE_GETPROPERTY),
+		IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP),
+		IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP_CTXTID),
+		IOCTL_INFO(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS),
+		IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_READTIMESTAMP),
+		IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_FREEMEMONTIMESTAMP),
+		IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_CREATE),
+		IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_DESTROY),
+		IOCTL_INFO(IOCTL_KGSL_MAP_USER_MEM),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_PMEM),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FREE),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FLUSH_CACHE),
+		IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC),
+		IOCTL_INFO(IOCTL_KGSL_CFF_SYNCMEM),
+		IOCTL_INFO(IOCTL_KGSL_CFF_USER_EVENT),
+		IOCTL_INFO(IOCTL_KGSL_TIMESTAMP_EVENT),
+		IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC_ID),
+		IOCTL_INFO(IOCTL_KGSL_GPUMEM_FREE_ID),
+		IOCTL_INFO(IOCTL_KGSL_PERFCOUNTER_GET),
+		IOCTL_INFO(IOCTL_KGSL_PERFCOUNTER_PUT),
+		/* kgsl-3d specific ioctls: */
+		IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_SET_BIN_BASE_OFFSET),
+		IOCTL_INFO(IOCTL_KGSL_SUBMIT_COMMANDS),
+		IOCTL_INFO(IOCTL_KGSL_SYNCSOURCE_CREATE),
+		IOCTL_INFO(IOCTL_KGSL_SYNCSOURCE_DESTROY),
+		IOCTL_INFO(IOCTL_KGSL_GPUOBJ_ALLOC),
+		IOCTL_INFO(IOCTL_KGSL_GPUOBJ_FREE),
+		IOCTL_INFO(IOCTL_KGSL_GPUOBJ_INFO),
+		IOCTL_INFO(IOCTL_KGSL_GPU_COMMAND),
+};
+
+static const char *kgsl_2d_ioctls[_IOC_NR(0xffffffff)] = {
+		IOCTL_INFO(IOCTL_KGSL_DEVICE_GETPROPERTY),
+		IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP),
+		IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP_CTXTID),
+		IOCTL_INFO(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS),
+		IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_READTIMESTAMP),
+		IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_FREEMEMONTIMESTAMP),
+		IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_CREATE),
+		IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_DESTROY),
+		IOCTL_INFO(IOCTL_KGSL_MAP_USER_MEM),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_PMEM),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FREE),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC),
+		IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FLUSH_CACHE),
+		IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC),
+		IOCTL_INFO(IOCTL_KGSL_CFF_SYNCMEM),
+		IOCTL_INFO(IOCTL_KGSL_CFF_USER_EVENT),
+		IOCTL_INFO(IOCTL_KGSL_TIMESTAMP_EVENT),
+		IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC_ID),
+		IOCTL_INFO(IOCTL_KGSL_GPUMEM_FREE_ID),
+};
+
+/* same as hexdump() in libwrap: */
+static void hexdump(const void *data, int size)
+{
+	const unsigned char *buf = data;
+	char alpha[17];
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (!(i % 16))
+			printf("\t\t\t%08X", (unsigned int) i);
+		if (!(i % 4))
+			printf(" ");
+
+		printf(" %02x", buf[i]);
+
+		if (isprint(buf[i]) && (buf[i] < 0xA0))
+			alpha[i % 16] = buf[i];
+		else
+			alpha[i % 16] = '.';
+
+		if ((i % 16) == 15) {
+			alpha[16] = 0;
+			printf("\t|%s|\n", alpha);
+		}
+	}
+
+	if (i % 16) {
+		for (i %= 16; i < 16; i++) {
+			printf("   ");
+			alpha[i] = '.';
+
+			if (i == 15) {
+				alpha[16] = 0;
+				printf("\t|%s|\n", alpha);
+			}
+		}
+	}
+}
+
+/* same as hexdump_dwords() in libwrap: */
+static void hexdump_dwords(const void *data, int sizedwords)
+{
+	const uint32_t *buf = data;
+	int i;
+
+	for (i = 0; i < sizedwords; i++) {
+		if (!(i % 8))
+			printf("\t\t\t%08X:   ", (unsigned int) i*4);
+		printf(" %08x", buf[i]);
+		if ((i % 8) == 7)
+			printf("\n");
+	}
+
+	if (i % 8)
+		printf("\n");
+}
+
+#define PROP_INFO(n) [n] = #n
+static const char *propnames[] = {
+		PROP_INFO(KGSL_PROP_DEVICE_INFO),
+		PROP_INFO(KGSL_PROP_DEVICE_SHADOW),
+		PROP_INFO(KGSL_PROP_DEVICE_POWER),
+		PROP_INFO(KGSL_PROP_SHMEM),
+		PROP_INFO(KGSL_PROP_SHMEM_APERTURES),
+		PROP_INFO(KGSL_PROP_MMU_ENABLE),
+		PROP_INFO(KGSL_PROP_INTERRUPT_WAITS),
+		PROP_INFO(KGSL_PROP_VERSION),
+		PROP_INFO(KGSL_PROP_GPU_RESET_STAT),
+		PROP_INFO(KGSL_PROP_PWRCTRL),
+		PROP_INFO(KGSL_PROP_PWR_CONSTRAINT),
+		PROP_INFO(KGSL_PROP_UCHE_GMEM_VADDR),
+		PROP_INFO(KGSL_PROP_SP_GENERIC_MEM),
+		PROP_INFO(KGSL_PROP_UCODE_VERSION),
+		PROP_INFO(KGSL_PROP_GPMU_VERSION),
+		PROP_INFO(KGSL_PROP_HIGHEST_BANK_BIT),
+		PROP_INFO(KGSL_PROP_DEVICE_BITNESS),
+		PROP_INFO(KGSL_PROP_DEVICE_QDSS_STM),
+		PROP_INFO(KGSL_PROP_MIN_ACCESS_LENGTH),
+		PROP_INFO(KGSL_PROP_UBWC_MODE),
+		PROP_INFO(KGSL_PROP_DEVICE_QTIMER),
+};
+
+/* the cmdstream dumped by a captured submit: */
+struct cmd {
+	uint64_t gpuaddr;      /* zero for kgsl-2d RD_CONTEXT/RD_CMDSTREAM */
+	uint32_t sizedwords;
+	uint32_t *dwords;
+};
+
+/* per-thread state.  The time the thread's in-flight ioctl started, for -t,
+ * and the cmdstream of its last captured submit, which is written to the
+ * file before the submit's RD_IOCTL:
+ */
+static struct thread {
+	uint32_t tid;
+	uint64_t timestamp;
+	int captured;
+	struct cmd *cmds;
+	unsigned int ncmds, maxcmds, next;
+} threads[256];
+
+static struct thread *get_thread(uint32_t tid)
+{
+	unsigned int i, h = tid % ARRAY_SIZE(threads);
+
+	for (i = 0; i < ARRAY_SIZE(threads); i++) {
+		unsigned int n = (h + i) % ARRAY_SIZE(threads);
+		if (!threads[n].tid || (threads[n].tid == tid)) {
+			threads[n].tid = tid;
+			return &threads[n];
+		}
+	}
+
+	/* too many threads, just share the last slot: */
+	return &threads[h];
+}
+
+static void reset_cmds(struct thread *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->ncmds; i++)
+		free(t->cmds[i].dwords);
+	t->ncmds = t->next = 0;
+	t->captured = 0;
+}
+
+/* copy the cmdstream, the buffer it is in can be updated before the
+ * submit's RD_IOCTL:
+ */
+static void add_cmd(struct thread *t, uint64_t gpuaddr,
+		const void *dwords, uint32_t sizedwords, uint32_t avail)
+{
+	struct cmd *cmd;
+
+	if (t->ncmds == t->maxcmds) {
+		t->maxcmds = max(16, t->maxcmds * 2);
+		t->cmds = realloc(t->cmds, t->maxcmds * sizeof(t->cmds[0]));
+	}
+
+	cmd = &t->cmds[t->ncmds++];
+	cmd->gpuaddr = gpuaddr;
+	cmd->sizedwords = sizedwords;
+	cmd->dwords = calloc(sizedwords, 4);
+	if (dwords)
+		memcpy(cmd->dwords, dwords, min(sizedwords, avail) * 4);
+}
+
+static const struct cmd * next_cmd(struct thread *t)
+{
+	if (t->next >= t->ncmds)
+		return NULL;
+	return &t->cmds[t->next++];
+}
+
+/* like dump_ib() in libwrap, the cmdstream is only there if the submit was
+ * captured and the buffer found:
+ */
+static void print_cmd(struct thread *t, uint64_t gpuaddr)
+{
+	const struct cmd *cmd;
+
+	if ((t->next >= t->ncmds) || (t->cmds[t->next].gpuaddr != gpuaddr))
+		return;
+
+	cmd = next_cmd(t);
+
+	printf("\t\tcmd: (%u dwords)\n", cmd->sizedwords);
+	hexdump_dwords(cmd->dwords, cmd->sizedwords);
+}
+
+/* the data logged after the arg struct: */
+struct extra {
+	const uint8_t *ptr, *end;
+};
+
+static const void * get_extra(struct extra *x, uint32_t sz)
+{
+	const void *ptr = x->ptr;
+
+	if (sz > (x->end - x->ptr))
+		return NULL;
+	x->ptr += sz;
+
+	return ptr;
+}
+
+static void issueibcmds_pre(struct thread *t, int is2d,
+		const struct kgsl_ringbuffer_issueibcmds *param, struct extra *x)
+{
+	static int dumped;
+	const struct kgsl_ibdesc *ibdesc;
+	int i;
+
+	printf("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
+	printf("\t\tflags:\t\t%08x\n", param->flags);
+	printf("\t\tnumibs:\t\t%08x\n", param->numibs);
+	printf("\t\tibdesc_addr:\t%08x\n", (uint32_t)param->ibdesc_addr);
+
+	ibdesc = get_extra(x, param->numibs * sizeof(*ibdesc));
+	if (!ibdesc)
+		return;
+
+	for (i = 0; i < param->numibs; i++) {
+		printf("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
+		printf("\t\tibdesc[%d].sizedwords:\t%08x\n", i, (uint32_t)ibdesc[i].sizedwords);
+		printf("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, (uint32_t)ibdesc[i].gpuaddr);
+		printf("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
+		if (!t->captured)
+			continue;
+		if (is2d) {
+			if (ibdesc[i].sizedwords > PACKETSIZE_STATESTREAM) {
+				const struct cmd *context = next_cmd(t);
+				const struct cmd *cmd = next_cmd(t);
+				const uint64_t *gpuaddr;
+
+				if (!context || !cmd)
+					return;
+
+				printf("\t\tcontext:\n");
+				hexdump_dwords(context->dwords, context->sizedwords);
+				printf("\t\tcmd:\n");
+				hexdump_dwords(cmd->dwords, cmd->sizedwords);
+
+				gpuaddr = get_extra(x, sizeof(*gpuaddr));
+				if (!gpuaddr)
+					return;
+				if (*gpuaddr) {
+					printf("\t\tdumping: %04d-%016"PRIx64".dat\n",
+							dumped++, *gpuaddr);
+				}
+			} else {
+				const void *dwords = get_extra(x, ibdesc[i].sizedwords * 4);
+
+				printf("\t\tWARNING: INVALID CONTEXT!\n");
+				if (!dwords)
+					return;
+				hexdump_dwords(dwords, ibdesc[i].sizedwords);
+			}
+		} else {
+			print_cmd(t, ibdesc[i].gpuaddr);
+		}
+	}
+}
+
+static void submit_commands_pre(struct thread *t,
+		const struct kgsl_submit_commands *param, struct extra *x)
+{
+	const struct kgsl_ibdesc *ibdesc;
+	int i;
+
+	printf("\t\tdrawctxt_id:\t%08x\n", param->context_id);
+	printf("\t\tflags:\t\t%08x\n", param->flags);
+	printf("\t\tnumibs:\t\t%08x\n", param->numcmds);
+
+	ibdesc = get_extra(x, param->numcmds * sizeof(*ibdesc));
+	if (!ibdesc)
+		return;
+
+	for (i = 0; i < param->numcmds; i++) {
+		printf("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
+		printf("\t\tibdesc[%d].sizedwords:\t%08x\n", i, (uint32_t)ibdesc[i].sizedwords);
+		printf("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, (uint32_t)ibdesc[i].gpuaddr);
+		printf("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
+		print_cmd(t, ibdesc[i].gpuaddr);
+	}
+}
+
+static void gpu_command_pre(struct thread *t,
+		const struct kgsl_gpu_command *param, struct extra *x)
+{
+	const struct kgsl_command_object *cmdobj;
+	int i;
+
+	printf("\t\tdrawctxt_id:\t%08x\n", param->context_id);
+	printf("\t\tflags:\t\t%08x %08x\n", (uint32_t)(param->flags >> 32), (uint32_t)param->flags);
+	printf("\t\tnumcmds:\t\t%08x\n", param->numcmds);
+
+	cmdobj = get_extra(x, param->numcmds * sizeof(*cmdobj));
+	if (!cmdobj)
+		return;
+
+	for (i = 0; i < param->numcmds; i++) {
+		printf("\t\tcmd[%d].flags:\t\t%08x\n", i, cmdobj[i].flags);
+		printf("\t\tcmd[%d].sizedwords:\t%08x\n", i, (uint32_t)cmdobj[i].size / 4);
+		printf("\t\tcmd[%d].gpuaddr:\t%08x\n", i, (uint32_t)cmdobj[i].gpuaddr);
+		print_cmd(t, cmdobj[i].gpuaddr);
+	}
+}
+
+static void getproperty_post(const struct kgsl_device_getproperty *param,
+		struct extra *x)
+{
+	const char *typename =
+		(param->type < ARRAY_SIZE(propnames)) ? propnames[param->type] : NULL;
+	const void *value;
+
+	printf("\t\ttype:\t\t%08x (%s)\n", param->type,
+			typename ? typename : "unknown");
+	if (param->type == KGSL_PROP_DEVICE_INFO) {
+		const struct kgsl_devinfo *devinfo;
+		const uint32_t *emulated = get_extra(x, sizeof(*emulated));
+		uint32_t gpu_id;
+
+		if (!emulated || (param->sizebytes < sizeof(*devinfo)) ||
+				(param->sizebytes > (x->end - x->ptr)))
+			return;
+
+		devinfo = (const void *)x->ptr;
+		if (*emulated & RD_EMULATED_GPU_ID) {
+			printf("\t\tEMULATING gpu_id: %d (%08x)!!!\n",
+					devinfo->gpu_id, devinfo->chip_id);
+		}
+		if (*emulated & RD_EMULATED_GMEM_SIZE)
+			printf("\t\tEMULATING gmem_sizebytes: %u !!!\n", (uint32_t)devinfo->gmem_sizebytes);
+		gpu_id = devinfo->gpu_id;
+		if (!gpu_id) {
+			gpu_id = ((devinfo->chip_id >> 24) & 0xff) * 100 +
+				((devinfo->chip_id >> 16) & 0xff) * 10 +
+				((devinfo->chip_id >> 8) & 0xff) * 1;
+		}
+		printf("\t\tgpu_id: %d\n", gpu_id);
+		printf("\t\tgmem_sizebytes: 0x%x\n", (uint32_t)devinfo->gmem_sizebytes);
+	}
+	value = get_extra(x, param->sizebytes);
+	if (value)
+		hexdump(value, param->sizebytes);
+}
+
+/* decode the arg struct and extra data, as the libwrap pre handlers do: */
+static void decode_pre(struct thread *t, const struct rd_ioctl *ev,
+		const void *arg, struct extra *x)
+{
+	switch (_IOC_NR(ev->request)) {
+	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
+		issueibcmds_pre(t, ev->flags & RD_IOCTL_2D, arg, x);
+		break;
+	case _IOC_NR(IOCTL_KGSL_SUBMIT_COMMANDS):
+		submit_commands_pre(t, arg, x);
+		break;
+	case _IOC_NR(IOCTL_KGSL_DRAWCTXT_CREATE): {
+		const struct kgsl_drawctxt_create *param = arg;
+		printf("\t\tflags:\t\t%08x\n", param->flags);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC): {
+		const struct kgsl_sharedmem_from_vmalloc *param = arg;
+		const int *len;
+		printf("\t\tflags:\t\t%08x\n", param->flags);
+		printf("\t\thostptr:\t%08x\n", (uint32_t)param->hostptr);
+		len = get_extra(x, sizeof(*len));
+		if (len)
+			printf("\t\tlen:\t\t%08x\n", *len);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FREE): {
+		const struct kgsl_sharedmem_free *param = arg;
+		printf("\t\tgpuaddr:\t%08x\n", (uint32_t)param->gpuaddr);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC): {
+		const struct kgsl_gpumem_alloc *param = arg;
+		printf("\t\tflags:\t\t%08x\n", param->flags);
+		printf("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC_ID): {
+		const struct kgsl_gpumem_alloc_id *param = arg;
+		printf("\t\tflags:\t\t%08x\n", param->flags);
+		printf("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_FREE_ID): {
+		const struct kgsl_gpumem_free_id *param = arg;
+		printf("\t\tid:\t%u\n", param->id);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_PERFCOUNTER_PUT): {
+		const struct kgsl_perfcounter_put *param = arg;
+		printf("\t\tgroupid:\t%u\n", param->groupid);
+		printf("\t\tcountable:\t%u\n", param->countable);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_ALLOC): {
+		const struct kgsl_gpuobj_alloc *param = arg;
+		printf("\t\tflags:\t\t%08x %08x\n", (uint32_t)(param->flags >> 32), (uint32_t)param->flags);
+		printf("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_FREE): {
+		const struct kgsl_gpuobj_free *param = arg;
+		printf("\t\tid:\t%u\n", param->id);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_INFO): {
+		const struct kgsl_gpuobj_info *param = arg;
+		printf("\t\tid:\t%u\n", param->id);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPU_COMMAND):
+		gpu_command_pre(t, arg, x);
+		break;
+	}
+}
+
+/* and as the post handlers do, with the arg struct as returned to the
+ * application:
+ */
+static void decode_post(const struct rd_ioctl *ev, const void *arg,
+		struct extra *x)
+{
+	switch (_IOC_NR(ev->request)) {
+	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS): {
+		const struct kgsl_ringbuffer_issueibcmds *param = arg;
+		printf("\t\ttimestamp:\t%08x\n", param->timestamp);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_SUBMIT_COMMANDS): {
+		const struct kgsl_submit_commands *param = arg;
+		printf("\t\ttimestamp:\t%08x\n", param->timestamp);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_DRAWCTXT_CREATE): {
+		const struct kgsl_drawctxt_create *param = arg;
+		printf("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_DEVICE_GETPROPERTY):
+		getproperty_post(arg, x);
+		break;
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC): {
+		const struct kgsl_sharedmem_from_vmalloc *param = arg;
+		printf("\t\tgpuaddr:\t%08x\n", (uint32_t)param->gpuaddr);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC): {
+		const struct kgsl_gpumem_alloc *param = arg;
+		printf("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC_ID): {
+		const struct kgsl_gpumem_alloc_id *param = arg;
+		printf("\t\tid:\t%u\n", param->id);
+		printf("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_PERFCOUNTER_GET): {
+		const struct kgsl_perfcounter_get *param = arg;
+		printf("\t\tgroupid:\t%u\n", param->groupid);
+		printf("\t\tcountable:\t%u\n", param->countable);
+		printf("\t\toffset_lo:\t0x%x\n", param->offset);
+		printf("\t\toffset_hi:\t0x%x\n", param->offset_hi);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_ALLOC): {
+		const struct kgsl_gpuobj_alloc *param = arg;
+		printf("\t\tid:\t%u\n", param->id);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_INFO): {
+		const struct kgsl_gpuobj_info *param = arg;
+		printf("\t\tid:\t%u\n", param->id);
+		printf("\t\tgpuaddr:\t%08lx\n", (unsigned long)param->gpuaddr);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPU_COMMAND): {
+		const struct kgsl_gpu_command *param = arg;
+		printf("\t\ttimestamp:\t%08x\n", param->timestamp);
+		break;
+	}
+	}
+}
+
+static int is_submit(uint32_t request)
+{
+	switch (_IOC_NR(request)) {
+	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
+	case _IOC_NR(IOCTL_KGSL_SUBMIT_COMMANDS):
+	case _IOC_NR(IOCTL_KGSL_GPU_COMMAND):
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* the arg struct sizes are from this build, see above: */
+static int arg_matches(uint32_t request, uint32_t argsz)
+{
+	switch (_IOC_NR(request)) {
+	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
+		return argsz == sizeof(struct kgsl_ringbuffer_issueibcmds);
+	case _IOC_NR(IOCTL_KGSL_SUBMIT_COMMANDS):
+		return argsz == sizeof(struct kgsl_submit_commands);
+	case _IOC_NR(IOCTL_KGSL_DRAWCTXT_CREATE):
+		return argsz == sizeof(struct kgsl_drawctxt_create);
+	case _IOC_NR(IOCTL_KGSL_DEVICE_GETPROPERTY):
+		return argsz == sizeof(struct kgsl_device_getproperty);
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC):
+		return argsz == sizeof(struct kgsl_sharedmem_from_vmalloc);
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FREE):
+		return argsz == sizeof(struct kgsl_sharedmem_free);
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC):
+		return argsz == sizeof(struct kgsl_gpumem_alloc);
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC_ID):
+		return argsz == sizeof(struct kgsl_gpumem_alloc_id);
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_FREE_ID):
+		return argsz == sizeof(struct kgsl_gpumem_free_id);
+	case _IOC_NR(IOCTL_KGSL_PERFCOUNTER_GET):
+		return argsz == sizeof(struct kgsl_perfcounter_get);
+	case _IOC_NR(IOCTL_KGSL_PERFCOUNTER_PUT):
+		return argsz == sizeof(struct kgsl_perfcounter_put);
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_ALLOC):
+		return argsz == sizeof(struct kgsl_gpuobj_alloc);
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_FREE):
+		return argsz == sizeof(struct kgsl_gpuobj_free);
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_INFO):
+		return argsz == sizeof(struct kgsl_gpuobj_info);
+	case _IOC_NR(IOCTL_KGSL_GPU_COMMAND):
+		return argsz == sizeof(struct kgsl_gpu_command);
+	default:
+		return 0;
+	}
+}
+
+static void print_ioctl(const struct rd_ioctl *ev, uint32_t size, int timing)
+{
+	static uint64_t first;
+	struct thread *t = get_thread(ev->tid);
+	const uint8_t *data = (const uint8_t *)(ev + 1);
+	int after = ev->flags & RD_IOCTL_AFTER;
+	int nr = _IOC_NR(ev->request);
+	const char *dev, *name = NULL;
+	const void *arg = NULL;
+	uint32_t argsz = 0;
+	struct extra x;
+
+	if (timing) {
+		if (!first)
+			first = ev->timestamp;
+
+		printf("%12.6f [%5u] ", (ev->timestamp - first) / 1000000000.0, ev->tid);
+		if (after)
+			printf("(%8.2f us) ", (ev->timestamp - t->timestamp) / 1000.0);
+		else
+			printf("%13s", "");
+		t->timestamp = ev->timestamp;
+	}
+
+	if (ev->flags & RD_IOCTL_UNKNOWN) {
+		if (after) {
+			printf("< [%4d]         : <unknown> (%08x) (%d)\n",
+					ev->fd, ev->request, ev->ret);
+		} else {
+			printf("> [%4d]         : <unknown> (%08x)\n",
+					ev->fd, ev->request);
+		}
+		return;
+	}
+
+	if (ev->flags & RD_IOCTL_2D) {
+		dev = "kgsl-2d";
+		if (nr < ARRAY_SIZE(kgsl_2d_ioctls))
+			name = kgsl_2d_ioctls[nr];
+	} else {
+		dev = "kgsl-3d";
+		if (nr < ARRAY_SIZE(kgsl_3d_ioctls))
+			name = kgsl_3d_ioctls[nr];
+	}
+
+	if (!name)
+		name = "<unknown>";
+
+	printf("%c [%4d] %8s: %s (%08x)", after ? '<' : '>', ev->fd, dev,
+			name, ev->request);
+	if (after)
+		printf(" => %d", ev->ret);
+	printf("\n");
+
+	size -= sizeof(*ev);
+
+	if ((_IOC_DIR(ev->request) & (after ? _IOC_READ : _IOC_WRITE)) &&
+			(_IOC_SIZE(ev->request) <= size)) {
+		arg = data;
+		argsz = _IOC_SIZE(ev->request);
+		hexdump(arg, argsz);
+	}
+
+	if (arg && arg_matches(ev->request, argsz)) {
+		x.ptr = data + argsz;
+		x.end = data + size;
+
+		if (!after) {
+			decode_pre(t, ev, arg, &x);
+		} else {
+			/* the fixed up arg struct is last: */
+			if ((ev->flags & RD_IOCTL_FIXUP) && ((x.end - x.ptr) >= argsz)) {
+				x.end -= argsz;
+				arg = x.end;
+			}
+			decode_post(ev, arg, &x);
+		}
+	}
+
+	/* this submit's cmdstream is used up: */
+	if (!after && is_submit(ev->request))
+		reset_cmds(t);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t] FILE\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct rd_buffers *bufs;
+	struct rd_section sect;
+	struct rd_file *f;
+	struct thread *submit = NULL;   /* whose submit is being read */
+	void *ev = NULL;
+	uint32_t evsize = 0;
+	int opt, ret, timing = 0;
+
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		switch (opt) {
+		case 't':
+			timing = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != (argc - 1))
+		usage(argv[0]);
+
+	f = rd_file_open(argv[optind]);
+	if (!f) {
+		fprintf(stderr, "could not open: %s\n", argv[optind]);
+		return 1;
+	}
+
+	bufs = rd_buffers_new();
+
+	while ((ret = rd_file_next(f, &sect)) == 1) {
+		switch (sect.type) {
+		case RD_BUFFER_CONTENTS:
+			rd_buffers_set(bufs, sect.gpuaddr, sect.payload, sect.size);
+			break;
+		case RD_SUBMIT_SEQ: {
+			const struct rd_submit_seq *seq = sect.payload;
+			if (sect.size < sizeof(*seq))
+				break;
+			submit = get_thread(seq->tid);
+			reset_cmds(submit);
+			submit->captured = 1;
+			break;
+		}
+		case RD_CMDSTREAM_ADDR: {
+			const uint32_t *dwords = sect.payload;
+			uint64_t gpuaddr, base;
+			const void *data;
+			uint32_t len = 0;
+
+			if (!submit || (sect.size < 8))
+				break;
+
+			gpuaddr = dwords[0];
+			if (sect.size >= 12)
+				gpuaddr |= (uint64_t)dwords[2] << 32;
+
+			data = rd_buffers_find(bufs, gpuaddr, &base, &len);
+			if (data) {
+				data = (const uint8_t *)data + (gpuaddr - base);
+				len -= gpuaddr - base;
+			}
+			add_cmd(submit, gpuaddr, data, dwords[1], len / 4);
+			break;
+		}
+		case RD_CONTEXT:
+		case RD_CMDSTREAM:
+			/* kgsl-2d submits: */
+			if (submit)
+				add_cmd(submit, 0, sect.payload, sect.size / 4, sect.size / 4);
+			break;
+		case RD_IOCTL:
+			submit = NULL;
+			if (sect.size < sizeof(struct rd_ioctl))
+				break;
+			/* an aligned copy, to decode the arg structs in place: */
+			if (sect.size > evsize) {
+				evsize = sect.size;
+				free(ev);
+				ev = malloc(evsize);
+			}
+			memcpy(ev, sect.payload, sect.size);
+			print_ioctl(ev, sect.size, timing);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "warning: truncated or corrupt file\n");
+
+	free(ev);
+	rd_buffers_free(bufs);
+	rd_file_close(f);
+
+	return 0;
+}
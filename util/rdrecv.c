@@ -0,0 +1,175 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Receive rd files streamed live by libwrap (WRAP_STREAM=SOCKET), and write
+ * each of them out as a file:
+ *
+ *   rdrecv SOCKET              - write each stream to stream-NNNN.rd
+ *   rdrecv -p PREFIX SOCKET    - write each stream to PREFIX-NNNN.rd
+ *
+ * A leading '@' in SOCKET means a socket in the abstract namespace.  Each
+ * rd file started by libwrap is a new connection, and connections are
+ * handled concurrently, so several traced processes can stream at once.
+ * This is a stand-in for a consumer that decodes the stream as it arrives.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void receive(int sock, const char *path)
+{
+	static char buf[0x100000];
+	unsigned long long total = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	while ((n = read(sock, buf, sizeof(buf))) != 0) {
+		char *p = buf;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: read error: %s\n", path, strerror(errno));
+			break;
+		}
+
+		total += n;
+		while (n > 0) {
+			ssize_t ret = write(fd, p, n);
+			if (ret < 0) {
+				fprintf(stderr, "%s: write error: %s\n", path, strerror(errno));
+				close(fd);
+				return;
+			}
+			p += ret;
+			n -= ret;
+		}
+	}
+
+	close(fd);
+	printf("%s: %llu bytes\n", path, total);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-p PREFIX] SOCKET\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr = {
+			.sun_family = AF_UNIX,
+	};
+	const char *prefix = "stream";
+	const char *path;
+	unsigned int cnt = 0;
+	int opt, sock;
+
+	while ((opt = getopt(argc, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			prefix = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+
+	path = argv[optind];
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return 1;
+	}
+
+	strcpy(addr.sun_path, path);
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+	else
+		unlink(path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((sock == -1) ||
+			bind(sock, (struct sockaddr *)&addr,
+					offsetof(struct sockaddr_un, sun_path) + strlen(path)) ||
+			listen(sock, 16)) {
+		fprintf(stderr, "could not listen on %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	/* no zombies: */
+	signal(SIGCHLD, SIG_IGN);
+
+	printf("listening on %s\n", path);
+	fflush(stdout);
+
+	for (;;) {
+		char name[256];
+		int conn = accept(sock, NULL, NULL);
+
+		if (conn == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		snprintf(name, sizeof(name), "%s-%04u.rd", prefix, cnt++);
+
+		switch (fork()) {
+		case 0:
+			close(sock);
+			receive(conn, name);
+			fflush(stdout);
+			_exit(0);
+		case -1:
+			/* no process to spare, so just do it ourselves: */
+			receive(conn, name);
+			fflush(stdout);
+			break;
+		}
+
+		close(conn);
+	}
+
+	return 0;
+}
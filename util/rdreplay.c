@@ -0,0 +1,337 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replay the submits in a rd file, against the device emulated by
+ * libwrapfake.so:
+ *
+ *   LD_PRELOAD=libwrapfake.so rdreplay FILE
+ *   LD_PRELOAD=libwrapfake.so rdreplay -l LOOPS FILE
+ *
+ * Buffers are recreated at the gpuaddrs they were captured at (the fake
+ * device honors a preset gpuaddr in IOCTL_KGSL_GPUMEM_ALLOC_ID), their
+ * contents uploaded, and the recorded cmdstream submitted again through
+ * IOCTL_KGSL_SUBMIT_COMMANDS.  So libwrap sees the same ioctls that the
+ * captured process made, which gives a deterministic way to benchmark the
+ * capture pipeline with no GPU.  The capture libwrap writes of the replay
+ * should decode the same as the original.
+ *
+ * WRAP_GPU_ID defaults to the gpu-id in the rd file.
+ * With -l, the file is replayed LOOPS times, reusing the buffers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#define __user
+#include "msm_kgsl.h"
+
+#include "redump.h"
+#include "rdfile.h"
+
+struct bo {
+	uint64_t gpuaddr;
+	uint64_t size;
+	uint32_t id;
+	uint64_t mmapsize;
+	void *map;
+};
+
+/* sorted by gpuaddr, and non-overlapping: */
+static struct bo *bos;
+static unsigned int nbos, bos_size;
+
+static int dev = -1;
+static uint32_t ctx;
+
+static struct kgsl_ibdesc *ibs;
+static unsigned int nibs, ibs_size;
+
+static unsigned int nsubmits;
+static uint64_t nbytes;
+
+/* index of the first bo ending after gpuaddr: */
+static unsigned int bo_search(uint64_t gpuaddr)
+{
+	unsigned int lo = 0, hi = nbos;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if ((bos[mid].gpuaddr + bos[mid].size) <= gpuaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void bo_free(unsigned int i)
+{
+	struct kgsl_gpumem_free_id req = {
+			.id = bos[i].id,
+	};
+
+	munmap(bos[i].map, bos[i].mmapsize);
+	ioctl(dev, IOCTL_KGSL_GPUMEM_FREE_ID, &req);
+
+	nbos--;
+	memmove(&bos[i], &bos[i + 1], (nbos - i) * sizeof(bos[0]));
+}
+
+static void dev_open(void)
+{
+	struct kgsl_devinfo devinfo = {0};
+	struct kgsl_device_getproperty prop = {
+			.type      = KGSL_PROP_DEVICE_INFO,
+			.value     = &devinfo,
+			.sizebytes = sizeof(devinfo),
+	};
+	struct kgsl_drawctxt_create req = {0};
+
+	/* the gmem size is not captured, and doesn't matter for replay, but the
+	 * fake device insists on one:
+	 */
+	setenv("WRAP_GMEM_SIZE", "0x100000", 0);
+
+	dev = open("/dev/kgsl-3d0", O_RDWR);
+	if (dev < 0) {
+		fprintf(stderr, "could not open /dev/kgsl-3d0\n");
+		exit(1);
+	}
+
+	/* like a real driver would, which also gets the gpu-id captured: */
+	ioctl(dev, IOCTL_KGSL_DEVICE_GETPROPERTY, &prop);
+
+	if (ioctl(dev, IOCTL_KGSL_DRAWCTXT_CREATE, &req)) {
+		fprintf(stderr, "could not create context\n");
+		exit(1);
+	}
+
+	ctx = req.drawctxt_id;
+}
+
+/* find the bo that the captured buffer was in, or (re)create it: */
+static struct bo * bo_get(uint64_t gpuaddr, uint64_t size)
+{
+	struct kgsl_gpumem_alloc_id req = {
+			.size    = size,
+			.gpuaddr = gpuaddr,
+	};
+	unsigned int i = bo_search(gpuaddr);
+	struct bo *bo;
+
+	if ((i < nbos) && (bos[i].gpuaddr <= gpuaddr) &&
+			((gpuaddr + size) <= (bos[i].gpuaddr + bos[i].size)))
+		return &bos[i];
+
+	/* the buffer was freed and something else allocated in its place: */
+	while ((i < nbos) && (bos[i].gpuaddr < (gpuaddr + size)))
+		bo_free(i);
+
+	if (dev < 0)
+		dev_open();
+
+	if (ioctl(dev, IOCTL_KGSL_GPUMEM_ALLOC_ID, &req) || (req.gpuaddr != gpuaddr)) {
+		fprintf(stderr, "could not allocate %"PRIx64" bytes at %016"PRIx64"\n",
+				size, gpuaddr);
+		exit(1);
+	}
+
+	if (nbos == bos_size) {
+		bos_size = bos_size ? bos_size * 2 : 64;
+		bos = realloc(bos, bos_size * sizeof(bos[0]));
+	}
+
+	memmove(&bos[i + 1], &bos[i], (nbos - i) * sizeof(bos[0]));
+	nbos++;
+
+	bo = &bos[i];
+	bo->gpuaddr = gpuaddr;
+	bo->size = size;
+	bo->id = req.id;
+	bo->mmapsize = req.mmapsize;
+	bo->map = mmap(NULL, req.mmapsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+			dev, (off_t)req.id << 12);
+	if (bo->map == MAP_FAILED) {
+		fprintf(stderr, "could not map buffer at %016"PRIx64"\n", gpuaddr);
+		exit(1);
+	}
+
+	return bo;
+}
+
+static void submit(void)
+{
+	struct kgsl_submit_commands req = {
+			.context_id = ctx,
+			.cmdlist    = ibs,
+			.numcmds    = nibs,
+	};
+
+	if (!nibs)
+		return;
+
+	if (ioctl(dev, IOCTL_KGSL_SUBMIT_COMMANDS, &req))
+		fprintf(stderr, "submit %u failed\n", nsubmits);
+
+	nsubmits++;
+	nibs = 0;
+}
+
+static void replay_section(const struct rd_section *sect)
+{
+	const uint32_t *dwords = sect->payload;
+	struct bo *bo;
+	char val[32];
+
+	/* the recorded IBs are submitted once the next submit starts: */
+	if (sect->type != RD_CMDSTREAM_ADDR)
+		submit();
+
+	switch (sect->type) {
+	case RD_GPU_ID:
+		snprintf(val, sizeof(val), "%u", dwords[0]);
+		setenv("WRAP_GPU_ID", val, 0);
+		break;
+	case RD_BUFFER_CONTENTS:
+		if (!sect->size)
+			break;
+		bo = bo_get(sect->gpuaddr, sect->size);
+		memcpy((uint8_t *)bo->map + (sect->gpuaddr - bo->gpuaddr),
+				sect->payload, sect->size);
+		nbytes += sect->size;
+		break;
+	case RD_CMDSTREAM_ADDR: {
+		uint64_t gpuaddr = dwords[0];
+		uint32_t sizedwords = dwords[1];
+		unsigned int i;
+
+		if (sect->size >= 12)
+			gpuaddr |= (uint64_t)dwords[2] << 32;
+
+		i = bo_search(gpuaddr);
+		if ((i >= nbos) || (bos[i].gpuaddr > gpuaddr)) {
+			fprintf(stderr, "no buffer for cmdstream at %016"PRIx64"\n", gpuaddr);
+			break;
+		}
+
+		if (nibs == ibs_size) {
+			ibs_size = ibs_size ? ibs_size * 2 : 16;
+			ibs = realloc(ibs, ibs_size * sizeof(ibs[0]));
+		}
+
+		ibs[nibs++] = (struct kgsl_ibdesc){
+			.gpuaddr    = gpuaddr,
+			.hostptr    = (uint8_t *)bos[i].map + (gpuaddr - bos[i].gpuaddr),
+			.sizedwords = sizedwords,
+		};
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-l LOOPS] FILE\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct rd_section sect;
+	struct rd_file *f;
+	unsigned int loop, loops = 1;
+	double elapsed = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		switch (opt) {
+		case 'l':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != (argc - 1))
+		usage(argv[0]);
+
+	for (loop = 0; loop < loops; loop++) {
+		double start;
+
+		/* (re)opening, and decompressing, the file is not timed: */
+		f = rd_file_open(argv[optind]);
+		if (!f) {
+			fprintf(stderr, "could not open: %s\n", argv[optind]);
+			return 1;
+		}
+
+		start = now();
+
+		while ((ret = rd_file_next(f, &sect)) == 1)
+			replay_section(&sect);
+		submit();
+
+		elapsed += now() - start;
+
+		if (ret < 0)
+			fprintf(stderr, "warning: truncated or corrupt file\n");
+
+		rd_file_close(f);
+	}
+
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	fprintf(stderr, "%u submits, %.1f MB of buffer contents in %.3fs: "
+			"%.1f submits/s, %.1f MB/s\n", nsubmits, nbytes / 1e6, elapsed,
+			nsubmits / elapsed, nbytes / 1e6 / elapsed);
+
+	while (nbos > 0)
+		bo_free(nbos - 1);
+
+	if (dev >= 0)
+		close(dev);
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "redump.h"
+#include "rdz.h"
+
+struct rdz_block {
+	uint64_t offset;         /* of the compressed data in the file */
+	uint64_t uoffset;        /* of the block in the uncompressed file */
+	uint32_t zsize, size;
+	int inflated;
+};
+
+struct rdz {
+	int fd;
+	struct rdz_block *blocks;
+	uint32_t nblocks;
+	uint8_t *zbuf;
+};
+
+int rdz_compressed(int fd)
+{
+	uint32_t magic;
+
+	return (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic)) &&
+			(magic == RD_COMPRESSED_MAGIC);
+}
+
+struct rdz * rdz_open(int fd, uint64_t *size)
+{
+	struct rdz *z = calloc(1, sizeof(*z));
+	uint64_t off = sizeof(uint32_t), uoff = 0;
+	uint32_t hdr[2], max = 0;
+	struct stat st;
+
+	z->fd = fd;
+
+	if (fstat(fd, &st))
+		goto fail;
+
+	while (pread(fd, hdr, sizeof(hdr), off) == sizeof(hdr)) {
+		struct rdz_block *b;
+
+		if ((hdr[0] > compressBound(RD_COMPRESSED_BLOCK)) ||
+				(hdr[1] > RD_COMPRESSED_BLOCK)) {
+			fprintf(stderr, "corrupt compressed block\n");
+			goto fail;
+		}
+
+		off += sizeof(hdr);
+		if (hdr[0] > (st.st_size - off))
+			break;
+
+		if (z->nblocks == max) {
+			max = max ? max * 2 : 256;
+			z->blocks = realloc(z->blocks, max * sizeof(z->blocks[0]));
+		}
+
+		b = &z->blocks[z->nblocks++];
+		b->offset   = off;
+		b->uoffset  = uoff;
+		b->zsize    = hdr[0];
+		b->size     = hdr[1];
+		b->inflated = 0;
+
+		off  += hdr[0];
+		uoff += hdr[1];
+	}
+
+	z->zbuf = malloc(compressBound(RD_COMPRESSED_BLOCK));
+	*size = uoff;
+
+	return z;
+
+fail:
+	rdz_close(z);
+	return NULL;
+}
+
+void rdz_close(struct rdz *z)
+{
+	if (!z)
+		return;
+
+	close(z->fd);
+	free(z->blocks);
+	free(z->zbuf);
+	free(z);
+}
+
+/* find the block containing the given uncompressed offset: */
+static uint32_t find_block(struct rdz *z, uint64_t off)
+{
+	uint32_t lo = 0, hi = z->nblocks;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if ((z->blocks[mid].uoffset + z->blocks[mid].size) <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int inflate_block(struct rdz *z, struct rdz_block *b, uint8_t *map)
+{
+	uLongf len = b->size;
+
+	if ((pread(z->fd, z->zbuf, b->zsize, b->offset) != b->zsize) ||
+			(uncompress(map + b->uoffset, &len, z->zbuf, b->zsize) != Z_OK) ||
+			(len != b->size)) {
+		fprintf(stderr, "corrupt compressed block\n");
+		return -1;
+	}
+
+	b->inflated = 1;
+
+	return 0;
+}
+
+int rdz_fill(struct rdz *z, void *map, uint64_t off, uint64_t len)
+{
+	uint32_t i;
+
+	for (i = find_block(z, off); i < z->nblocks; i++) {
+		struct rdz_block *b = &z->blocks[i];
+
+		if (b->uoffset >= (off + len))
+			break;
+		if (!b->inflated && inflate_block(z, b, map))
+			return -1;
+	}
+
+	return 0;
+}
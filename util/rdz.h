@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RDZ_H_
+#define RDZ_H_
+
+#include <stdint.h>
+
+/* Random access to compressed rd files (see WRAP_COMPRESS).  Only the block
+ * headers are read when the file is opened, and blocks are inflated on
+ * demand, the first time something in them is accessed, so that seeking to
+ * a submit or reading the index does not decompress the whole file.
+ */
+
+struct rdz;
+
+/* returns 1 if the file starts with RD_COMPRESSED_MAGIC: */
+int rdz_compressed(int fd);
+
+/* build the block table, returning the uncompressed size in *size.  Takes
+ * ownership of the fd.  A truncated last block (ie. the process was killed
+ * while writing it) is dropped, returns NULL if the file is corrupt.
+ */
+struct rdz * rdz_open(int fd, uint64_t *size);
+void rdz_close(struct rdz *z);
+
+/* inflate any blocks overlapping [off, off + len) of the uncompressed file
+ * into the corresponding range of map, which must be (at least) the
+ * uncompressed size.  Returns -1 if a block is corrupt.
+ */
+int rdz_fill(struct rdz *z, void *map, uint64_t off, uint64_t len);
+
+#endif /* RDZ_H_ */
@@ -29,8 +29,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <getopt.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "redump.h"
+#include "rdfile.h"
 
 static const uint32_t patterns[] = {
 		/* these should be ordered by most inclusive pattern, ie. most 'f's */
@@ -123,218 +131,686 @@ struct param {
 	uint32_t val, bitlen;
 };
 
+/*
+ * Open addressing hash set of indices into some array (gpuaddrs, params),
+ * so that lookups don't need to scan the whole array.  The slots store
+ * index + 1, so zero is an empty slot.
+ */
+struct index_set {
+	int      *slots;
+	unsigned  size;          /* always a power of two */
+};
+
+struct param_block;
+
 struct context {
-	int       fd;
-	uint32_t *buf;           /* current row buffer */
+	struct rd_file *file;
+	const uint32_t *buf;     /* current row buffer */
 	int       sz;            /* current row buffer size */
-	uint32_t  gpuaddrs[32];
-	int       ngpuaddrs;
-	struct param params[32];
-	int       nparams;
+	uint32_t *gpuaddrs;      /* in order seen, the index picks the color */
+	int       ngpuaddrs, gpuaddrs_size;
+	struct index_set gpuaddr_set;
+	struct param *params;
+	int       nparams, params_size;
+	struct index_set param_set;
+	int      *aligned;       /* per alignment row, dword index or -1 */
+	int       aligned_size;
+	struct param_block *blk; /* param matches for the current block */
 };
 
-struct context ctxts[64];
+struct context *ctxts;
 int nctxts;
-typedef int offsets_t[ARRAY_SIZE(ctxts)];
+
+static uint32_t hash_u32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static void index_set_reset(struct index_set *set, unsigned size)
+{
+	free(set->slots);
+	set->slots = calloc(size, sizeof(set->slots[0]));
+	set->size = size;
+}
+
+static void * grow_array(void *arr, int *size, int n, size_t elem)
+{
+	if (n > *size) {
+		*size = max(n, *size * 2);
+		arr = realloc(arr, *size * elem);
+	}
+	return arr;
+}
+
+static int * find_gpuaddr_slot(struct context *ctx, uint32_t gpuaddr)
+{
+	struct index_set *set = &ctx->gpuaddr_set;
+	unsigned i = hash_u32(gpuaddr);
+
+	for (;; i++) {
+		int *slot = &set->slots[i & (set->size - 1)];
+		if (!*slot || (ctx->gpuaddrs[*slot - 1] == gpuaddr))
+			return slot;
+	}
+}
+
+static int find_gpuaddr(struct context *ctx, uint32_t dword)
+{
+	int *slot;
+	if (!ctx->ngpuaddrs)
+		return -1;
+	slot = find_gpuaddr_slot(ctx, dword);
+	return *slot - 1;
+}
+
+static int add_gpuaddr(struct context *ctx, uint32_t gpuaddr)
+{
+	int i, *slot;
+
+	/* keep the set at most half full: */
+	if ((2 * (ctx->ngpuaddrs + 1)) > ctx->gpuaddr_set.size) {
+		index_set_reset(&ctx->gpuaddr_set, max(64, 2 * ctx->gpuaddr_set.size));
+		for (i = 0; i < ctx->ngpuaddrs; i++)
+			*find_gpuaddr_slot(ctx, ctx->gpuaddrs[i]) = i + 1;
+	}
+
+	slot = find_gpuaddr_slot(ctx, gpuaddr);
+	if (!*slot) {
+		ctx->gpuaddrs = grow_array(ctx->gpuaddrs, &ctx->gpuaddrs_size,
+				ctx->ngpuaddrs + 1, sizeof(ctx->gpuaddrs[0]));
+		ctx->gpuaddrs[ctx->ngpuaddrs] = gpuaddr;
+		*slot = ++ctx->ngpuaddrs;
+	}
+
+	return *slot - 1;
+}
+
+static uint32_t gpuaddr_color(int idx)
+{
+	return gpuaddr_colors[idx % ARRAY_SIZE(gpuaddr_colors)];
+}
+
+static int * find_param_slot(struct context *ctx, const struct param *param)
+{
+	struct index_set *set = &ctx->param_set;
+	unsigned i = hash_u32(param->val ^ hash_u32(param->type | (param->bitlen << 16)));
+
+	for (;; i++) {
+		int *slot = &set->slots[i & (set->size - 1)];
+		struct param *other;
+		if (!*slot)
+			return slot;
+		other = &ctx->params[*slot - 1];
+		if ((other->type == param->type) && (other->val == param->val) &&
+				(other->bitlen == param->bitlen))
+			return slot;
+	}
+}
+
+/* add param, unless there is already an identical one since the last flush: */
+static void add_param(struct context *ctx, const struct param *param)
+{
+	int i, *slot;
+
+	if ((2 * (ctx->nparams + 1)) > ctx->param_set.size) {
+		index_set_reset(&ctx->param_set, max(64, 2 * ctx->param_set.size));
+		for (i = 0; i < ctx->nparams; i++)
+			*find_param_slot(ctx, &ctx->params[i]) = i + 1;
+	}
+
+	slot = find_param_slot(ctx, param);
+	if (!*slot) {
+		ctx->params = grow_array(ctx->params, &ctx->params_size,
+				ctx->nparams + 1, sizeof(ctx->params[0]));
+		ctx->params[ctx->nparams] = *param;
+		*slot = ++ctx->nparams;
+	}
+}
 
 static void handle_string(struct context *ctx)
 {
-	printf("%s", (char *)ctx->buf);
+	printf("%.*s", ctx->sz, (const char *)ctx->buf);
 }
 
 static void handle_gpuaddr(struct context *ctx)
 {
 	uint32_t gpuaddr = ctx->buf[0];
+	int idx = add_gpuaddr(ctx, gpuaddr);
 	printf("<font color=\"#%06x\"><b>%08x</b></font><br>",
-			gpuaddr_colors[ctx->ngpuaddrs], gpuaddr);
+			gpuaddr_color(idx), gpuaddr);
 	printf("(len: %x)", ctx->buf[1]);
-	ctx->gpuaddrs[ctx->ngpuaddrs++] = gpuaddr;
 }
 
-static int find_gpuaddr(struct context *ctx, uint32_t dword)
+/*
+ * Alignment of cmdstreams:
+ *
+ * To line up the corresponding dwords of cmdstreams which differ by some
+ * inserted or missing dwords, the cmdstreams are aligned into rows.  This
+ * is a progressive alignment, where each cmdstream in turn is aligned
+ * against the rows so far with a banded Needleman-Wunsch.  Each row is
+ * represented by the dword of the first cmdstream which has one, and pairs
+ * of dwords are scored by the same rules used for highlighting (matching
+ * gpuaddrs score highest, followed by the patterns in order).  So adding a
+ * cmdstream of n dwords is O(n * band), rather than trying every possible
+ * combination of offsets.
+ */
+
+#define BAND         32       /* min # of dwords either side of the diagonal */
+#define GAP_PENALTY  4
+
+enum { DIAG, UP, LEFT };
+
+static int nrows;             /* # of rows in the current alignment */
+static int *row_ctx;          /* per row, index of the representative ctxt */
+static int row_ctx_size;
+
+static int score(struct context *a, uint32_t x, struct context *b, uint32_t y)
 {
-	int i;
-	for (i = 0; i < ctx->ngpuaddrs; i++)
-		if (dword == ctx->gpuaddrs[i])
-			return i;
-	return -1;
+	int j = find_gpuaddr(a, x);
+
+	/* highest score, if both are the same gpuaddr: */
+	if (j >= 0)
+		return (j == find_gpuaddr(b, y)) ? ARRAY_SIZE(patterns) : 0;
+
+	/* followed by pattern match.. in order of priority */
+	for (j = 0; j < ARRAY_SIZE(patterns); j++)
+		if (!((x ^ y) & patterns[j]))
+			return ARRAY_SIZE(patterns) - 1 - j;
+
+	return 0;
 }
 
-static int find_pattern(uint32_t dword, int i, offsets_t offsets)
+/* align the k'th ctxt against the rows of the first k: */
+static void align_ctxt(int k)
 {
-	int j, k;
-	for (j = 0; j < ARRAY_SIZE(patterns); j++) {
-		int found = 1;
-		uint32_t pattern = patterns[j];
-		for (k = 0; k < nctxts; k++) {
-			uint32_t other_dword = ctxts[k].buf[i - offsets[k]];
-			if ((dword & pattern) != (other_dword & pattern)) {
-				found = 0;
-				break;
+	struct context *ctx = &ctxts[k];
+	int n = nrows, m = ctx->sz / 4;
+	int band = max(BAND, (n ? (m / n) : m) + 2);
+	int width = 2 * band + 1;
+	int *prev = malloc(width * sizeof(int));
+	int *cur = malloc(width * sizeof(int));
+	uint8_t *dirs = malloc((size_t)(n + 1) * width);
+	int *moves = malloc((n + m) * sizeof(int));
+	int *new_row_ctx, *tmp;
+	int i, j, c, nmoves = 0;
+
+/* first j in the band for row i, which is centered on the diagonal: */
+#define LO(i) ((n ? (int)((int64_t)(i) * m / n) : 0) - band)
+#define IN_BAND(i, j) (((j) >= LO(i)) && ((j) < (LO(i) + width)))
+
+	for (i = 0; i <= n; i++) {
+		int lo = LO(i), plo = LO(i - 1);
+		struct context *rctx = i ? &ctxts[row_ctx[i - 1]] : NULL;
+		uint32_t rdword = i ? rctx->buf[rctx->aligned[i - 1]] : 0;
+
+		for (c = 0; c < width; c++) {
+			int best = INT32_MIN / 2, dir = DIAG, v;
+
+			j = lo + c;
+			if ((j < 0) || (j > m)) {
+				cur[c] = best;
+				continue;
+			}
+
+			if (!i && !j)
+				best = 0;
+
+			if (i && j && IN_BAND(i - 1, j - 1)) {
+				v = prev[j - 1 - plo] + score(rctx, rdword, ctx, ctx->buf[j - 1]);
+				if (v > best) {
+					best = v;
+					dir = DIAG;
+				}
+			}
+
+			if (i && IN_BAND(i - 1, j)) {
+				v = prev[j - plo] - GAP_PENALTY;
+				if (v > best) {
+					best = v;
+					dir = UP;
+				}
 			}
+
+			if (j && (c > 0)) {
+				v = cur[c - 1] - GAP_PENALTY;
+				if (v > best) {
+					best = v;
+					dir = LEFT;
+				}
+			}
+
+			cur[c] = best;
+			dirs[(size_t)i * width + c] = dir;
 		}
-		if (found)
-			return j;
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
 	}
-	return -1;
-}
 
-static int find_rank(int i, offsets_t offsets)
-{
-	int j, k, rank = 0;
-	uint32_t dword;
+	/* trace back from the end, the moves come out in reverse: */
+	for (i = n, j = m; i || j; ) {
+		int dir = dirs[(size_t)i * width + (j - LO(i))];
+		moves[nmoves++] = dir;
+		if (dir != LEFT)
+			i--;
+		if (dir != UP)
+			j--;
+	}
 
-	/* check if we are past the end: */
-	for (k = 0; k < nctxts; k++)
-		if (i >= (ctxts[k].sz/ 4 + offsets[k]))
-			return 0;
+#undef LO
+#undef IN_BAND
 
-	dword = ctxts[0].buf[i - offsets[0]];
+	/* and build the new rows: */
+	new_row_ctx = malloc(max(nmoves, 1) * sizeof(int));
+	for (c = 0; c <= k; c++) {
+		struct context *other = &ctxts[c];
+		int *aligned;
 
-	j = find_gpuaddr(&ctxts[0], dword);
-	if (j >= 0) {
-		/* highest rank, if all are gpuaddr: */
-		rank = ARRAY_SIZE(patterns);
-		for (k = 0; k < nctxts; k++) {
-			struct context *ctx = &ctxts[k];
-			if (j != find_gpuaddr(ctx, ctx->buf[i - offsets[k]])) {
-				rank = 0;
-				break;
+		if (!other->buf)
+			continue;
+
+		/* i is the old row for the first k ctxts, or dword for the k'th: */
+		aligned = malloc(max(nmoves, 1) * sizeof(int));
+		for (i = 0, j = 0; j < nmoves; j++) {
+			int dir = moves[nmoves - 1 - j];
+
+			if (c == k) {
+				aligned[j] = (dir != UP) ? i++ : -1;
+			} else {
+				aligned[j] = (dir != LEFT) ? other->aligned[i++] : -1;
 			}
 		}
-	} else {
-		/* followed by pattern match.. in order of priority */
-		/* TODO we need some fuzziness for partial match here.. */
-		j = find_pattern(dword, i, offsets);
-		if (j >= 0)
-			rank = ARRAY_SIZE(patterns) - 1 - j;
+
+		free(other->aligned);
+		other->aligned = aligned;
+		other->aligned_size = max(nmoves, 1);
 	}
 
-	return rank + find_rank(i + 1, offsets) / 2;
+	for (i = 0, j = 0; j < nmoves; j++) {
+		int dir = moves[nmoves - 1 - j];
+		if (dir == LEFT) {
+			new_row_ctx[j] = k;
+		} else {
+			new_row_ctx[j] = row_ctx[i++];
+		}
+	}
+
+	free(row_ctx);
+	row_ctx = new_row_ctx;
+	row_ctx_size = max(nmoves, 1);
+	nrows = nmoves;
+
+	free(prev);
+	free(cur);
+	free(dirs);
+	free(moves);
 }
 
-static int adjust_offsets_recursive(struct context *ctx, int i,
-		offsets_t offsets, int n, int max_sz)
+static void align_cmdstreams(void)
 {
-	int rank;
+	int k, first = 1;
 
-	rank = find_rank(i, offsets);
+	nrows = 0;
 
-	if (n < nctxts) {
-		int new_rank;
-		offsets_t new_offsets;
-		memcpy(new_offsets, offsets, sizeof(offsets_t));
+	for (k = 0; k < nctxts; k++) {
+		struct context *ctx = &ctxts[k];
+		int i;
+
+		if (!ctx->buf)
+			continue;
 
-		if ((ctxts[n].sz/4 + offsets[n]) < max_sz)
-			new_offsets[n] += 1;
-		new_rank = adjust_offsets_recursive(ctx, i, new_offsets, n+1, max_sz);
-		if (new_rank > rank) {
-			rank = new_rank;
-			memcpy(offsets, new_offsets, sizeof(offsets_t));
+		if (!first) {
+			align_ctxt(k);
+			continue;
 		}
-	}
 
-	return rank;
+		first = 0;
+
+		/* the first one just becomes the rows: */
+		nrows = ctx->sz / 4;
+		ctx->aligned = grow_array(ctx->aligned, &ctx->aligned_size, nrows,
+				sizeof(ctx->aligned[0]));
+		row_ctx = grow_array(row_ctx, &row_ctx_size, nrows, sizeof(row_ctx[0]));
+		for (i = 0; i < nrows; i++) {
+			ctx->aligned[i] = i;
+			row_ctx[i] = k;
+		}
+	}
 }
 
-static void adjust_offsets(struct context *ctx, int i, offsets_t offsets)
+/*
+ * Vectorized kernels for the classification of dwords:
+ *
+ * Since the patterns are all byte masks, the most inclusive pattern that
+ * the dwords of a row match only depends on which bytes are equal across
+ * all ctxts.  So the dwords of each ctxt are xor'd against the row's
+ * representative and or'd together, and the resulting set of zero bytes
+ * is looked up in a table.  Likewise, the param scan tests each shifted
+ * param value against a block of dwords at a time, giving a bitmask of
+ * the dwords which match.
+ */
+
+#define BLOCK 64              /* # of dwords in a param match block */
+
+struct param_match {
+	uint32_t mask;
+	struct param *param;
+};
+
+/* params which match each dword of a block: */
+struct param_block {
+	int start;                     /* first dword in block, or -1 */
+	int n[BLOCK];
+	struct param_match *matches[BLOCK];
+	int matches_size[BLOCK];
+};
+
+static int8_t pattern_table[16];  /* set of equal bytes -> pattern idx */
+static int8_t *row_pattern;       /* per row, pattern idx or -1 */
+static int row_pattern_size;
+
+/* diff[i] |= a[i] ^ b[i] */
+static void diff_accumulate(uint32_t *diff, const uint32_t *a,
+		const uint32_t *b, int n)
 {
-	int k;
-	int max_sz = 0;
+	int i = 0;
+#if defined(__AVX2__)
+	for (; i + 8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)&diff[i]);
+		__m256i x = _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *)&a[i]),
+				_mm256_loadu_si256((const __m256i *)&b[i]));
+		_mm256_storeu_si256((__m256i *)&diff[i], _mm256_or_si256(d, x));
+	}
+#elif defined(__SSE2__)
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i *)&diff[i]);
+		__m128i x = _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *)&a[i]),
+				_mm_loadu_si128((const __m128i *)&b[i]));
+		_mm_storeu_si128((__m128i *)&diff[i], _mm_or_si128(d, x));
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4) {
+		uint32x4_t x = veorq_u32(vld1q_u32(&a[i]), vld1q_u32(&b[i]));
+		vst1q_u32(&diff[i], vorrq_u32(vld1q_u32(&diff[i]), x));
+	}
+#endif
+	for (; i < n; i++)
+		diff[i] |= a[i] ^ b[i];
+}
 
-	for (k = 0; k < nctxts; k++)
-		if (ctxts[k].sz > max_sz)
-			max_sz = ctxts[k].sz;
+/* eq[i] = bitmask of the zero bytes in diff[i], lsb is the low byte */
+static void zero_bytes(const uint32_t *diff, uint8_t *eq, int n)
+{
+	int i = 0, j;
+#if defined(__AVX2__)
+	for (; i + 8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)&diff[i]);
+		uint32_t bits = _mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(d, _mm256_setzero_si256()));
+		for (j = 0; j < 8; j++, bits >>= 4)
+			eq[i + j] = bits & 0xf;
+	}
+#elif defined(__SSE2__)
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i *)&diff[i]);
+		uint32_t bits = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(d, _mm_setzero_si128()));
+		for (j = 0; j < 4; j++, bits >>= 4)
+			eq[i + j] = bits & 0xf;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	static const uint8_t weights[16] = {
+			1, 2, 4, 8, 1, 2, 4, 8, 1, 2, 4, 8, 1, 2, 4, 8,
+	};
+	uint8x16_t w = vld1q_u8(weights);
+	for (; i + 4 <= n; i += 4) {
+		uint8x16_t z = vceqq_u8(vld1q_u8((const uint8_t *)&diff[i]), vdupq_n_u8(0));
+		/* sum the weights of the zero bytes within each dword: */
+		uint32_t bits[4];
+		vst1q_u32(bits, vpaddlq_u16(vpaddlq_u8(vandq_u8(z, w))));
+		for (j = 0; j < 4; j++)
+			eq[i + j] = bits[j];
+	}
+#endif
+	for (; i < n; i++) {
+		uint32_t d = diff[i];
+		eq[i] = 0;
+		for (j = 0; j < 4; j++, d >>= 8)
+			if (!(d & 0xff))
+				eq[i] |= 1 << j;
+	}
+}
 
-	/* convert to dwords: */
-	max_sz /= 4;
+/* bitmask of dwords[0..n-1] for which (dword & mask) == val, n <= 64 */
+static uint64_t match_dwords(const uint32_t *dwords, int n,
+		uint32_t mask, uint32_t val)
+{
+	uint64_t bits = 0;
+	int i = 0;
+#if defined(__AVX2__)
+	__m256i m = _mm256_set1_epi32(mask), v = _mm256_set1_epi32(val);
+	for (; i + 8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)&dwords[i]);
+		__m256i c = _mm256_cmpeq_epi32(_mm256_and_si256(d, m), v);
+		bits |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(c)) << i;
+	}
+#elif defined(__SSE2__)
+	__m128i m = _mm_set1_epi32(mask), v = _mm_set1_epi32(val);
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i *)&dwords[i]);
+		__m128i c = _mm_cmpeq_epi32(_mm_and_si128(d, m), v);
+		bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(c)) << i;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	static const uint32_t weights[4] = { 1, 2, 4, 8 };
+	uint32x4_t m = vdupq_n_u32(mask), v = vdupq_n_u32(val);
+	uint32x4_t w = vld1q_u32(weights);
+	for (; i + 4 <= n; i += 4) {
+		uint32x4_t c = vceqq_u32(vandq_u32(vld1q_u32(&dwords[i]), m), v);
+		bits |= (uint64_t)vaddvq_u32(vandq_u32(c, w)) << i;
+	}
+#endif
+	for (; i < n; i++)
+		if ((dwords[i] & mask) == val)
+			bits |= (uint64_t)1 << i;
+	return bits;
+}
 
-	adjust_offsets_recursive(ctx, i, offsets, 0, max_sz);
+static void init_pattern_table(void)
+{
+	int e, j, b;
+
+	for (e = 0; e < ARRAY_SIZE(pattern_table); e++) {
+		pattern_table[e] = -1;
+		for (j = 0; j < ARRAY_SIZE(patterns); j++) {
+			uint32_t bytes = 0;
+			for (b = 0; b < 4; b++)
+				if (patterns[j] & (0xff << (8 * b)))
+					bytes |= 1 << b;
+			if ((bytes & e) == bytes) {
+				pattern_table[e] = j;
+				break;
+			}
+		}
+	}
 }
 
-static void handle_hexdump(struct context *ctx)
+/* find the most inclusive pattern that the dwords of each row match: */
+static void classify_rows(void)
 {
-	uint32_t *dwords = ctx->buf;
-	int i, j, k;
-	offsets_t offsets = {0};
-	int offset = 0;
-	int idx = -1;
+	uint32_t *ref = malloc(max(nrows, 1) * sizeof(uint32_t));
+	uint32_t *col = malloc(max(nrows, 1) * sizeof(uint32_t));
+	uint32_t *diff = calloc(max(nrows, 1), sizeof(uint32_t));
+	uint8_t *eq = malloc(max(nrows, 1));
+	int k, r;
+
+	row_pattern = grow_array(row_pattern, &row_pattern_size, nrows,
+			sizeof(row_pattern[0]));
+
+	for (r = 0; r < nrows; r++) {
+		struct context *rctx = &ctxts[row_ctx[r]];
+		ref[r] = rctx->buf[rctx->aligned[r]];
+	}
 
-	/* figure out idx: */
 	for (k = 0; k < nctxts; k++) {
-		if (&ctxts[k] == ctx) {
-			idx = k;
-			break;
+		struct context *ctx = &ctxts[k];
+
+		if (!ctx->buf)
+			continue;
+
+		/* params may have changed since the last cmdstream: */
+		if (!ctx->blk)
+			ctx->blk = calloc(1, sizeof(*ctx->blk));
+		ctx->blk->start = -1;
+
+		/* a gap matches nothing, so make it differ in every byte: */
+		for (r = 0; r < nrows; r++) {
+			int i = ctx->aligned[r];
+			col[r] = (i >= 0) ? ctx->buf[i] : ~ref[r];
 		}
+
+		diff_accumulate(diff, ref, col, nrows);
 	}
 
-	for (i = 0; i < ctx->sz/4; i++) {
-		int found = 0;
-		uint32_t dword;
-		uint32_t pattern = 0;
-		uint32_t known_pattern = 0;
-		uint32_t known_pattern_color = 0;
-		uint32_t pmasks[32];
-		uint32_t pcolors[32];
-		const char *pnames[32];
-		int nparams = 0;
-
-		/* adjust offsets for fuzzy matching: */
-		adjust_offsets(ctx, i + offset, offsets);
-		j = offsets[idx] - offset;
-		while (j--)
-			printf("<font face=\"monospace\" color=\"#000000\">........</font><br>");
-		offset = offsets[idx];
+	zero_bytes(diff, eq, nrows);
 
-		dword = dwords[i];
+	for (r = 0; r < nrows; r++)
+		row_pattern[r] = pattern_table[eq[r]];
 
-		/* check for gpu address: */
-		j = find_gpuaddr(ctx, dword);
-		if (j >= 0) {
-			printf("<font face=\"monospace\">%04x: <font color=\"#%06x\"><b>%08x</b></font> (gpuaddr)</font><br>",
-					i, gpuaddr_colors[j], dword);
+	free(ref);
+	free(col);
+	free(diff);
+	free(eq);
+}
+
+static void match_params(struct context *ctx, struct param_block *blk, int start)
+{
+	int count = min(BLOCK, ctx->sz/4 - start);
+	const uint32_t *dwords = &ctx->buf[start];
+	int j;
+
+	blk->start = start;
+	memset(blk->n, 0, sizeof(blk->n));
+
+	for (j = 0; j < ctx->nparams; j++) {
+		struct param *param = &ctx->params[j];
+		int alignedlen = ALIGN(param->bitlen, 8);
+		uint64_t m = ((uint64_t)1 << param->bitlen) - 1;
+		uint32_t val = param->val;
+		uint64_t seen = 0;
+
+		/* ignore param vals of zero, to easy for false match: */
+		if (!val)
 			continue;
+
+		/* each param matches a dword at most once, at the lowest shift: */
+		do {
+			uint64_t bits = match_dwords(dwords, count, m, val) & ~seen;
+			seen |= bits;
+			while (bits) {
+				int b = __builtin_ctzll(bits);
+				bits &= bits - 1;
+				int n = blk->n[b]++;
+				blk->matches[b] = grow_array(blk->matches[b],
+						&blk->matches_size[b], n + 1,
+						sizeof(blk->matches[b][0]));
+				blk->matches[b][n].mask  = m;
+				blk->matches[b][n].param = param;
+			}
+			m <<= alignedlen;
+			val <<= alignedlen;
+		} while (m & (uint64_t)0xffffffff);
+	}
+}
+
+/* classification of an aligned dword, shared by the output backends: */
+struct dword_info {
+	int       idx;           /* dword index in the cmdstream */
+	uint32_t  dword;
+	int       gpuaddr;       /* gpuaddr index, or -1 */
+	uint32_t  pattern;       /* bytes which match the other ctxts */
+	uint32_t  known_pattern;
+	uint32_t  known_pattern_color;
+	int       nparams;
+	const struct param_match *params; /* owned by the param block */
+};
+
+/* returns zero if the row is a gap in this ctxt: */
+static int classify_dword(struct context *ctx, int r, struct dword_info *info)
+{
+	struct param_block *blk = ctx->blk;
+	int i, j;
+
+	i = ctx->aligned[r];
+	if (i < 0)
+		return 0;
+
+	memset(info, 0, sizeof(*info));
+	info->idx = i;
+	info->dword = ctx->buf[i];
+
+	/* check for gpu address: */
+	info->gpuaddr = find_gpuaddr(ctx, info->dword);
+	if (info->gpuaddr >= 0)
+		return 1;
+
+	/* check for similarity with other ctxts: */
+	j = row_pattern[r];
+	if (j >= 0)
+		info->pattern = patterns[j];
+
+	/* check for known patterns: */
+	for (j = 0; j < ARRAY_SIZE(known_patterns); j++) {
+		if (known_patterns[j].val == (info->dword & known_patterns[j].mask)) {
+			info->known_pattern = known_patterns[j].mask;
+			info->known_pattern_color = known_patterns[j].color;
+			break;
 		}
+	}
 
-		/* check for similarity with other ctxts: */
-		j = find_pattern(dword, i + offset, offsets);
-		if (j >= 0)
-			pattern = patterns[j];
+	/* check for recognized params: */
+	if (!info->known_pattern) {
+		if ((blk->start < 0) || (i >= blk->start + BLOCK))
+			match_params(ctx, blk, i - (i % BLOCK));
+		info->nparams = blk->n[i - blk->start];
+		info->params = blk->matches[i - blk->start];
+	}
 
-		/* check for known patterns: */
-		for (j = 0; j < ARRAY_SIZE(known_patterns); j++) {
-			if (known_patterns[j].val == (dword & known_patterns[j].mask)) {
-				known_pattern = known_patterns[j].mask;
-				known_pattern_color = known_patterns[j].color;
-				break;
-			}
+	return 1;
+}
+
+static void handle_hexdump(struct context *ctx)
+{
+	struct dword_info info;
+	int i, j, k, r;
+
+	for (r = 0; r < nrows; r++) {
+		uint32_t dword;
+
+		/* gap inserted by the alignment: */
+		if (!classify_dword(ctx, r, &info)) {
+			printf("<font face=\"monospace\" color=\"#000000\">........</font><br>");
+			continue;
 		}
 
-		/* check for recognized params: */
-		if (!known_pattern) {
-			for (j = 0; j < ctx->nparams; j++) {
-				struct param *param = &ctx->params[j];
-				int alignedlen = ALIGN(param->bitlen, 8);
-				uint64_t m = (uint64_t)(1 << param->bitlen) - 1;
-				uint32_t val = param->val;
-				/* ignore param vals of zero, to easy for false match: */
-				if (!val)
-					continue;
-				do {
-					if ((dword & m) == val) {
-						int n = nparams++;
-						pmasks[n]  = m;
-						pcolors[n] = param_colors[param->type];
-						pnames[n]  = param_names[param->type];
-						break;
-					}
-					m <<= alignedlen;
-					val <<= alignedlen;
-				} while (m & (uint64_t)0xffffffff);
-			}
+		i = info.idx;
+		dword = info.dword;
+
+		if (info.gpuaddr >= 0) {
+			printf("<font face=\"monospace\">%04x: <font color=\"#%06x\"><b>%08x</b></font> (gpuaddr)</font><br>",
+					i, gpuaddr_color(info.gpuaddr), dword);
+			continue;
 		}
 
-		if (pattern || known_pattern || nparams) {
+		if (info.pattern || info.known_pattern || info.nparams) {
 			uint32_t mask = 0xff000000;
 			uint32_t shift = 24;
 
@@ -343,15 +819,15 @@ static void handle_hexdump(struct context *ctx)
 			for (k = 0; k < 4; k++, mask >>= 8, shift -= 8) {
 				uint32_t color = 0;
 
-				if (pattern & mask)
+				if (info.pattern & mask)
 					color = 0x0000ff;
 
-				if (known_pattern & mask)
-					color = known_pattern_color;
+				if (info.known_pattern & mask)
+					color = info.known_pattern_color;
 
-				for (j = 0; j < nparams; j++) {
-					if (mask & pmasks[j]) {
-						color = pcolors[j];
+				for (j = 0; j < info.nparams; j++) {
+					if (mask & info.params[j].mask) {
+						color = param_colors[info.params[j].param->type];
 						printf("<b>");
 						break;
 					}
@@ -360,19 +836,19 @@ static void handle_hexdump(struct context *ctx)
 				printf("<font color=\"#%06x\">%02x</font>",
 						color, (dword & mask) >> shift);
 
-				for (j = 0; j < nparams; j++) {
-					if (mask & pmasks[j]) {
+				for (j = 0; j < info.nparams; j++) {
+					if (mask & info.params[j].mask) {
 						printf("</b>");
 						break;
 					}
 				}
 			}
-			if (nparams > 0) {
+			if (info.nparams > 0) {
 				printf(" (");
-				for (j = 0; j < nparams; j++) {
+				for (j = 0; j < info.nparams; j++) {
 					if (j != 0)
 						printf(", ");
-					printf("%s", pnames[j]);
+					printf("%s", param_names[info.params[j].param->type]);
 				}
 				printf("?)");
 			}
@@ -389,30 +865,46 @@ static void handle_context(struct context *ctx)
 	/* ignore for now */
 }
 
+static void handle_buffer(struct context *ctx)
+{
+	/* ignore for now */
+}
+
 static void handle_cmdstream(struct context *ctx)
 {
 	handle_hexdump(ctx);
 }
 
-static void handle_param(struct context *ctx)
+static struct param get_param(struct context *ctx)
 {
-	struct param *param = &ctx->params[ctx->nparams++];
-	param->type   = ctx->buf[0];
-	param->val    = ctx->buf[1];
-	param->bitlen = ctx->buf[2];
-	printf("%s<br>", param_names[param->type]);
-	printf("<font color=\"#%06x\"><b>%08x</b></font><br>",
-			param_colors[param->type], param->val);
-	printf("(bitlen: %d)", param->bitlen);
-	if (param->val >= (1 << param->bitlen)) {
+	struct param param = {
+			.type   = ctx->buf[0],
+			.val    = ctx->buf[1],
+			.bitlen = ctx->buf[2],
+	};
+	if (param.val >= (1 << param.bitlen)) {
 		fprintf(stderr, "invalid param: %08x (name: %s, bitlen: %d)\n",
-				param->val, param_names[param->type], param->bitlen);
+				param.val, param_names[param.type], param.bitlen);
 	}
+	add_param(ctx, &param);
+	return param;
+}
+
+static void handle_param(struct context *ctx)
+{
+	struct param param = get_param(ctx);
+	printf("%s<br>", param_names[param.type]);
+	printf("<font color=\"#%06x\"><b>%08x</b></font><br>",
+			param_colors[param.type], param.val);
+	printf("(bitlen: %d)", param.bitlen);
 }
 
 static void handle_flush(struct context *ctx)
 {
 	ctx->nparams = 0;
+	if (ctx->param_set.size)
+		memset(ctx->param_set.slots, 0,
+				ctx->param_set.size * sizeof(ctx->param_set.slots[0]));
 }
 
 static void (*sect_handlers[])(struct context *ctx) = {
@@ -423,6 +915,8 @@ static void (*sect_handlers[])(struct context *ctx) = {
 	[RD_CMDSTREAM] = handle_cmdstream,
 	[RD_PARAM] = handle_param,
 	[RD_FLUSH] = handle_flush,
+	[RD_BUFFER_CONTENTS] = handle_buffer,
+	[RD_INDEX] = handle_buffer,
 };
 
 static const char *sect_names[] = {
@@ -433,48 +927,446 @@ static const char *sect_names[] = {
 	[RD_CMDSTREAM] = "cmdstream",
 	[RD_PARAM]     = "param",
 	[RD_FLUSH]     = "flush",
+	[RD_BUFFER_CONTENTS] = "buffer",
+	[RD_INDEX]     = "index",
+	[RD_SUBMIT_SEQ] = "submit-seq",
+	[RD_IOCTL]     = "ioctl",
+};
+
+/*
+ * JSON lines output:
+ *
+ * One object per line, written as it is generated so memory use does not
+ * depend on the size of the input.  Each line has the section "type" and
+ * a "ctxts" array with one entry per input file (null if the file has no
+ * section in this row).  Cmdstreams get one line per aligned row, with
+ * the "row" number, the "pattern" mask matched by all ctxts (or null), and
+ * per ctxt the dword "idx" and "val" (null for a gap) and its classification:
+ *
+ *   {"type":"cmdstream","row":3,"pattern":4294967040,"ctxts":[
+ *       {"idx":3,"val":1073742453,"params":[{"name":"bw","mask":4095}]},
+ *       {"idx":5,"val":1073742454,"params":[]}]}
+ *
+ * (wrapped here for readability), where gpuaddrs have a "gpuaddr" index
+ * instead of the pattern/known/params fields.
+ */
+
+static void json_string(const char *str, int len)
+{
+	int i;
+
+	putchar('"');
+	for (i = 0; (i < len) && str[i]; i++) {
+		unsigned char c = str[i];
+		if ((c == '"') || (c == '\\'))
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void json_string_sect(struct context *ctx)
+{
+	json_string((const char *)ctx->buf, ctx->sz);
+}
+
+static void json_gpuaddr(struct context *ctx)
+{
+	uint32_t gpuaddr = ctx->buf[0];
+	int idx = add_gpuaddr(ctx, gpuaddr);
+	printf("{\"gpuaddr\":%u,\"len\":%u,\"idx\":%d}", gpuaddr, ctx->buf[1], idx);
+}
+
+static void json_param(struct context *ctx)
+{
+	struct param param = get_param(ctx);
+	printf("{\"name\":");
+	json_string(param_names[param.type], strlen(param_names[param.type]));
+	printf(",\"val\":%u,\"bitlen\":%u}", param.val, param.bitlen);
+}
+
+static void json_flush(struct context *ctx)
+{
+	handle_flush(ctx);
+	printf("{}");
+}
+
+static void json_empty(struct context *ctx)
+{
+	printf("{}");
+}
+
+static void (*json_handlers[])(struct context *ctx) = {
+	[RD_TEST] = json_string_sect,
+	[RD_CMD]  = json_string_sect,
+	[RD_GPUADDR] = json_gpuaddr,
+	[RD_CONTEXT] = json_empty,
+	[RD_PARAM] = json_param,
+	[RD_FLUSH] = json_flush,
+	[RD_BUFFER_CONTENTS] = json_empty,
+	[RD_INDEX] = json_empty,
+};
+
+static void json_dword(struct context *ctx, int r)
+{
+	struct dword_info info;
+	int j;
+
+	if (!classify_dword(ctx, r, &info)) {
+		printf("{\"idx\":null,\"val\":null}");
+		return;
+	}
+
+	printf("{\"idx\":%d,\"val\":%u", info.idx, info.dword);
+
+	if (info.gpuaddr >= 0) {
+		printf(",\"gpuaddr\":%d}", info.gpuaddr);
+		return;
+	}
+
+	if (info.known_pattern)
+		printf(",\"known\":%u", info.known_pattern);
+
+	printf(",\"params\":[");
+	for (j = 0; j < info.nparams; j++) {
+		const char *name = param_names[info.params[j].param->type];
+		printf("%s{\"name\":", j ? "," : "");
+		json_string(name, strlen(name));
+		printf(",\"mask\":%u}", info.params[j].mask);
+	}
+	printf("]}");
+}
+
+static void json_cmdstream(void)
+{
+	int i, r;
+
+	for (r = 0; r < nrows; r++) {
+		printf("{\"type\":\"cmdstream\",\"row\":%d,\"pattern\":", r);
+		if (row_pattern[r] >= 0)
+			printf("%u", patterns[row_pattern[r]]);
+		else
+			printf("null");
+		printf(",\"ctxts\":[");
+		for (i = 0; i < nctxts; i++) {
+			struct context *ctx = &ctxts[i];
+			if (i)
+				putchar(',');
+			if (ctx->buf)
+				json_dword(ctx, r);
+			else
+				printf("null");
+		}
+		printf("]}\n");
+	}
+}
+
+static void json_row(enum rd_sect_type row_type)
+{
+	int i;
+
+	if (row_type == RD_CMDSTREAM) {
+		json_cmdstream();
+		return;
+	}
+
+	printf("{\"type\":\"%s\",\"ctxts\":[", sect_names[row_type]);
+	for (i = 0; i < nctxts; i++) {
+		struct context *ctx = &ctxts[i];
+		if (i)
+			putchar(',');
+		if (ctx->buf)
+			json_handlers[row_type](ctx);
+		else
+			printf("null");
+	}
+	printf("]}\n");
+}
+
+/*
+ * Param solver:
+ *
+ * Given captures of the same test with different params, find for each
+ * aligned dword of the cmdstream the bitfields which encode a param, ie.
+ * where the bits of the dword track the param value in every input.  The
+ * hypotheses are an encoding (the param value, optionally in units of a
+ * power of two, or off by one) plus a shift, and all 32 shifts of an
+ * encoding are tested at once as a bitmask, which is and'd across all of
+ * the inputs.  The first (simplest) encoding with any match is reported.
+ */
+
+static const struct {
+	int div;                 /* log2 of the units the field is in */
+	int bias;
+} encodings[] = {
+		{ 0,  0 },
+		{ 0, -1 },
+		{ 0,  1 },
+		{ 1,  0 },
+		{ 2,  0 },
+		{ 3,  0 },
+		{ 4,  0 },
+		{ 5,  0 },
+		{ 6,  0 },
+};
+
+/* bit n of the result is set if bits n..n+width-1 of dword equal val: */
+static uint32_t field_shifts(uint32_t dword, uint32_t val, int width)
+{
+	uint32_t bits = 0xffffffff >> (width - 1);
+	int j;
+
+	if ((width < 32) && (val >> width))
+		return 0;
+
+	for (j = 0; (j < width) && bits; j++)
+		bits &= (((val >> j) & 1) ? dword : ~dword) >> j;
+
+	return bits;
+}
+
+static int64_t encode(const struct param *param, int e)
+{
+	return (int64_t)(param->val >> encodings[e].div) + encodings[e].bias;
+}
+
+static void report_field(int json, int cmdstream, int r, const char *name,
+		int e, int shift, int width)
+{
+	struct context *rctx = &ctxts[row_ctx[r]];
+	int idx = rctx->aligned[r];
+
+	if (json) {
+		printf("{\"type\":\"field\",\"cmdstream\":%d,\"row\":%d,\"idx\":%d,"
+				"\"param\":\"%s\",\"lo\":%d,\"hi\":%d,\"div\":%d,\"bias\":%d}\n",
+				cmdstream, r, idx, name, shift, shift + width - 1,
+				encodings[e].div, encodings[e].bias);
+		return;
+	}
+
+	printf("cmdstream %d, row %d (dword %04x): bits [%d:%d] = %s",
+			cmdstream, r, idx, shift + width - 1, shift, name);
+	if (encodings[e].div)
+		printf(" >> %d", encodings[e].div);
+	if (encodings[e].bias)
+		printf(" %c %d", (encodings[e].bias < 0) ? '-' : '+', abs(encodings[e].bias));
+	printf("\n");
+}
+
+static void solve_cmdstream(int json, int cmdstream)
+{
+	const struct param **params = calloc(nctxts, sizeof(params[0]));
+	int type, i, k, r, e;
+
+	for (type = 0; type < ARRAY_SIZE(param_names); type++) {
+		int usable[ARRAY_SIZE(encodings)];
+		int nusable = 0, bitlen = 0, found = 1;
+
+		/* the param must be recorded in every input: */
+		for (k = 0; (k < nctxts) && found; k++) {
+			struct context *ctx = &ctxts[k];
+
+			params[k] = NULL;
+			if (!ctx->buf)
+				continue;
+
+			for (i = 0; i < ctx->nparams; i++) {
+				if (ctx->params[i].type == type) {
+					params[k] = &ctx->params[i];
+					break;
+				}
+			}
+
+			if (!params[k]) {
+				found = 0;
+				break;
+			}
+
+			bitlen = params[k]->bitlen;
+		}
+
+		if (!found || !bitlen || (bitlen > 32))
+			continue;
+
+		/* and the encoded values must vary across the inputs, otherwise
+		 * any constant field would match:
+		 */
+		for (e = 0; e < ARRAY_SIZE(encodings); e++) {
+			int64_t first = -1;
+			int varies = 0;
+
+			usable[e] = 1;
+			for (k = 0; k < nctxts; k++) {
+				int64_t val;
+
+				if (!params[k])
+					continue;
+
+				val = encode(params[k], e);
+				if (val < 0)
+					usable[e] = 0;
+				else if (first < 0)
+					first = val;
+				else if (val != first)
+					varies = 1;
+			}
+
+			usable[e] &= varies;
+			nusable += usable[e];
+		}
+
+		if (!nusable)
+			continue;
+
+		for (r = 0; r < nrows; r++) {
+			for (e = 0; e < ARRAY_SIZE(encodings); e++) {
+				int width = max(bitlen - encodings[e].div, 1);
+				uint32_t bits = 0xffffffff;
+
+				if (!usable[e])
+					continue;
+
+				for (k = 0; (k < nctxts) && bits; k++) {
+					struct context *ctx = &ctxts[k];
+					uint32_t dword;
+
+					if (!ctx->buf)
+						continue;
+
+					/* gaps and gpuaddrs don't encode params: */
+					if (ctx->aligned[r] < 0) {
+						bits = 0;
+						break;
+					}
+
+					dword = ctx->buf[ctx->aligned[r]];
+					if (find_gpuaddr(ctx, dword) >= 0) {
+						bits = 0;
+						break;
+					}
+
+					bits &= field_shifts(dword, encode(params[k], e), width);
+				}
+
+				if (!bits)
+					continue;
+
+				while (bits) {
+					int shift = __builtin_ctz(bits);
+					bits &= bits - 1;
+					report_field(json, cmdstream, r, param_names[type],
+							e, shift, width);
+				}
+				break;
+			}
+		}
+	}
+
+	free(params);
+}
+
+static void solve_gpuaddr(struct context *ctx)
+{
+	add_gpuaddr(ctx, ctx->buf[0]);
+}
+
+static void solve_param(struct context *ctx)
+{
+	get_param(ctx);
+}
+
+/* in solve mode, other sections are only tracked for their state: */
+static void (*solve_handlers[])(struct context *ctx) = {
+	[RD_GPUADDR] = solve_gpuaddr,
+	[RD_PARAM] = solve_param,
+	[RD_FLUSH] = handle_flush,
 };
 
+static void solve_row(enum rd_sect_type row_type, int json, int cmdstream)
+{
+	int i;
+
+	if (row_type == RD_CMDSTREAM) {
+		solve_cmdstream(json, cmdstream);
+		return;
+	}
+
+	if ((row_type >= ARRAY_SIZE(solve_handlers)) || !solve_handlers[row_type])
+		return;
+
+	for (i = 0; i < nctxts; i++)
+		if (ctxts[i].buf)
+			solve_handlers[row_type](&ctxts[i]);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-j] [-s] FILE...\n", name);
+	exit(2);
+}
+
 int main(int argc, char **argv)
 {
-	int i, n;
+	int i, n, opt, json = 0, solve = 0, ncmdstreams = 0;
+
+	while ((opt = getopt(argc, argv, "js")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		case 's':
+			solve = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
 
-	for (i = 1; i < argc; i++) {
+	if (optind >= argc)
+		usage(argv[0]);
+
+	ctxts = calloc(argc - optind, sizeof(ctxts[0]));
+	init_pattern_table();
+
+	for (i = optind; i < argc; i++) {
 		struct context *ctx = &ctxts[nctxts++];
-		ctx->fd = open(argv[i], O_RDONLY);
-		if (ctx->fd < 0) {
+		ctx->file = rd_file_open(argv[i]);
+		if (!ctx->file) {
 			fprintf(stderr, "could not open: %s\n", argv[i]);
 			return -1;
 		}
 	}
 
-	printf("<html><body><table border=\"1\">\n");
+	if (!json && !solve)
+		printf("<html><body><table border=\"1\">\n");
+
 	do {
 		enum rd_sect_type row_type = RD_NONE;
 
 		for (i = 0; i < nctxts; i++) {
 			struct context *ctx = &ctxts[i];
-			enum rd_sect_type type = RD_NONE;
+			struct rd_section sect;
+			int ret;
 
 			ctx->sz = 0;
-			free(ctx->buf);
 			ctx->buf = NULL;
 
-			if ((read(ctx->fd, &type, sizeof(type)) > 0) &&
-					(read(ctx->fd, &ctx->sz, 4) > 0)) {
+			ret = rd_file_next(ctx->file, &sect);
+			if (ret < 0)
+				return -1;
+
+			if (ret > 0) {
+				ctx->sz = sect.size;
+				ctx->buf = sect.payload;
+
 				if (row_type == RD_NONE)
-					row_type = type;
-
-				if (type == row_type) {
-					/* allocate  bit extra, because there could be some optional
-					 * words in the cmdstreams, and they might not all be the
-					 * same size..
-					 */
-					ctx->buf = calloc(1, ctx->sz + 1 + 20);
-					read(ctx->fd, ctx->buf, ctx->sz);
-					((char *)ctx->buf)[ctx->sz] = '\0';
-				} else {
-					fprintf(stderr, "unexpected type '%d', expected '%d'\n", type, row_type);
+					row_type = sect.type;
+
+				if (sect.type != row_type) {
+					fprintf(stderr, "unexpected type '%d', expected '%d'\n", sect.type, row_type);
 					return -1;
 				}
 			}
@@ -486,13 +1378,39 @@ int main(int argc, char **argv)
 			break;
 		}
 
+		/* skip sections we don't know how to display: */
+		if ((row_type >= ARRAY_SIZE(sect_handlers)) ||
+				!sect_handlers[row_type]) {
+			n = 1;
+			continue;
+		}
+
+		if (row_type == RD_CMDSTREAM) {
+			align_cmdstreams();
+			classify_rows();
+		}
+
+		if (solve) {
+			solve_row(row_type, json, ncmdstreams);
+			if (row_type == RD_CMDSTREAM)
+				ncmdstreams++;
+			n = 1;
+			continue;
+		}
+
+		if (json) {
+			json_row(row_type);
+			n = 1;
+			continue;
+		}
+
 		printf("<tr><th>%s</th>", sect_names[row_type]);
 
 		for (i = 0, n = 0; i < nctxts; i++) {
 			struct context *ctx = &ctxts[i];
 
 			printf("<td>");
-			if (ctx->sz > 0) {
+			if (ctx->buf) {
 				sect_handlers[row_type](ctx);
 				n++;
 			}
@@ -501,7 +1419,12 @@ int main(int argc, char **argv)
 
 		printf("</tr>\n");
 	} while(n > 0);
-	printf("</table></body></html>\n");
+
+	if (!json && !solve)
+		printf("</table></body></html>\n");
+
+	for (i = 0; i < nctxts; i++)
+		rd_file_close(ctxts[i].file);
 
 	return 0;
 }
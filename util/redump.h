@@ -24,6 +24,8 @@
 #ifndef REDUMP_H_
 #define REDUMP_H_
 
+#include <stdint.h>
+
 enum rd_sect_type {
 	RD_NONE,
 	RD_TEST,       /* ascii text */
@@ -39,6 +41,12 @@ enum rd_sect_type {
 	RD_FRAG_SHADER,
 	RD_BUFFER_CONTENTS,
 	RD_GPU_ID,
+	RD_BUFFER_REF, /* u32 index of earlier RD_BUFFER_CONTENTS, u32 len */
+	RD_BUFFER_DELTA, /* changes to buffer at preceding RD_GPUADDR, list of:
+	                  * u32 offset, u32 len, data (padded to 4 bytes) */
+	RD_INDEX,      /* struct rd_index_entry[], struct rd_index_trailer */
+	RD_SUBMIT_SEQ, /* struct rd_submit_seq, starts each submit */
+	RD_IOCTL,      /* struct rd_ioctl, followed by the ioctl's arg struct, etc */
 };
 
 /* RD_PARAM types: */
@@ -55,6 +63,84 @@ enum rd_param_type {
 	RD_PARAM_BLIT_Y2,      /* BLIT_Y + BLIT_WIDTH */
 };
 
+/* compressed rd files (see WRAP_COMPRESS) start with RD_COMPRESSED_MAGIC,
+ * followed by independently zlib compressed blocks of (up to)
+ * RD_COMPRESSED_BLOCK bytes of the uncompressed file, each preceded by a u32
+ * compressed size and a u32 uncompressed size:
+ */
+#define RD_COMPRESSED_MAGIC   0x7a647266   /* "frdz" */
+#define RD_COMPRESSED_BLOCK   0x100000
+
+/* the last section of an rd file is (optionally) a RD_INDEX, so readers
+ * can find the sections for a given submit or gpuaddr without parsing the
+ * whole file.  Offsets are in the uncompressed file, and point to the start
+ * of the section (including its 0xffffffff prefix).  The trailer is the
+ * last thing in the file, so the index can be found from the end:
+ */
+#define RD_INDEX_MAGIC   0x78646e69   /* "indx" */
+
+struct rd_index_entry {
+	uint64_t offset;
+	uint64_t gpuaddr;    /* for RD_GPUADDR, RD_CMDSTREAM_ADDR and buffers */
+	uint32_t len;        /* buffer/cmdstream length in bytes, likewise */
+	uint32_t type;
+	uint32_t size;       /* section payload size */
+	uint32_t submit;     /* # of submits before, or including, the section */
+};
+
+struct rd_index_trailer {
+	uint64_t offset;     /* of the RD_INDEX section */
+	uint32_t count;
+	uint32_t magic;
+};
+
+/* submits are numbered in the order they are captured, which is also the
+ * order they appear in the file, even if captured by multiple threads:
+ */
+struct rd_submit_seq {
+	uint64_t seqno;
+	uint64_t timestamp;  /* CLOCK_MONOTONIC, in ns, at start of submit */
+	uint32_t tid;
+	uint32_t pad;
+};
+
+/* with WRAP_EVLOG, ioctls are logged as a pair of RD_IOCTL sections (before
+ * and after), instead of as text.  The raw arg struct follows, if it is an
+ * input (before) or output (after) of the ioctl, then what else libwrap
+ * decodes for the ioctl:
+ *
+ *   ISSUEIBCMDS (before):     struct kgsl_ibdesc[numibs], and on kgsl-2d if
+ *                             the submit is captured, for each ib either the
+ *                             u64 gpuaddr of the buffer dumped to a .dat file
+ *                             (if the ib has a context), or the ib itself
+ *   SUBMIT_COMMANDS (before): struct kgsl_ibdesc[numcmds]
+ *   GPU_COMMAND (before):     struct kgsl_command_object[numcmds]
+ *   SHAREDMEM_FROM_VMALLOC (before): int len
+ *   GETPROPERTY (after):      for KGSL_PROP_DEVICE_INFO a u32 of
+ *                             RD_EMULATED_x, then the property value
+ *
+ * and last, with RD_IOCTL_FIXUP, the arg struct again as libwrap returned it
+ * to the application.  The cmdstream of a captured submit is written before
+ * the submit's RD_IOCTL (before).
+ */
+#define RD_IOCTL_AFTER    0x1   /* otherwise before the ioctl */
+#define RD_IOCTL_2D       0x2   /* on kgsl-2d, otherwise kgsl-3d */
+#define RD_IOCTL_UNKNOWN  0x4   /* not on a kgsl device */
+#define RD_IOCTL_FIXUP    0x8   /* arg struct changed after the ioctl */
+
+#define RD_EMULATED_GPU_ID     0x1   /* WRAP_GPU_ID */
+#define RD_EMULATED_GMEM_SIZE  0x2   /* WRAP_GMEM_SIZE */
+
+struct rd_ioctl {
+	uint64_t timestamp;  /* CLOCK_MONOTONIC, in ns */
+	uint32_t request;
+	int32_t fd;
+	int32_t ret;         /* after the ioctl only */
+	uint32_t flags;      /* RD_IOCTL_x */
+	uint32_t tid;
+	uint32_t pad;
+};
+
 void rd_start(const char *name, const char *fmt, ...) __attribute__((weak));
 void rd_end(void) __attribute__((weak));
 void rd_write_section(enum rd_sect_type type, const void *buf, int sz) __attribute__((weak));
@@ -29,8 +29,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <getopt.h>
 
 #include "redump.h"
+#include "rdfile.h"
 
 #include "freedreno_z1xx.h"
 
@@ -130,7 +132,7 @@ static void dump_register(uint32_t reg, uint32_t dword)
 		printf("\tunknown(%02x): %08x (%d)\n", reg, dword, dword);
 }
 
-static void dump_cmdstream(uint32_t *dwords, uint32_t sizedwords)
+static void dump_cmdstream(const uint32_t *dwords, uint32_t sizedwords)
 {
 	int i, j;
 	for (i = 0; i < sizedwords; i++) {
@@ -175,32 +177,25 @@ static const char *param_names[] = {
 		"",
 };
 
-static void dump_file(int fd)
+static void dump_file(struct rd_file *f)
 {
-	enum rd_sect_type type = RD_NONE;
-	void *buf = NULL;
-	int sz;
+	struct rd_section sect;
 
-	while ((read(fd, &type, sizeof(type)) > 0) && (read(fd, &sz, 4) > 0)) {
-		free(buf);
+	while (rd_file_next(f, &sect) > 0) {
+		const uint32_t *buf = sect.payload;
 
-		buf = malloc(sz + 1);
-		((char *)buf)[sz] = '\0';
-		read(fd, buf, sz);
-
-		switch(type) {
+		switch(sect.type) {
 		case RD_TEST:
-			printf("test: %s\n", (char *)buf);
+			printf("test: %.*s\n", sect.size, (const char *)buf);
 			break;
 		case RD_CMD:
-			printf("cmd: %s\n", (char *)buf);
+			printf("cmd: %.*s\n", sect.size, (const char *)buf);
 			break;
 		case RD_CMDSTREAM:
-			dump_cmdstream(buf, sz/4);
+			dump_cmdstream(buf, sect.size/4);
 			break;
 		case RD_PARAM:
-			printf("param: %s: %u\n", param_names[((uint32_t *)buf)[0]],
-					((uint32_t *)buf)[1]);
+			printf("param: %s: %u\n", param_names[buf[0]], buf[1]);
 			break;
 		default:
 			break;
@@ -210,15 +205,33 @@ static void dump_file(int fd)
 
 int main(int argc, char **argv)
 {
-	int i;
+	int i, opt, submit = -1;
+
+	/* optionally, skip ahead to the given submit: */
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			submit = strtol(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s SUBMIT] FILE...\n", argv[0]);
+			return -1;
+		}
+	}
 
-	for (i = 1; i < argc; i++) {
-		int fd = open(argv[i], O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "could not open: %s\n", argv[1]);
+	for (i = optind; i < argc; i++) {
+		struct rd_file *f = rd_file_open(argv[i]);
+		if (!f) {
+			fprintf(stderr, "could not open: %s\n", argv[i]);
 			return -1;
 		}
-		dump_file(fd);
+		if ((submit >= 0) && rd_file_seek_submit(f, submit)) {
+			fprintf(stderr, "no submit %d in: %s\n", submit, argv[i]);
+			rd_file_close(f);
+			continue;
+		}
+		dump_file(f);
+		rd_file_close(f);
 	}
 
 	return 0;
@@ -26,17 +26,45 @@
  */
 
 #include <ctype.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
 
 #include "wrap.h"
+#include "adreno_pm4.xml.h"
 
-#ifdef USE_PTHREADS
-static pthread_mutex_t l = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
-#define LOCK()   pthread_mutex_lock(&l)
-#define UNLOCK() pthread_mutex_unlock(&l)
-#else
-#define LOCK()
-#define UNLOCK()
-#endif
+/* in stats mode, nothing is logged but the summary printed on exit, and in
+ * event log mode, ioctls are logged to the rd file rather than as text.
+ * Only the ioctl trace is affected, errors are still printed:
+ */
+#define TEXT_LOG()  (!wrap_stats() && !wrap_evlog())
+#define trace(...)  (TEXT_LOG() ? printf(__VA_ARGS__) : 0)
+
+/*
+ * Locking:
+ *
+ *   + fd_lock protects updates to the file_table (lookups are lockless)
+ *   + buffers_lock protects the buffer registry, ie. the list and lookup
+ *     tables, as well as the buffers themselves.  It is taken for read to
+ *     look up or dump buffers, and for write to add/remove buffers or change
+ *     their lookup keys.
+ *   + rd_lock() serializes capture, so that sections which belong together
+ *     are not interleaved with those from other threads.  Submits are the
+ *     exception, they are staged per-thread between rd_capture_begin() and
+ *     rd_capture_end(), which takes rd_lock() to write them out in order.
+ *
+ * Lock ordering is buffers_lock before rd_lock().  The actual ioctl, and
+ * logging of ioctl params, happens without holding any of them.
+ */
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t buffers_lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int buffers_locked;   /* by the current thread */
+
+#define FD_LOCK()          pthread_mutex_lock(&fd_lock)
+#define FD_UNLOCK()        pthread_mutex_unlock(&fd_lock)
+#define BUFFERS_RDLOCK()   do { pthread_rwlock_rdlock(&buffers_lock); buffers_locked++; } while (0)
+#define BUFFERS_WRLOCK()   do { pthread_rwlock_wrlock(&buffers_lock); buffers_locked++; } while (0)
+#define BUFFERS_UNLOCK()   do { buffers_locked--; pthread_rwlock_unlock(&buffers_lock); } while (0)
 
 struct device_info {
 	const char *name;
@@ -136,6 +164,9 @@ hexdump(const void *data, int size)
 	char alpha[17];
 	int i;
 
+	if (!TEXT_LOG())
+		return;
+
 	for (i = 0; i < size; i++) {
 		if (!(i % 16))
 			printf("\t\t\t%08X", (unsigned int) i);
@@ -180,6 +211,9 @@ hexdump_dwords(const void *data, int sizedwords)
 	uint32_t *buf = (void *) data;
 	int i;
 
+	if (!TEXT_LOG())
+		return;
+
 	for (i = 0; i < sizedwords; i++) {
 		if (!(i % 8))
 			printf("\t\t\t%08X:   ", (unsigned int) i*4);
@@ -193,6 +227,109 @@ hexdump_dwords(const void *data, int sizedwords)
 }
 
 
+/*
+ * Event log (WRAP_EVLOG):
+ *
+ * Rather than printing the ioctl trace, each ioctl is logged as a pair of
+ * RD_IOCTL sections.  The arg struct is snapshotted where the text log would
+ * hexdump it, but the section is only written once the pre/post handler has
+ * run, so the handler can add what else it decodes (see log_extra()), and so
+ * that any changes it makes to the arg struct are seen.  Which lets rdlog
+ * print the same thing as the text log.
+ */
+static __thread struct {
+	struct rd_ioctl ev;
+	uint8_t *data;         /* arg struct, followed by the extra data */
+	uint32_t argsz, len, size;
+	int failed;            /* out of memory, only the rd_ioctl is logged */
+} evlog;
+
+static void log_data(const void *ptr, uint32_t len)
+{
+	if (evlog.failed)
+		return;
+
+	if ((evlog.len + len) > evlog.size) {
+		uint32_t size = 2 * (evlog.len + len);
+		uint8_t *data = realloc(evlog.data, size);
+
+		if (!data) {
+			evlog.failed = 1;
+			return;
+		}
+
+		evlog.data = data;
+		evlog.size = size;
+	}
+	memcpy(evlog.data + evlog.len, ptr, len);
+	evlog.len += len;
+}
+
+/* add data a handler decodes besides the arg struct to the current event: */
+static void log_extra(const void *ptr, uint32_t len)
+{
+	if (wrap_evlog())
+		log_data(ptr, len);
+}
+
+/* start logging the ioctl, info is NULL if not kgsl: */
+static void log_ioctl_begin(struct device_info *info, int dir, int fd,
+		unsigned long int request, void *ptr, int ret)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	evlog.ev = (struct rd_ioctl){
+			.timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+			.request   = request,
+			.fd        = fd,
+			.ret       = ret,
+			.tid       = syscall(SYS_gettid),
+	};
+	evlog.argsz = evlog.len = evlog.failed = 0;
+
+	if (dir == _IOC_READ)
+		evlog.ev.flags |= RD_IOCTL_AFTER;
+	if (!info)
+		evlog.ev.flags |= RD_IOCTL_UNKNOWN;
+	else if (info == &kgsl_2d_info)
+		evlog.ev.flags |= RD_IOCTL_2D;
+
+	if (info && ptr && (dir & _IOC_DIR(request))) {
+		evlog.argsz = _IOC_SIZE(request);
+		log_data(ptr, evlog.argsz);
+	}
+}
+
+/* write the event, once the handler has added its extra data: */
+static void log_ioctl_end(void *ptr)
+{
+	struct iovec iov[] = {
+			{ .iov_base = &evlog.ev,  .iov_len = sizeof(evlog.ev) },
+			{ .iov_base = evlog.data, .iov_len = 0 },
+	};
+
+	/* the post handler fixed up what the application gets back: */
+	if ((evlog.ev.flags & RD_IOCTL_AFTER) && evlog.argsz && !evlog.failed &&
+			memcmp(ptr, evlog.data, evlog.argsz)) {
+		evlog.ev.flags |= RD_IOCTL_FIXUP;
+		log_data(ptr, evlog.argsz);
+	}
+
+	if (!evlog.failed)
+		iov[1].iov_len = evlog.len;
+
+	rd_write_sectionv(RD_IOCTL, iov, iov[1].iov_len ? 2 : 1);
+}
+
+static void log_ioctl(struct device_info *info, int dir, int fd,
+		unsigned long int request, void *ptr, int ret)
+{
+	log_ioctl_begin(info, dir, fd, request, ptr, ret);
+	log_ioctl_end(ptr);
+}
+
 static void dump_ioctl(struct device_info *info, int dir, int fd,
 		unsigned long int request, void *ptr, int ret)
 {
@@ -201,6 +338,14 @@ static void dump_ioctl(struct device_info *info, int dir, int fd,
 	char c;
 	const char *name;
 
+	if (wrap_evlog()) {
+		log_ioctl_begin(info, dir, fd, request, ptr, ret);
+		return;
+	}
+
+	if (!TEXT_LOG())
+		return;
+
 	if (dir == _IOC_READ)
 		c = '<';
 	else
@@ -220,6 +365,186 @@ static void dump_ioctl(struct device_info *info, int dir, int fd,
 		hexdump(ptr, sz);
 }
 
+/*
+ * Stats mode (WRAP_STATS):
+ *
+ * Nothing is dumped, instead per-ioctl counts and latency histograms (time
+ * spent in the real ioctl), along with submit and buffer allocation totals,
+ * are kept and printed to stderr on exit.  Counters are updated atomically,
+ * so no locks are taken.
+ */
+
+#define STATS_BUCKETS 40   /* bucket n counts latencies < 2^n ns */
+
+static struct {
+	uint64_t count, ns, max;
+	uint64_t hist[STATS_BUCKETS];
+} ioctl_stats[_IOC_NR(0xffffffff) + 1];
+
+static struct {
+	uint64_t submits, ibs, dwords;
+	uint64_t allocs, alloc_bytes, frees;
+} stats;
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static uint64_t stats_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* upper bound, in us, of the bucket containing the given percentile: */
+static double stats_percentile(uint64_t *hist, uint64_t count, uint64_t max,
+		int pct)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		n += hist[i];
+		if ((n * 100) >= (count * pct))
+			break;
+	}
+
+	return (double)min(1ull << i, max) / 1000.0;
+}
+
+static void stats_print(void)
+{
+	int nr, i;
+
+	fprintf(stderr, "libwrap stats:\n");
+	fprintf(stderr, "  submits:   %"PRIu64"\n", stats.submits);
+	fprintf(stderr, "  ibs:       %"PRIu64"\n", stats.ibs);
+	fprintf(stderr, "  dwords:    %"PRIu64"\n", stats.dwords);
+	if (stats.submits) {
+		fprintf(stderr, "  per submit: %.1f ibs, %.1f dwords\n",
+				(double)stats.ibs / stats.submits,
+				(double)stats.dwords / stats.submits);
+	}
+	fprintf(stderr, "  bo allocs: %"PRIu64" (%"PRIu64" bytes)\n",
+			stats.allocs, stats.alloc_bytes);
+	fprintf(stderr, "  bo frees:  %"PRIu64"\n", stats.frees);
+
+	fprintf(stderr, "  %-40s %10s %12s %10s %10s %10s %10s\n", "ioctl",
+			"count", "total ms", "avg us", "p50 us", "p99 us", "max us");
+
+	for (nr = 0; nr < ARRAY_SIZE(ioctl_stats); nr++) {
+		const char *name = NULL;
+		uint64_t count = ioctl_stats[nr].count;
+
+		if (!count)
+			continue;
+
+		if (nr < ARRAY_SIZE(kgsl_3d_info.ioctl_info))
+			name = kgsl_3d_info.ioctl_info[nr].name;
+		if (!name && (nr < ARRAY_SIZE(kgsl_2d_info.ioctl_info)))
+			name = kgsl_2d_info.ioctl_info[nr].name;
+		if (!name)
+			name = "<unknown>";
+
+		fprintf(stderr, "  %-40s %10"PRIu64" %12.3f %10.2f %10.2f %10.2f %10.2f\n",
+				name, count, ioctl_stats[nr].ns / 1000000.0,
+				ioctl_stats[nr].ns / 1000.0 / count,
+				stats_percentile(ioctl_stats[nr].hist, count,
+						ioctl_stats[nr].max, 50),
+				stats_percentile(ioctl_stats[nr].hist, count,
+						ioctl_stats[nr].max, 99),
+				ioctl_stats[nr].max / 1000.0);
+
+		/* and the non-empty buckets, as log2(ns):count */
+		fprintf(stderr, "  %-40s", "");
+		for (i = 0; i < STATS_BUCKETS; i++)
+			if (ioctl_stats[nr].hist[i])
+				fprintf(stderr, " %d:%"PRIu64, i, ioctl_stats[nr].hist[i]);
+		fprintf(stderr, "\n");
+	}
+}
+
+static void stats_init(void)
+{
+	atexit(stats_print);
+}
+
+static void stats_ioctl(unsigned long int request, void *ptr, int ret,
+		uint64_t ns)
+{
+	int nr = _IOC_NR(request);
+	uint64_t max;
+	int i, bucket = 0;
+
+	pthread_once(&stats_once, stats_init);
+
+	while ((bucket < (STATS_BUCKETS - 1)) && (ns >= (1ull << bucket)))
+		bucket++;
+
+	__sync_fetch_and_add(&ioctl_stats[nr].count, 1);
+	__sync_fetch_and_add(&ioctl_stats[nr].ns, ns);
+	__sync_fetch_and_add(&ioctl_stats[nr].hist[bucket], 1);
+	while ((max = ioctl_stats[nr].max) < ns)
+		if (__sync_bool_compare_and_swap(&ioctl_stats[nr].max, max, ns))
+			break;
+
+	if (ret)
+		return;
+
+	switch (nr) {
+	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS): {
+		struct kgsl_ringbuffer_issueibcmds *param = ptr;
+		struct kgsl_ibdesc *ibdesc = (struct kgsl_ibdesc *)param->ibdesc_addr;
+		__sync_fetch_and_add(&stats.submits, 1);
+		__sync_fetch_and_add(&stats.ibs, param->numibs);
+		for (i = 0; i < param->numibs; i++)
+			__sync_fetch_and_add(&stats.dwords, ibdesc[i].sizedwords);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_SUBMIT_COMMANDS): {
+		struct kgsl_submit_commands *param = ptr;
+		struct kgsl_ibdesc *ibdesc = (struct kgsl_ibdesc *)param->cmdlist;
+		__sync_fetch_and_add(&stats.submits, 1);
+		__sync_fetch_and_add(&stats.ibs, param->numcmds);
+		for (i = 0; i < param->numcmds; i++)
+			__sync_fetch_and_add(&stats.dwords, ibdesc[i].sizedwords);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPU_COMMAND): {
+		struct kgsl_gpu_command *param = ptr;
+		struct kgsl_command_object *cmdobj = (struct kgsl_command_object *)param->cmdlist;
+		__sync_fetch_and_add(&stats.submits, 1);
+		__sync_fetch_and_add(&stats.ibs, param->numcmds);
+		for (i = 0; i < param->numcmds; i++)
+			__sync_fetch_and_add(&stats.dwords, cmdobj[i].size / 4);
+		break;
+	}
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC):
+		__sync_fetch_and_add(&stats.allocs, 1);
+		__sync_fetch_and_add(&stats.alloc_bytes,
+				((struct kgsl_gpumem_alloc *)ptr)->size);
+		break;
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC_ID):
+		__sync_fetch_and_add(&stats.allocs, 1);
+		__sync_fetch_and_add(&stats.alloc_bytes,
+				((struct kgsl_gpumem_alloc_id *)ptr)->size);
+		break;
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_ALLOC):
+		__sync_fetch_and_add(&stats.allocs, 1);
+		__sync_fetch_and_add(&stats.alloc_bytes,
+				((struct kgsl_gpuobj_alloc *)ptr)->size);
+		break;
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC):
+		/* size is implied by the vma, so not known here: */
+		__sync_fetch_and_add(&stats.allocs, 1);
+		break;
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FREE):
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_FREE_ID):
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_FREE):
+		__sync_fetch_and_add(&stats.frees, 1);
+		break;
+	}
+}
+
 static void dumpfile(const char *file)
 {
 	char buf[1024];
@@ -239,11 +564,197 @@ struct buffer {
 	uint64_t offset;
 	struct list node;
 	int munmap;
-	int dumped;
+	uint64_t dumped;         /* capture_seqno of the capture that dumped it */
+	uint32_t *dirty;         /* WRAP_DIRTY: pages written since snapshot */
+	unsigned int snapshot;   /* rd_file_id() at last full snapshot */
 };
 
 static LIST_HEAD(buffers_of_interest);
 
+/*
+ * Lookup tables for find_buffer(), so we don't have to walk the list of
+ * (potentially thousands of) buffers for every ioctl/mmap/IB:
+ *
+ *   + sorted arrays (by start address) for hostptr and gpuaddr range lookups
+ *   + open addressing hash tables for id and handle lookups
+ *
+ * Buffers only appear in a table while the corresponding field is non-zero,
+ * so the fields must only be changed via the set_xyz() helpers.  Buffers are
+ * assumed to not overlap, as is the case for both hostptr and gpuaddr.
+ */
+
+struct buffer_range {
+	uint64_t start;
+	struct buffer *buf;
+};
+
+struct buffer_ranges {
+	struct buffer_range *ranges;
+	unsigned int count, size;
+};
+
+struct buffer_hash_entry {
+	unsigned int key;          /* zero for empty slots */
+	struct buffer *buf;
+};
+
+struct buffer_hash {
+	struct buffer_hash_entry *entries;
+	unsigned int count, size;  /* size is power of two */
+};
+
+static struct buffer_ranges hostptr_ranges, gpuaddr_ranges;
+static struct buffer_hash id_hash, handle_hash;
+
+/* index of the first range starting after addr: */
+static unsigned int range_upper(struct buffer_ranges *r, uint64_t addr)
+{
+	unsigned int lo = 0, hi = r->count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (r->ranges[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void range_add(struct buffer_ranges *r, uint64_t start,
+		struct buffer *buf)
+{
+	unsigned int i;
+
+	if (!start)
+		return;
+
+	if (r->count == r->size) {
+		r->size = max(64, r->size * 2);
+		r->ranges = realloc(r->ranges, r->size * sizeof(r->ranges[0]));
+	}
+
+	/* after any existing range with the same start, so the most recently
+	 * added buffer wins, as with the list:
+	 */
+	i = range_upper(r, start);
+	memmove(&r->ranges[i + 1], &r->ranges[i],
+			(r->count - i) * sizeof(r->ranges[0]));
+	r->ranges[i].start = start;
+	r->ranges[i].buf = buf;
+	r->count++;
+}
+
+static void range_del(struct buffer_ranges *r, uint64_t start,
+		struct buffer *buf)
+{
+	unsigned int i;
+
+	if (!start)
+		return;
+
+	for (i = range_upper(r, start); i-- > 0 && r->ranges[i].start == start; ) {
+		if (r->ranges[i].buf == buf) {
+			r->count--;
+			memmove(&r->ranges[i], &r->ranges[i + 1],
+					(r->count - i) * sizeof(r->ranges[0]));
+			return;
+		}
+	}
+}
+
+static struct buffer * range_find(struct buffer_ranges *r, uint64_t addr)
+{
+	unsigned int i = range_upper(r, addr);
+	struct buffer *buf;
+
+	if (i == 0)
+		return NULL;
+
+	buf = r->ranges[i - 1].buf;
+	if (addr < (r->ranges[i - 1].start + buf->len))
+		return buf;
+
+	return NULL;
+}
+
+static inline unsigned int hash_key(unsigned int key)
+{
+	return key * 0x9e3779b1;
+}
+
+static void hash_add(struct buffer_hash *h, unsigned int key,
+		struct buffer *buf)
+{
+	unsigned int i, mask;
+
+	if (!key)
+		return;
+
+	/* keep load factor below 1/2: */
+	if ((h->count + 1) * 2 > h->size) {
+		struct buffer_hash_entry *old = h->entries;
+		unsigned int n = h->size;
+
+		h->size = max(64, h->size * 2);
+		h->entries = calloc(h->size, sizeof(h->entries[0]));
+		h->count = 0;
+
+		for (i = 0; i < n; i++)
+			if (old[i].key)
+				hash_add(h, old[i].key, old[i].buf);
+		free(old);
+	}
+
+	mask = h->size - 1;
+	for (i = hash_key(key); h->entries[i & mask].key; i++)
+		;
+	h->entries[i & mask].key = key;
+	h->entries[i & mask].buf = buf;
+	h->count++;
+}
+
+static struct buffer * hash_find(struct buffer_hash *h, unsigned int key)
+{
+	unsigned int i, mask = h->size - 1;
+
+	if (!h->size)
+		return NULL;
+
+	for (i = hash_key(key); h->entries[i & mask].key; i++)
+		if (h->entries[i & mask].key == key)
+			return h->entries[i & mask].buf;
+
+	return NULL;
+}
+
+static void hash_del(struct buffer_hash *h, unsigned int key,
+		struct buffer *buf)
+{
+	unsigned int i, j, mask = h->size - 1;
+
+	if (!key || !h->size)
+		return;
+
+	for (i = hash_key(key); h->entries[i & mask].buf != buf; i++)
+		if (!h->entries[i & mask].key)
+			return;
+
+	/* backward shift deletion, so there are no gaps in probe sequences: */
+	for (j = i + 1; h->entries[j & mask].key; j++) {
+		unsigned int home = hash_key(h->entries[j & mask].key);
+		/* can the entry at j move to the hole at i? */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			h->entries[i & mask] = h->entries[j & mask];
+			i = j;
+		}
+	}
+	h->entries[i & mask].key = 0;
+	h->entries[i & mask].buf = NULL;
+	h->count--;
+}
+
 static struct buffer * register_buffer(void *hostptr, uint64_t flags,
 		unsigned int len, unsigned int handle)
 {
@@ -253,6 +764,8 @@ static struct buffer * register_buffer(void *hostptr, uint64_t flags,
 	buf->len = len;
 	buf->handle = handle;
 	list_add(&buf->node, &buffers_of_interest);
+	range_add(&hostptr_ranges, (uintptr_t)hostptr, buf);
+	hash_add(&handle_hash, handle, buf);
 	return buf;
 }
 
@@ -260,30 +773,65 @@ static struct buffer * find_buffer(void *hostptr, uint64_t gpuaddr,
 		uint64_t offset, unsigned int handle, unsigned id)
 {
 	struct buffer *buf = NULL;
-	list_for_each_entry(buf, &buffers_of_interest, node) {
-		if (hostptr)
-			if ((buf->hostptr <= hostptr) && (hostptr < (buf->hostptr + buf->len)))
-				return buf;
-		if (gpuaddr)
-			if ((buf->gpuaddr <= gpuaddr) && (gpuaddr < (buf->gpuaddr + buf->len)))
-				return buf;
-		if (offset)
+
+	if (hostptr && (buf = range_find(&hostptr_ranges, (uintptr_t)hostptr)))
+		return buf;
+	if (gpuaddr && (buf = range_find(&gpuaddr_ranges, gpuaddr)))
+		return buf;
+	if (offset) {
+		/* not used currently, so not worth a table: */
+		list_for_each_entry(buf, &buffers_of_interest, node)
 			if ((buf->offset <= offset) && (offset < (buf->offset + buf->len)))
 				return buf;
-		if (handle)
-			if (buf->handle == handle)
-				return buf;
-		if (id)
-			if (buf->id == id)
-				return buf;
 	}
+	if (handle && (buf = hash_find(&handle_hash, handle)))
+		return buf;
+	if (id && (buf = hash_find(&id_hash, id)))
+		return buf;
+
 	return NULL;
 }
 
+static void untrack_dirty(struct buffer *buf);
+
+static void set_hostptr(struct buffer *buf, void *hostptr)
+{
+	if (buf->hostptr != hostptr) {
+		untrack_dirty(buf);
+		range_del(&hostptr_ranges, (uintptr_t)buf->hostptr, buf);
+		range_add(&hostptr_ranges, (uintptr_t)hostptr, buf);
+	}
+	buf->hostptr = hostptr;
+}
+
+static void set_gpuaddr(struct buffer *buf, uint64_t gpuaddr)
+{
+	if (buf->gpuaddr != gpuaddr) {
+		range_del(&gpuaddr_ranges, buf->gpuaddr, buf);
+		range_add(&gpuaddr_ranges, gpuaddr, buf);
+	}
+	buf->gpuaddr = gpuaddr;
+}
+
+static void set_id(struct buffer *buf, unsigned int id)
+{
+	if (buf->id != id) {
+		hash_del(&id_hash, buf->id, buf);
+		buf->id = id;
+		hash_add(&id_hash, id, buf);
+	}
+}
+
 static void unregister_buffer(struct buffer *buf)
 {
 	if (buf) {
+		untrack_dirty(buf);
+		rd_cow_release(buf->hostptr, buf->len);
 		list_del(&buf->node);
+		range_del(&hostptr_ranges, (uintptr_t)buf->hostptr, buf);
+		range_del(&gpuaddr_ranges, buf->gpuaddr, buf);
+		hash_del(&id_hash, buf->id, buf);
+		hash_del(&handle_hash, buf->handle, buf);
 		if (buf->munmap)
 			munmap(buf->hostptr, buf->len);
 		free(buf);
@@ -294,11 +842,13 @@ static void dump_buffer(uint64_t gpuaddr)
 {
 	static int cnt = 0;
 	struct buffer *buf = find_buffer((void *)-1, gpuaddr, 0, 0, 0);
+	uint64_t dumped = buf ? buf->gpuaddr : 0;
+	log_extra(&dumped, sizeof(dumped));
 	if (buf) {
 		char filename[32];
 		int fd;
 		sprintf(filename, "%04d-%016lx.dat", cnt, buf->gpuaddr);
-		printf("\t\tdumping: %s\n", filename);
+		trace("\t\tdumping: %s\n", filename);
 		fd = open(filename, O_WRONLY| O_TRUNC | O_CREAT, 0644);
 		write(fd, buf->hostptr, buf->len);
 		close(fd);
@@ -308,242 +858,1078 @@ static void dump_buffer(uint64_t gpuaddr)
 
 #ifdef FAKE
 static int is64b = 0;
-uint64_t alloc_gpuaddr(uint32_t size)
+
+/*
+ * Fake gpuaddr allocator:
+ *
+ * First-fit allocation from an address sorted array of free ranges, which
+ * are merged with their neighbours again when freed, so that long running
+ * processes do not run out of address space.  As with kgsl, allocations of
+ * 64KiB or more are 64KiB aligned, and smaller ones are page aligned.  The
+ * allocated ranges are tracked too, so that gpuaddrs which did not come
+ * from here (ie. preset by rdreplay) are never added to the free ranges.
+ *
+ * Callers hold the buffers lock.
+ */
+
+#define VA_START  0xc0000000ull
+#define VA_END    0x100000000ull
+
+struct va_ranges {
+	struct va_range {
+		uint64_t start, end;
+	} *ranges;
+	unsigned int count, size;
+};
+
+static struct va_ranges va_free, va_used;
+
+/* index of the first range ending after addr: */
+static unsigned int va_search(struct va_ranges *r, uint64_t addr)
 {
-	// TODO need better scheme to deal w/ deallocation..
-	static uint32_t gpuaddr = 0xc0000000;
-	uint32_t addr = gpuaddr;
-	gpuaddr += size;
-	if (is64b)
-		return ((uint64_t)0x1ffff << 32) | addr;
-	return addr;
+	unsigned int lo = 0, hi = r->count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (r->ranges[mid].end <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
-#endif
 
-/*****************************************************************************/
-static int install_fd(const char *path, int fd)
+static void va_insert(struct va_ranges *r, unsigned int i,
+		uint64_t start, uint64_t end)
 {
-	assert(fd < ARRAY_SIZE(file_table));
-	if (!strcmp(path, "/dev/kgsl-3d0")) {
-#ifdef FAKE
-		if (!(wrap_gpu_id() && wrap_gmem_size())) {
-			printf("need WRAP_GPU_ID/WRAP_GMEM_SIZE!\n");
-			return -1;
+	if (r->count == r->size) {
+		r->size = r->size ? r->size * 2 : 64;
+		r->ranges = realloc(r->ranges, r->size * sizeof(r->ranges[0]));
+	}
+	memmove(&r->ranges[i + 1], &r->ranges[i],
+			(r->count - i) * sizeof(r->ranges[0]));
+	r->ranges[i].start = start;
+	r->ranges[i].end = end;
+	r->count++;
+}
+
+static void va_remove(struct va_ranges *r, unsigned int i)
+{
+	r->count--;
+	memmove(&r->ranges[i], &r->ranges[i + 1],
+			(r->count - i) * sizeof(r->ranges[0]));
+}
+
+uint64_t alloc_gpuaddr(uint32_t size)
+{
+	uint64_t align = (size >= 0x10000) ? 0x10000 : 0x1000;
+	uint64_t len = ALIGN(max(size, 1), 0x1000);
+	unsigned int i;
+
+	if (!va_free.count && !va_used.count)
+		va_insert(&va_free, 0, VA_START, VA_END);
+
+	for (i = 0; i < va_free.count; i++) {
+		struct va_range *r = &va_free.ranges[i];
+		uint64_t start = ALIGN(r->start, align);
+		uint64_t fstart = r->start, fend = r->end;
+
+		if ((start + len) > fend)
+			continue;
+
+		/* keep what is left on either side: */
+		if ((start + len) < fend) {
+			r->start = start + len;
+			if (start > fstart)
+				va_insert(&va_free, i, fstart, start);
+		} else if (start > fstart) {
+			r->end = start;
+		} else {
+			va_remove(&va_free, i);
 		}
-		if ((wrap_gpu_id() >= 500) && !env2u("WRAP_FORCE_32B"))
-			is64b = 1;
-		file_table[fd].is_emulated = 1;
-#endif
-		file_table[fd].is_3d = 1;
-		printf("found kgsl_3d0: %d\n", fd);
-	} else if (!strcmp(path, "/dev/kgsl-2d0")) {
-		file_table[fd].is_2d = 1;
-		printf("found kgsl_2d0: %d\n", fd);
-	} else if (!strcmp(path, "/dev/kgsl-2d1")) {
-		file_table[fd].is_2d = 1;
-		printf("found kgsl_2d1: %d\n", fd);
-	} else if (strstr(path, "/dev/")) {
-		printf("#### missing device, path: %s: %d\n", path, fd);
+
+		va_insert(&va_used, va_search(&va_used, start), start, start + len);
+
+		if (is64b)
+			return ((uint64_t)0x1ffff << 32) | start;
+		return start;
+	}
+
+	printf("out of fake gpuaddr space, allocating %08x\n", size);
+	exit(-1);
+}
+
+static void free_gpuaddr(uint64_t gpuaddr)
+{
+	uint64_t start = (uint32_t)gpuaddr, end;
+	unsigned int i = va_search(&va_used, start);
+
+	if ((i >= va_used.count) || (va_used.ranges[i].start != start))
+		return;
+
+	end = va_used.ranges[i].end;
+	va_remove(&va_used, i);
+
+	/* merge with the neighbouring free ranges: */
+	i = va_search(&va_free, start);
+	if ((i > 0) && (va_free.ranges[i - 1].end == start)) {
+		i--;
+		start = va_free.ranges[i].start;
+		va_remove(&va_free, i);
 	}
+	if ((i < va_free.count) && (va_free.ranges[i].start == end)) {
+		end = va_free.ranges[i].end;
+		va_remove(&va_free, i);
+	}
+
+	va_insert(&va_free, i, start, end);
+}
+
+/*
+ * Host memory backing emulated buffers:
+ *
+ * Buffers of up to 2MiB come from power-of-two size classes, carved from
+ * 2MiB chunks (hugepages, when available) and recycled through per-class
+ * free lists, so that creating and destroying lots of buffers does not
+ * churn the allocator.  Larger buffers are mapped individually.  As with a
+ * real kgsl buffer, the memory is only given back once the buffer has been
+ * both freed and unmapped, see munmap().
+ */
+
+#define ARENA_CHUNK    0x200000
+#define ARENA_CLASSES  10          /* 4KiB .. 2MiB */
+
+static struct {
+	pthread_mutex_t lock;
+	void *free[ARENA_CLASSES];    /* linked through the first word */
+	uint8_t *cur;                 /* unused remainder of current chunk */
+	size_t left;
+	struct arena_map {
+		uintptr_t start, len;
+		int large;                /* a single buffer, rather than a chunk */
+	} *maps;                      /* sorted by start */
+	unsigned int nmaps, maps_size;
+} arena = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int arena_class(size_t len)
+{
+	unsigned int c = 0;
+	while ((0x1000ul << c) < len)
+		c++;
+	return c;
+}
+
+/* index of the first map ending after addr: */
+static unsigned int arena_search(uintptr_t addr)
+{
+	unsigned int lo = 0, hi = arena.nmaps;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if ((arena.maps[mid].start + arena.maps[mid].len) <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void arena_add_map(void *ptr, size_t len, int large)
+{
+	unsigned int i = arena_search((uintptr_t)ptr);
+
+	if (arena.nmaps == arena.maps_size) {
+		arena.maps_size = arena.maps_size ? arena.maps_size * 2 : 64;
+		arena.maps = realloc(arena.maps, arena.maps_size * sizeof(arena.maps[0]));
+	}
+	memmove(&arena.maps[i + 1], &arena.maps[i],
+			(arena.nmaps - i) * sizeof(arena.maps[0]));
+	arena.maps[i].start = (uintptr_t)ptr;
+	arena.maps[i].len = len;
+	arena.maps[i].large = large;
+	arena.nmaps++;
+}
+
+/* map len bytes, 2MiB aligned, so that they can be backed by hugepages: */
+static void * arena_map(size_t len)
+{
+	PROLOG(mmap);
+	PROLOG(munmap);
+	uint8_t *ptr, *aligned;
+
+#ifdef MAP_HUGETLB
+	if (!(len % ARENA_CHUNK)) {
+		ptr = orig_mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+			return ptr;
+	}
+#endif
+
+	/* no hugepages reserved, so try for transparent hugepages: */
+	ptr = orig_mmap(NULL, len + ARENA_CHUNK, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	aligned = (uint8_t *)ALIGN((uintptr_t)ptr, ARENA_CHUNK);
+	if (aligned > ptr)
+		orig_munmap(ptr, aligned - ptr);
+	if ((ptr + ARENA_CHUNK) > aligned)
+		orig_munmap(aligned + len, ptr + ARENA_CHUNK - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+
+	return aligned;
+}
+
+static void * alloc_hostmem(size_t length)
+{
+	size_t len = ALIGN(length, 0x1000);
+	unsigned int c = arena_class(len);
+	size_t size = 0x1000ul << c;
+	void *ptr;
+
+	if (len > ARENA_CHUNK) {
+		ptr = arena_map(len);
+		if (ptr) {
+			pthread_mutex_lock(&arena.lock);
+			arena_add_map(ptr, len, 1);
+			pthread_mutex_unlock(&arena.lock);
+		}
+		return ptr;
+	}
+
+	pthread_mutex_lock(&arena.lock);
+
+	if (arena.free[c]) {
+		ptr = arena.free[c];
+		arena.free[c] = *(void **)ptr;
+		/* new buffers are zero'd, as with kgsl: */
+		memset(ptr, 0, length);
+		pthread_mutex_unlock(&arena.lock);
+		return ptr;
+	}
+
+	if (arena.left < size) {
+		uint8_t *chunk;
+
+		/* put what is left of the current chunk on the free lists: */
+		while (arena.left > 0) {
+			unsigned int c2 = arena_class(arena.left);
+			if ((0x1000ul << c2) > arena.left)
+				c2--;
+			*(void **)arena.cur = arena.free[c2];
+			arena.free[c2] = arena.cur;
+			arena.cur += 0x1000ul << c2;
+			arena.left -= 0x1000ul << c2;
+		}
+
+		chunk = arena_map(ARENA_CHUNK);
+		if (!chunk) {
+			pthread_mutex_unlock(&arena.lock);
+			return NULL;
+		}
+		arena_add_map(chunk, ARENA_CHUNK, 0);
+		arena.cur = chunk;
+		arena.left = ARENA_CHUNK;
+	}
+
+	ptr = arena.cur;
+	arena.cur += size;
+	arena.left -= size;
+
+	pthread_mutex_unlock(&arena.lock);
+
+	return ptr;
+}
+
+/* returns non-zero if the memory came from alloc_hostmem(): */
+static int free_hostmem(void *ptr, size_t length)
+{
+	PROLOG(munmap);
+	uintptr_t addr = (uintptr_t)ptr;
+	struct arena_map *map;
+	unsigned int i;
+
+	pthread_mutex_lock(&arena.lock);
+
+	i = arena_search(addr);
+	if ((i >= arena.nmaps) || (arena.maps[i].start > addr)) {
+		pthread_mutex_unlock(&arena.lock);
+		return 0;
+	}
+
+	map = &arena.maps[i];
+	if (map->large) {
+		size_t len = map->len;
+
+		arena.nmaps--;
+		memmove(&arena.maps[i], &arena.maps[i + 1],
+				(arena.nmaps - i) * sizeof(arena.maps[0]));
+		pthread_mutex_unlock(&arena.lock);
+
+		orig_munmap(ptr, len);
+		return 1;
+	}
+
+	i = arena_class(ALIGN(length, 0x1000));
+	*(void **)ptr = arena.free[i];
+	arena.free[i] = ptr;
+
+	pthread_mutex_unlock(&arena.lock);
+
+	return 1;
+}
+#endif
+
+/*****************************************************************************/
+static int install_fd(const char *path, int fd)
+{
+	assert(fd < ARRAY_SIZE(file_table));
+	if (!strcmp(path, "/dev/kgsl-3d0")) {
+#ifdef FAKE
+		if (!(wrap_gpu_id() && wrap_gmem_size())) {
+			printf("need WRAP_GPU_ID/WRAP_GMEM_SIZE!\n");
+			return -1;
+		}
+		if ((wrap_gpu_id() >= 500) && !env2u("WRAP_FORCE_32B"))
+			is64b = 1;
+		file_table[fd].is_emulated = 1;
+#endif
+		file_table[fd].is_3d = 1;
+		printf("found kgsl_3d0: %d\n", fd);
+	} else if (!strcmp(path, "/dev/kgsl-2d0")) {
+		file_table[fd].is_2d = 1;
+		printf("found kgsl_2d0: %d\n", fd);
+	} else if (!strcmp(path, "/dev/kgsl-2d1")) {
+		file_table[fd].is_2d = 1;
+		printf("found kgsl_2d1: %d\n", fd);
+	} else if (strstr(path, "/dev/")) {
+		printf("#### missing device, path: %s: %d\n", path, fd);
+	}
+
+	return fd;
+}
+
+int open(const char* path, int flags, ...)
+{
+	mode_t mode = 0;
+	int ret;
+	PROLOG(open);
+
+	if (flags & (O_CREAT | O_TMPFILE)) { /* #if this creates errors, remove O_TMPFILE? */
+		va_list args;
+
+		va_start(args, flags);
+		mode = (mode_t) va_arg(args, int);
+		va_end(args);
+
+		ret = orig_open(path, flags, mode);
+	} else {
+#ifdef FAKE
+		const char *actual_path = path;
+		if (access(path, F_OK) && (path == strstr(path, "/dev/"))) {
+			/* fake non-existant device files: */
+			printf("emulating: %s\n", path);
+			actual_path = "/dev/null";
+		}
+		ret = orig_open(actual_path, flags);
+		if ((ret != -1) && (path != actual_path)) {
+			assert(ret < ARRAY_SIZE(file_table));
+			file_table[ret].is_emulated = 1;
+		}
+#else
+		ret = orig_open(path, flags);
+#endif
+	}
+
+	FD_LOCK();
+
+	if (ret != -1) {
+		ret = install_fd(path, ret);
+	}
+
+	FD_UNLOCK();
+
+	return ret;
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	int ret;
+	PROLOG(openat);
+
+	if (flags & (O_CREAT | O_TMPFILE)) { /* #if this creates errors, remove O_TMPFILE? */
+		va_list args;
+
+		va_start(args, flags);
+		mode = (mode_t) va_arg(args, int);
+		va_end(args);
+
+		ret = orig_openat(dirfd, path, flags, mode);
+	} else {
+#ifdef FAKE
+		const char *actual_path = path;
+		if (access(path, F_OK) && (path == strstr(path, "/dev/"))) {
+			/* fake non-existant device files: */
+			printf("emulating: %s\n", path);
+			actual_path = "/dev/null";
+		}
+		ret = orig_openat(dirfd, actual_path, flags);
+		if ((ret != -1) && (path != actual_path)) {
+			assert(ret < ARRAY_SIZE(file_table));
+			file_table[ret].is_emulated = 1;
+		}
+#else
+		ret = orig_openat(dirfd, path, flags);
+#endif
+	}
+
+	FD_LOCK();
+
+	if (ret != -1) {
+		ret = install_fd(path, ret);
+	}
+
+	FD_UNLOCK();
+
+	return ret;
+}
+
+int __openat(int dirfd, const char *path, int flags, int mode)
+{
+	int ret;
+	PROLOG(__openat);
+
+	printf("openat: path: %s\n", path);
+
+	if (flags & (O_CREAT | O_TMPFILE)) { /* #if this creates errors, remove O_TMPFILE? */
+		ret = orig___openat(dirfd, path, flags, mode);
+	} else {
+#ifdef FAKE
+		const char *actual_path = path;
+		if (access(path, F_OK) && (path == strstr(path, "/dev/"))) {
+			/* fake non-existant device files: */
+			printf("emulating: %s\n", path);
+			actual_path = "/dev/null";
+		}
+		ret = orig___openat(dirfd, actual_path, flags, mode);
+		if ((ret != -1) && (path != actual_path)) {
+			assert(ret < ARRAY_SIZE(file_table));
+			file_table[ret].is_emulated = 1;
+		}
+#else
+		ret = orig___openat(dirfd, path, flags, mode);
+#endif
+	}
+
+	FD_LOCK();
+
+	if (ret != -1) {
+		ret = install_fd(path, ret);
+	}
+
+	FD_UNLOCK();
+
+	return ret;
+}
+
+int close(int fd)
+{
+	PROLOG(close);
+
+	FD_LOCK();
+
+	if ((fd >= 0) && (fd < ARRAY_SIZE(file_table))) {
+		if (file_table[fd].is_3d) {
+			// XXX unregister buffers
+			printf("closing 3d\n");
+		}
+		file_table[fd].is_3d = 0;
+		file_table[fd].is_2d = 0;
+#ifdef FAKE
+		file_table[fd].is_emulated = 0;
+#endif
+	}
+
+	FD_UNLOCK();
+
+	return orig_close(fd);
+}
+
+static void log_gpuaddr(uint64_t gpuaddr, uint32_t len)
+{
+	uint32_t sect[3] = {
+			/* upper 32b of gpuaddr added after len for backwards compat */
+			gpuaddr, len, gpuaddr >> 32,
+	};
+	rd_write_section(RD_GPUADDR, sect, sizeof(sect));
+}
+
+static void log_cmdaddr(uint64_t gpuaddr, uint32_t sizedwords)
+{
+	uint32_t sect[3] = {
+			/* upper 32b of gpuaddr added after len for backwards compat */
+			gpuaddr, sizedwords, gpuaddr >> 32,
+	};
+	rd_write_section(RD_CMDSTREAM_ADDR, sect, sizeof(sect));
+}
+
+/* identifies the current thread's capture, so buffers are dumped once per
+ * submit.  Concurrent captures can clobber each other's buffer->dumped, but
+ * that only results in a buffer being dumped twice:
+ */
+static __thread uint64_t capture_seqno;
+
+/* whether the current thread's submit is being captured: */
+static __thread int capturing;
+
+/* # of submits so far, captured or not: */
+static uint64_t nsubmits;
+
+/* whether the n'th submit (counting from zero) is in the capture window,
+ * see WRAP_CAPTURE_START/COUNT/EVERY:
+ */
+static int in_capture_window(uint64_t n)
+{
+	uint64_t start = wrap_capture_start();
+	uint64_t count = wrap_capture_count();
+	uint64_t every = wrap_capture_every();
+
+	if (n < start)
+		return 0;
+
+	n -= start;
+
+	if (every)
+		return (n % every) < max(count, 1);
+
+	return !count || (n < count);
+}
+
+static void refs_reset(void);
+
+static void dump_ib_prep(void)
+{
+	uint64_t n = __sync_fetch_and_add(&nsubmits, 1);
+
+	capturing = !wrap_stats() && in_capture_window(n);
+	if (!capturing)
+		return;
+
+	capture_seqno = rd_capture_begin() + 1;
+
+	if (wrap_refonly())
+		refs_reset();
+}
+
+/*
+ * Dirty page tracking (WRAP_DIRTY):
+ *
+ * After a buffer is snapshotted, the pages lying entirely within the buffer
+ * are write-protected.  The first write by the application to such a page
+ * faults, and the SIGSEGV handler marks the page dirty and makes it writable
+ * again.  Partial pages at either end of the buffer are never protected, so
+ * they are always treated as dirty.
+ */
+
+static uintptr_t page_size;
+static struct sigaction old_segv;
+
+static uintptr_t first_page(struct buffer *buf)
+{
+	return (uintptr_t)buf->hostptr & ~(page_size - 1);
+}
+
+static unsigned int num_pages(struct buffer *buf)
+{
+	uintptr_t end = (uintptr_t)buf->hostptr + buf->len;
+	return (ALIGN(end, page_size) - first_page(buf)) / page_size;
+}
+
+static int page_dirty(struct buffer *buf, unsigned int i)
+{
+	uintptr_t start = first_page(buf) + i * page_size;
+
+	/* partial pages are not tracked: */
+	if ((start < (uintptr_t)buf->hostptr) ||
+			((start + page_size) > ((uintptr_t)buf->hostptr + buf->len)))
+		return 1;
+
+	return !!(buf->dirty[i / 32] & (1u << (i % 32)));
+}
+
+/*
+ * The fault handler cannot take buffers_lock (or any other lock), so the
+ * buffers with protected pages are also kept in a sorted table which is
+ * replaced, rather than modified, under tracked_lock.  The handler reads
+ * whichever table is current, and a replaced table (or a buffer's dirty
+ * bitmap) is only freed once no handler is running anymore.
+ */
+struct tracked_range {
+	uintptr_t start, end, first;
+	uint32_t *dirty;
+};
+
+struct tracked {
+	unsigned int count;
+	struct tracked_range e[];
+};
+
+static pthread_mutex_t tracked_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tracked *tracked;
+static int segv_active;
+
+static void segv_drain(void)
+{
+	while (__sync_fetch_and_add(&segv_active, 0))
+		sched_yield();
+}
+
+static void set_tracked_range(struct tracked_range *r, struct buffer *buf)
+{
+	r->start = (uintptr_t)buf->hostptr;
+	r->end = (uintptr_t)buf->hostptr + buf->len;
+	r->first = first_page(buf);
+	r->dirty = buf->dirty;
+}
+
+/* replace the table, either adding or removing buf: */
+static void update_tracked(struct buffer *buf, int add)
+{
+	struct tracked *old, *new;
+	unsigned int i, n = 0, count;
+
+	pthread_mutex_lock(&tracked_lock);
+
+	old = tracked;
+	count = old ? old->count : 0;
+	new = malloc(sizeof(*new) + (count + 1) * sizeof(new->e[0]));
+
+	for (i = 0; i < count; i++) {
+		if (old->e[i].dirty == buf->dirty)
+			continue;
+		if (add && (old->e[i].start > (uintptr_t)buf->hostptr)) {
+			set_tracked_range(&new->e[n++], buf);
+			add = 0;
+		}
+		new->e[n++] = old->e[i];
+	}
+	if (add)
+		set_tracked_range(&new->e[n++], buf);
+	new->count = n;
+
+	__atomic_store_n(&tracked, new, __ATOMIC_RELEASE);
+	segv_drain();
+	free(old);
+
+	pthread_mutex_unlock(&tracked_lock);
+}
+
+/* write-protect the tracked pages in the range [i, j) */
+static void protect_pages(struct buffer *buf, unsigned int i, unsigned int j)
+{
+	uintptr_t start = max(first_page(buf) + i * page_size,
+			ALIGN((uintptr_t)buf->hostptr, page_size));
+	uintptr_t end = min(first_page(buf) + j * page_size,
+			((uintptr_t)buf->hostptr + buf->len) & ~(page_size - 1));
+
+	if (start < end)
+		mprotect((void *)start, end - start, PROT_READ);
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *ctx)
+{
+	uintptr_t addr = (uintptr_t)info->si_addr;
+	struct tracked *t;
+	int found = 0;
+
+	if (rd_cow_fault(info->si_addr))
+		return;
+
+	__sync_fetch_and_add(&segv_active, 1);
+	t = __atomic_load_n(&tracked, __ATOMIC_ACQUIRE);
+	if (t) {
+		unsigned int lo = 0, hi = t->count;
+
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+			if (addr < t->e[mid].start) {
+				hi = mid;
+			} else if (addr >= t->e[mid].end) {
+				lo = mid + 1;
+			} else {
+				unsigned int i = (addr - t->e[mid].first) / page_size;
+				__sync_fetch_and_or(&t->e[mid].dirty[i / 32], 1u << (i % 32));
+				mprotect((void *)(addr & ~(page_size - 1)), page_size,
+						PROT_READ | PROT_WRITE);
+				found = 1;
+				break;
+			}
+		}
+	}
+	__sync_fetch_and_sub(&segv_active, 1);
+
+	if (found)
+		return;
+
+	/* not one of ours, so pass it on: */
+	if (old_segv.sa_flags & SA_SIGINFO) {
+		old_segv.sa_sigaction(sig, info, ctx);
+	} else if ((old_segv.sa_handler != SIG_DFL) &&
+			(old_segv.sa_handler != SIG_IGN)) {
+		old_segv.sa_handler(sig);
+	} else {
+		/* restore the default action, and let it fault again: */
+		signal(SIGSEGV, SIG_DFL);
+	}
+}
+
+static void untrack_dirty(struct buffer *buf)
+{
+	uintptr_t start, end;
+
+	if (!buf->dirty)
+		return;
 
-	return fd;
+	start = ALIGN((uintptr_t)buf->hostptr, page_size);
+	end = ((uintptr_t)buf->hostptr + buf->len) & ~(page_size - 1);
+	if (start < end)
+		mprotect((void *)start, end - start, PROT_READ | PROT_WRITE);
+
+	/* the handler may still be looking at the bitmap until it is drained: */
+	update_tracked(buf, 0);
+
+	free(buf->dirty);
+	buf->dirty = NULL;
 }
 
-int open(const char* path, int flags, ...)
+static pthread_once_t segv_once = PTHREAD_ONCE_INIT;
+
+static void segv_init(void)
 {
-	mode_t mode = 0;
-	int ret;
-	PROLOG(open);
+	struct sigaction sa = {
+			.sa_sigaction = segv_handler,
+			.sa_flags = SA_SIGINFO | SA_RESTART,
+	};
+	page_size = sysconf(_SC_PAGESIZE);
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old_segv);
+}
 
-	if (flags & (O_CREAT | O_TMPFILE)) { /* #if this creates errors, remove O_TMPFILE? */
-		va_list args;
+static void dump_buffer_delta(struct buffer *buf)
+{
+	static const uint32_t zero;
+	unsigned int i, j, npages, nruns = 0;
+	uint32_t (*runs)[2];
+	struct iovec *iov;
+	int n = 0;
 
-		va_start(args, flags);
-		mode = (mode_t) va_arg(args, int);
-		va_end(args);
+	pthread_once(&segv_once, segv_init);
 
-		ret = orig_open(path, flags, mode);
-	} else {
-#ifdef FAKE
-		const char *actual_path = path;
-		if (access(path, F_OK) && (path == strstr(path, "/dev/"))) {
-			/* fake non-existant device files: */
-			printf("emulating: %s\n", path);
-			actual_path = "/dev/null";
+	npages = num_pages(buf);
+
+	if (!buf->dirty || (buf->snapshot != rd_file_id())) {
+		/* first snapshot in this rd file, so everything is needed.  Note
+		 * that pages are protected before they are read, so no writes are
+		 * lost in between:
+		 */
+		if (!buf->dirty) {
+			buf->dirty = calloc(ALIGN(npages, 32) / 32, sizeof(uint32_t));
+			update_tracked(buf, 1);
+		} else
+			memset(buf->dirty, 0, ALIGN(npages, 32) / 32 * sizeof(uint32_t));
+		protect_pages(buf, 0, npages);
+		rd_write_buffer(buf->hostptr, buf->len);
+		buf->snapshot = rd_file_id();
+		return;
+	}
+
+	runs = malloc((npages / 2 + 1) * sizeof(runs[0]));
+	iov = malloc((npages / 2 + 1) * 3 * sizeof(iov[0]));
+
+	for (i = 0; i < npages; i = j) {
+		uintptr_t start, end;
+
+		if (!page_dirty(buf, i)) {
+			j = i + 1;
+			continue;
 		}
-		ret = orig_open(actual_path, flags);
-		if ((ret != -1) && (path != actual_path)) {
-			assert(ret < ARRAY_SIZE(file_table));
-			file_table[ret].is_emulated = 1;
+
+		for (j = i; (j < npages) && page_dirty(buf, j); j++)
+			__sync_fetch_and_and(&buf->dirty[j / 32], ~(1u << (j % 32)));
+		protect_pages(buf, i, j);
+
+		start = max(first_page(buf) + i * page_size, (uintptr_t)buf->hostptr);
+		end = min(first_page(buf) + j * page_size,
+				(uintptr_t)buf->hostptr + buf->len);
+
+		runs[nruns][0] = start - (uintptr_t)buf->hostptr;
+		runs[nruns][1] = end - start;
+
+		iov[n].iov_base = runs[nruns];
+		iov[n++].iov_len = sizeof(runs[0]);
+		iov[n].iov_base = (void *)start;
+		iov[n++].iov_len = end - start;
+		if ((end - start) % 4) {
+			iov[n].iov_base = (void *)&zero;
+			iov[n++].iov_len = 4 - ((end - start) % 4);
 		}
-#else
-		ret = orig_open(path, flags);
-#endif
+
+		nruns++;
 	}
 
-	LOCK();
+	/* note, an empty delta is still written for unchanged buffers, so that
+	 * readers see every buffer at every submit, as without WRAP_DIRTY:
+	 */
+	rd_write_sectionv(RD_BUFFER_DELTA, iov, n);
 
-	if (ret != -1) {
-		ret = install_fd(path, ret);
-	}
+	free(runs);
+	free(iov);
+}
+
+/*
+ * Referenced buffers (WRAP_REFONLY):
+ *
+ * Rather than dumping every buffer for each submit, the cmdstream is parsed
+ * to find the buffers it references, following CP_INDIRECT_BUFFER packets
+ * and CP_SET_DRAW_STATE groups into the IBs they point to.  Any packet
+ * payload dword (or pair of dwords, for 64b addresses) that falls within a
+ * buffer counts as a reference.  That is conservative, in that a value which
+ * just happens to look like a gpuaddr pulls in an extra buffer, but catches
+ * addresses written to registers as well as those in CP_LOAD_STATE, draw
+ * packets, etc.
+ *
+ * The referenced buffers are collected in a per-thread set, which is reset
+ * for each submit, so concurrent captures don't interfere.
+ */
 
-	UNLOCK();
+#define MAX_IB_DEPTH 4
 
-	return ret;
+static __thread struct {
+	struct buffer **bufs;
+	unsigned int count, size;
+} refs;
+
+static void refs_reset(void)
+{
+	if (refs.count)
+		memset(refs.bufs, 0, refs.size * sizeof(refs.bufs[0]));
+	refs.count = 0;
 }
 
-int openat(int dirfd, const char *path, int flags, ...)
+static void refs_add(struct buffer *buf)
 {
-	mode_t mode = 0;
-	int ret;
-	PROLOG(openat);
+	unsigned int i, mask;
 
-	if (flags & (O_CREAT | O_TMPFILE)) { /* #if this creates errors, remove O_TMPFILE? */
-		va_list args;
+	if ((refs.count + 1) * 2 > refs.size) {
+		struct buffer **old = refs.bufs;
+		unsigned int old_size = refs.size;
 
-		va_start(args, flags);
-		mode = (mode_t) va_arg(args, int);
-		va_end(args);
+		refs.size = old_size ? old_size * 2 : 256;
+		refs.bufs = calloc(refs.size, sizeof(refs.bufs[0]));
+		refs.count = 0;
 
-		ret = orig_openat(dirfd, path, flags, mode);
-	} else {
-#ifdef FAKE
-		const char *actual_path = path;
-		if (access(path, F_OK) && (path == strstr(path, "/dev/"))) {
-			/* fake non-existant device files: */
-			printf("emulating: %s\n", path);
-			actual_path = "/dev/null";
-		}
-		ret = orig_openat(dirfd, actual_path, flags);
-		if ((ret != -1) && (path != actual_path)) {
-			assert(ret < ARRAY_SIZE(file_table));
-			file_table[ret].is_emulated = 1;
-		}
-#else
-		ret = orig_openat(dirfd, path, flags);
-#endif
+		for (i = 0; i < old_size; i++)
+			if (old[i])
+				refs_add(old[i]);
+
+		free(old);
 	}
 
-	LOCK();
+	mask = refs.size - 1;
+	i = ((uintptr_t)buf >> 4) & mask;
 
-	if (ret != -1) {
-		ret = install_fd(path, ret);
+	while (refs.bufs[i]) {
+		if (refs.bufs[i] == buf)
+			return;
+		i = (i + 1) & mask;
 	}
 
-	UNLOCK();
-
-	return ret;
+	refs.bufs[i] = buf;
+	refs.count++;
 }
 
-int __openat(int dirfd, const char *path, int flags, int mode)
+static void scan_addrs(const uint32_t *dwords, uint32_t count)
 {
-	int ret;
-	PROLOG(__openat);
-
-	printf("openat: path: %s\n", path);
+	uint32_t i;
 
-	if (flags & (O_CREAT | O_TMPFILE)) { /* #if this creates errors, remove O_TMPFILE? */
-		ret = orig___openat(dirfd, path, flags, mode);
-	} else {
-#ifdef FAKE
-		const char *actual_path = path;
-		if (access(path, F_OK) && (path == strstr(path, "/dev/"))) {
-			/* fake non-existant device files: */
-			printf("emulating: %s\n", path);
-			actual_path = "/dev/null";
-		}
-		ret = orig___openat(dirfd, actual_path, flags, mode);
-		if ((ret != -1) && (path != actual_path)) {
-			assert(ret < ARRAY_SIZE(file_table));
-			file_table[ret].is_emulated = 1;
-		}
-#else
-		ret = orig___openat(dirfd, path, flags, mode);
-#endif
+	for (i = 0; i < count; i++) {
+		struct buffer *buf = find_buffer(NULL, dwords[i], 0, 0, 0);
+		if (!buf && ((i + 1) < count))
+			buf = find_buffer(NULL, dwords[i] | ((uint64_t)dwords[i + 1] << 32), 0, 0, 0);
+		if (buf)
+			refs_add(buf);
 	}
+}
 
-	LOCK();
+static void scan_ib(uint64_t gpuaddr, uint32_t sizedwords, int depth);
 
-	if (ret != -1) {
-		ret = install_fd(path, ret);
-	}
+/* CP_SET_DRAW_STATE groups, which is how a4xx+ reach most of the state
+ * (shaders, consts, textures).  Each group is a count/flags dword plus
+ * the address, which is 64b for type7 packets:
+ */
+static void scan_draw_state(const uint32_t *payload, uint32_t count,
+		int stride, int depth)
+{
+	uint32_t j;
 
-	UNLOCK();
+	if (depth >= MAX_IB_DEPTH)
+		return;
 
-	return ret;
+	for (j = 0; (j + stride) <= count; j += stride) {
+		uint32_t hdr = payload[j];
+		uint64_t addr = payload[j + 1];
+
+		if (stride > 2)
+			addr |= (uint64_t)payload[j + 2] << 32;
+
+		if (hdr & (CP_SET_DRAW_STATE__0_DISABLE |
+				CP_SET_DRAW_STATE__0_DISABLE_ALL_GROUPS))
+			continue;
+
+		if (addr)
+			scan_ib(addr, hdr & CP_SET_DRAW_STATE__0_COUNT__MASK, depth + 1);
+	}
 }
 
-int close(int fd)
+static void scan_ib(uint64_t gpuaddr, uint32_t sizedwords, int depth)
 {
-	PROLOG(close);
+	struct buffer *buf = find_buffer(NULL, gpuaddr, 0, 0, 0);
+	const uint32_t *dwords;
+	uint32_t i = 0;
 
-	LOCK();
+	if (!buf || !buf->hostptr)
+		return;
 
-	if ((fd >= 0) && (fd < ARRAY_SIZE(file_table))) {
-		if (file_table[fd].is_3d) {
-			// XXX unregister buffers
-			printf("closing 3d\n");
+	refs_add(buf);
+
+	dwords = buf->hostptr + (gpuaddr - buf->gpuaddr);
+	sizedwords = min(sizedwords, (buf->len - (gpuaddr - buf->gpuaddr)) / 4);
+
+	while (i < sizedwords) {
+		uint32_t pkt = dwords[i++];
+		uint32_t count, opcode = ~0;
+		uint64_t ibaddr = 0;
+		uint32_t ibsize = 0;
+		int draw_state = 0;      /* dwords per CP_SET_DRAW_STATE group */
+		const uint32_t *payload = &dwords[i];
+
+		switch (pkt & 0xc0000000) {
+		case CP_TYPE0_PKT:
+			count = ((pkt >> 16) & 0x3fff) + 1;
+			break;
+		case CP_TYPE2_PKT:
+			count = 0;
+			break;
+		case CP_TYPE3_PKT:
+			count = ((pkt >> 16) & 0x3fff) + 1;
+			opcode = (pkt >> 8) & 0xff;
+			if (((opcode == CP_INDIRECT_BUFFER_PFE) ||
+					(opcode == CP_INDIRECT_BUFFER_PFD)) && (count >= 2)) {
+				ibaddr = payload[0];
+				ibsize = payload[1];
+			} else if (opcode == CP_SET_DRAW_STATE) {
+				draw_state = 2;
+			}
+			break;
+		default:
+			/* type4/type7 packets, a5xx+: */
+			if ((pkt & 0xf0000000) == CP_TYPE4_PKT) {
+				count = pkt & 0x7f;
+			} else if ((pkt & 0xf0000000) == CP_TYPE7_PKT) {
+				count = pkt & 0x3fff;
+				opcode = (pkt >> 16) & 0x7f;
+				if ((opcode == CP_INDIRECT_BUFFER) && (count >= 3)) {
+					ibaddr = payload[0] | ((uint64_t)payload[1] << 32);
+					ibsize = payload[2];
+				} else if (opcode == CP_SET_DRAW_STATE) {
+					draw_state = 3;
+				}
+			} else {
+				/* not a packet we understand, so we've lost track of
+				 * the packet boundaries.  Scan what is left, so that
+				 * nothing is missed:
+				 */
+				count = sizedwords - i;
+			}
+			break;
 		}
-		file_table[fd].is_3d = 0;
-		file_table[fd].is_2d = 0;
-#ifdef FAKE
-		file_table[fd].is_emulated = 0;
-#endif
-	}
 
-	UNLOCK();
+		count = min(count, sizedwords - i);
+		scan_addrs(payload, count);
 
-	return orig_close(fd);
-}
+		if (ibaddr && (depth < MAX_IB_DEPTH))
+			scan_ib(ibaddr, ibsize, depth + 1);
 
-static void log_gpuaddr(uint64_t gpuaddr, uint32_t len)
-{
-	uint32_t sect[3] = {
-			/* upper 32b of gpuaddr added after len for backwards compat */
-			gpuaddr, len, gpuaddr >> 32,
-	};
-	rd_write_section(RD_GPUADDR, sect, sizeof(sect));
+		if (draw_state)
+			scan_draw_state(payload, count, draw_state, depth);
+
+		i += count;
+	}
 }
 
-static void log_cmdaddr(uint64_t gpuaddr, uint32_t sizedwords)
+static void dump_one_buffer(struct buffer *buf)
 {
-	uint32_t sect[3] = {
-			/* upper 32b of gpuaddr added after len for backwards compat */
-			gpuaddr, sizedwords, gpuaddr >> 32,
-	};
-	rd_write_section(RD_CMDSTREAM_ADDR, sect, sizeof(sect));
+	if (buf->hostptr && (buf->dumped != capture_seqno)) {
+		log_gpuaddr(buf->gpuaddr, buf->len);
+		if (wrap_dirty()) {
+			dump_buffer_delta(buf);
+		} else {
+			/* copy-on-write snapshots need the fault handler too: */
+			if (wrap_cow())
+				pthread_once(&segv_once, segv_init);
+			rd_write_buffer(buf->hostptr, buf->len);
+		}
+		buf->dumped = capture_seqno;
+	}
 }
 
-static void dump_ib_prep(void)
+static void dump_buffers(void)
 {
 	struct buffer *other_buf;
+	unsigned int i;
+
+	if (wrap_refonly()) {
+		for (i = 0; i < refs.size; i++)
+			if (refs.bufs[i])
+				dump_one_buffer(refs.bufs[i]);
+		return;
+	}
 
 	list_for_each_entry(other_buf, &buffers_of_interest, node) {
-		other_buf->dumped = 0;
+		dump_one_buffer(other_buf);
 	}
 }
 
 static void dump_ib(struct kgsl_ibdesc *ibdesc)
 {
-	struct buffer *buf = find_buffer(NULL, ibdesc->gpuaddr, 0, 0, 0);
+	struct buffer *buf;
+
+	if (!capturing)
+		return;
+
+	buf = find_buffer(NULL, ibdesc->gpuaddr, 0, 0, 0);
 	if (buf && buf->hostptr) {
-		struct buffer *other_buf;
 		uint32_t off = ibdesc->gpuaddr - buf->gpuaddr;
 		uint32_t *ptr = buf->hostptr + off;
 
-		printf("\t\tcmd: (%u dwords)\n", (uint32_t)ibdesc->sizedwords);
+		trace("\t\tcmd: (%u dwords)\n", (uint32_t)ibdesc->sizedwords);
 
 		hexdump_dwords(ptr, ibdesc->sizedwords);
 
-		list_for_each_entry(other_buf, &buffers_of_interest, node) {
-			if (other_buf && other_buf->hostptr && !other_buf->dumped) {
-				uint32_t len = other_buf->len;
-				log_gpuaddr(other_buf->gpuaddr, len);
-				rd_write_section(RD_BUFFER_CONTENTS,
-						other_buf->hostptr, len);
-				other_buf->dumped = 1;
-			}
-		}
+		if (wrap_refonly())
+			scan_ib(ibdesc->gpuaddr, ibdesc->sizedwords, 0);
+
+		dump_buffers();
 
 		/* we already dump all the buffer contents, so just need
 		 * to dump the address/size of the cmdstream:
@@ -555,26 +1941,25 @@ static void dump_ib(struct kgsl_ibdesc *ibdesc)
 static void dump_cmd(struct kgsl_command_object *cmd)
 {
 	/* note: kgsl seems to ignore cmd->offset.. which may be a bug.. */
-	struct buffer *buf = find_buffer(NULL, cmd->gpuaddr, 0, 0, 0);
+	struct buffer *buf;
+
+	if (!capturing)
+		return;
+
+	buf = find_buffer(NULL, cmd->gpuaddr, 0, 0, 0);
 	if (buf && buf->hostptr) {
-		struct buffer *other_buf;
 		uint32_t sizedwords = cmd->size / 4;
 		uint32_t off = cmd->gpuaddr - buf->gpuaddr;
 		uint32_t *ptr = buf->hostptr + off;
 
-		printf("\t\tcmd: (%u dwords)\n", sizedwords);
+		trace("\t\tcmd: (%u dwords)\n", sizedwords);
 
 		hexdump_dwords(ptr, sizedwords);
 
-		list_for_each_entry(other_buf, &buffers_of_interest, node) {
-			if (other_buf && other_buf->hostptr && !other_buf->dumped) {
-				uint32_t len = other_buf->len;
-				log_gpuaddr(other_buf->gpuaddr, len);
-				rd_write_section(RD_BUFFER_CONTENTS,
-						other_buf->hostptr, len);
-				other_buf->dumped = 1;
-			}
-		}
+		if (wrap_refonly())
+			scan_ib(cmd->gpuaddr, sizedwords, 0);
+
+		dump_buffers();
 
 		/* we already dump all the buffer contents, so just need
 		 * to dump the address/size of the cmdstream:
@@ -590,7 +1975,7 @@ static void kgsl_ioctl_ringbuffer_issueibcmds_pre(int fd,
 	int i;
 	struct kgsl_ibdesc *ibdesc;
 	dump_ib_prep();
-	printf("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
+	trace("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
 	/*
 For z180_cmdstream_issueibcmds():
 
@@ -632,16 +2017,19 @@ PACKETSIZE_STATESTREAM:
 
 so the context, restored on context switch, is the first: 320 (0x140) words
 	*/
-	printf("\t\tflags:\t\t%08x\n", param->flags);
-	printf("\t\tnumibs:\t\t%08x\n", param->numibs);
-	printf("\t\tibdesc_addr:\t%08x\n", param->ibdesc_addr);
+	trace("\t\tflags:\t\t%08x\n", param->flags);
+	trace("\t\tnumibs:\t\t%08x\n", param->numibs);
+	trace("\t\tibdesc_addr:\t%08x\n", param->ibdesc_addr);
 	ibdesc = (struct kgsl_ibdesc *)param->ibdesc_addr;
+	log_extra(ibdesc, param->numibs * sizeof(*ibdesc));
 	for (i = 0; i < param->numibs; i++) {
 		// z180_cmdstream_issueibcmds or adreno_ringbuffer_issueibcmds
-		printf("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
-		printf("\t\tibdesc[%d].sizedwords:\t%08x\n", i, (uint32_t)ibdesc[i].sizedwords);
-		printf("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, ibdesc[i].gpuaddr);
-		printf("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
+		trace("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
+		trace("\t\tibdesc[%d].sizedwords:\t%08x\n", i, (uint32_t)ibdesc[i].sizedwords);
+		trace("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, ibdesc[i].gpuaddr);
+		trace("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
+		if (!capturing)
+			continue;
 		if (is2d) {
 			if (ibdesc[i].sizedwords > PACKETSIZE_STATESTREAM) {
 				unsigned int len, *ptr;
@@ -653,12 +2041,12 @@ so the context, restored on context switch, is the first: 320 (0x140) words
 				 * can patch up the cmdstream to jump back to the next ringbuffer
 				 * entry.
 				 */
-				printf("\t\tcontext:\n");
+				trace("\t\tcontext:\n");
 				hexdump_dwords(ibdesc[i].hostptr, PACKETSIZE_STATESTREAM);
 				rd_write_section(RD_CONTEXT, ibdesc[i].hostptr,
 						PACKETSIZE_STATESTREAM * sizeof(unsigned int));
 
-				printf("\t\tcmd:\n");
+				trace("\t\tcmd:\n");
 				ptr = (unsigned int *)(ibdesc[i].hostptr +
 						PACKETSIZE_STATESTREAM * sizeof(unsigned int));
 				len = ptr[2] & 0xfff;
@@ -671,19 +2059,22 @@ so the context, restored on context switch, is the first: 320 (0x140) words
 				 */
 				dump_buffer(ibdesc[i].gpuaddr);
 			} else {
-				printf("\t\tWARNING: INVALID CONTEXT!\n");
+				trace("\t\tWARNING: INVALID CONTEXT!\n");
 				hexdump_dwords(ibdesc[i].hostptr, ibdesc[i].sizedwords);
+				log_extra(ibdesc[i].hostptr, ibdesc[i].sizedwords * 4);
 			}
 		} else {
 			dump_ib(&ibdesc[i]);
 		}
 	}
+
+	rd_capture_end();
 }
 
 static void kgsl_ioctl_ringbuffer_issueibcmds_post(int fd,
 		struct kgsl_ringbuffer_issueibcmds *param)
 {
-	printf("\t\ttimestamp:\t%08x\n", param->timestamp);
+	trace("\t\ttimestamp:\t%08x\n", param->timestamp);
 }
 
 static void kgsl_ioctl_submit_commands_pre(int fd,
@@ -695,29 +2086,32 @@ static void kgsl_ioctl_submit_commands_pre(int fd,
 	dump_ib_prep();
 
 	ibdesc = (struct kgsl_ibdesc *)param->cmdlist;
+	log_extra(ibdesc, param->numcmds * sizeof(*ibdesc));
 
-	printf("\t\tdrawctxt_id:\t%08x\n", param->context_id);
-	printf("\t\tflags:\t\t%08x\n", param->flags);
-	printf("\t\tnumibs:\t\t%08x\n", param->numcmds);
+	trace("\t\tdrawctxt_id:\t%08x\n", param->context_id);
+	trace("\t\tflags:\t\t%08x\n", param->flags);
+	trace("\t\tnumibs:\t\t%08x\n", param->numcmds);
 	for (i = 0; i < param->numcmds; i++) {
-		printf("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
-		printf("\t\tibdesc[%d].sizedwords:\t%08x\n", i, (uint32_t)ibdesc[i].sizedwords);
-		printf("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, ibdesc[i].gpuaddr);
-		printf("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
+		trace("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
+		trace("\t\tibdesc[%d].sizedwords:\t%08x\n", i, (uint32_t)ibdesc[i].sizedwords);
+		trace("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, ibdesc[i].gpuaddr);
+		trace("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
 		dump_ib(&ibdesc[i]);
 	}
+
+	rd_capture_end();
 }
 
 static void kgsl_ioctl_submit_commands_post(int fd,
 		struct kgsl_submit_commands *param)
 {
-	printf("\t\ttimestamp:\t%08x\n", param->timestamp);
+	trace("\t\ttimestamp:\t%08x\n", param->timestamp);
 }
 
 static void kgsl_ioctl_drawctxt_create_pre(int fd,
 		struct kgsl_drawctxt_create *param)
 {
-	printf("\t\tflags:\t\t%08x\n", param->flags);
+	trace("\t\tflags:\t\t%08x\n", param->flags);
 }
 
 static void kgsl_ioctl_drawctxt_create_post(int fd,
@@ -727,7 +2121,7 @@ static void kgsl_ioctl_drawctxt_create_post(int fd,
 	static unsigned ctxid = 0;
 	param->drawctxt_id = ++ctxid;
 #endif
-	printf("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
+	trace("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
 }
 
 #define PROP_INFO(n) [n] = #n
@@ -760,11 +2154,11 @@ static void kgsl_ioctl_device_getproperty_post(int fd,
 {
 	const char *typename =
 		(param->type < ARRAY_SIZE(propnames)) ? propnames[param->type] : NULL;
-	printf("\t\ttype:\t\t%08x (%s)\n", param->type,
+	trace("\t\ttype:\t\t%08x (%s)\n", param->type,
 			typename ? typename : "unknown");
 	if (param->type == KGSL_PROP_DEVICE_INFO) {
 		struct kgsl_devinfo *devinfo = param->value;
-		uint32_t gpu_id;
+		uint32_t gpu_id, emulated = 0;
 		if (wrap_gpu_id()) {
 			uint32_t gpu_id = wrap_gpu_id();
 			/* convert gpu-id into chip-id, and add optional patch level: */
@@ -782,13 +2176,16 @@ static void kgsl_ioctl_device_getproperty_post(int fd,
 			devinfo->mmu_enabled = 1;
 			devinfo->gmem_gpubaseaddr = 0x10000;
 #endif
-			printf("\t\tEMULATING gpu_id: %d (%08x)!!!\n",
+			trace("\t\tEMULATING gpu_id: %d (%08x)!!!\n",
 					devinfo->gpu_id, devinfo->chip_id);
+			emulated |= RD_EMULATED_GPU_ID;
 		}
 		if (wrap_gmem_size()) {
 			devinfo->gmem_sizebytes = wrap_gmem_size();
-			printf("\t\tEMULATING gmem_sizebytes: %u !!!\n", (uint32_t)devinfo->gmem_sizebytes);
+			trace("\t\tEMULATING gmem_sizebytes: %u !!!\n", (uint32_t)devinfo->gmem_sizebytes);
+			emulated |= RD_EMULATED_GMEM_SIZE;
 		}
+		log_extra(&emulated, sizeof(emulated));
 		gpu_id = devinfo->gpu_id;
 		if (!gpu_id) {
 			gpu_id = ((devinfo->chip_id >> 24) & 0xff) * 100 +
@@ -796,8 +2193,8 @@ static void kgsl_ioctl_device_getproperty_post(int fd,
 				((devinfo->chip_id >> 8) & 0xff) * 1;
 		}
 		rd_write_section(RD_GPU_ID, &gpu_id, sizeof(gpu_id));
-		printf("\t\tgpu_id: %d\n", gpu_id);
-		printf("\t\tgmem_sizebytes: 0x%x\n", (uint32_t)devinfo->gmem_sizebytes);
+		trace("\t\tgpu_id: %d\n", gpu_id);
+		trace("\t\tgmem_sizebytes: 0x%x\n", (uint32_t)devinfo->gmem_sizebytes);
 #ifdef FAKE
 	} else if (param->type == KGSL_PROP_DEVICE_SHADOW) {
 		struct kgsl_shadowprop *shadow = param->value;
@@ -839,6 +2236,7 @@ static void kgsl_ioctl_device_getproperty_post(int fd,
 #endif
 	}
 	hexdump(param->value, param->sizebytes);
+	log_extra(param->value, param->sizebytes);
 }
 
 static int len_from_vma(unsigned int hostptr)
@@ -870,8 +2268,8 @@ static void kgsl_ioctl_sharedmem_from_vmalloc_pre(int fd,
 	int len;
 
 	/* just make gpuaddr == hostptr.. should make it easy to track */
-	printf("\t\tflags:\t\t%08x\n", param->flags);
-	printf("\t\thostptr:\t%08x\n", param->hostptr);
+	trace("\t\tflags:\t\t%08x\n", param->flags);
+	trace("\t\thostptr:\t%08x\n", param->hostptr);
 	if (param->gpuaddr) {
 		len = param->gpuaddr;
 	} else {
@@ -1001,7 +2399,8 @@ static void kgsl_ioctl_sharedmem_from_vmalloc_pre(int fd,
 #ifdef FAKE
 	param->gpuaddr = alloc_gpuaddr(len);
 #endif
-	printf("\t\tlen:\t\t%08x\n", len);
+	trace("\t\tlen:\t\t%08x\n", len);
+	log_extra(&len, sizeof(len));
 }
 
 static void kgsl_ioctl_sharedmem_from_vmalloc_post(int fd,
@@ -1010,23 +2409,27 @@ static void kgsl_ioctl_sharedmem_from_vmalloc_post(int fd,
 	struct buffer *buf = find_buffer((void *)param->hostptr, 0, 0, 0, 0);
 	log_gpuaddr(param->gpuaddr, len_from_vma(param->hostptr));
 	if (buf)
-		buf->gpuaddr = param->gpuaddr;
-	printf("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
+		set_gpuaddr(buf, param->gpuaddr);
+	trace("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
 }
 
 static void kgsl_ioctl_sharedmem_free_pre(int fd,
 		struct kgsl_sharedmem_free *param)
 {
 	struct buffer *buf = find_buffer((void *)-1, param->gpuaddr, 0, 0, 0);
-	printf("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
+	trace("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
+#ifdef FAKE
+	/* not all of these are registered buffers: */
+	free_gpuaddr(param->gpuaddr);
+#endif
 	unregister_buffer(buf);
 }
 
 static void kgsl_ioctl_gpumem_alloc_pre(int fd,
 		struct kgsl_gpumem_alloc *param)
 {
-	printf("\t\tflags:\t\t%08x\n", param->flags);
-	printf("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
+	trace("\t\tflags:\t\t%08x\n", param->flags);
+	trace("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
 }
 
 static void kgsl_ioctl_gpumem_alloc_post(int fd,
@@ -1034,18 +2437,18 @@ static void kgsl_ioctl_gpumem_alloc_post(int fd,
 {
 	struct buffer *buf;
 	log_gpuaddr(param->gpuaddr, param->size);
-	printf("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
+	trace("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
 	/* NOTE: host addr comes from mmap'ing w/ gpuaddr as offset */
 	buf = register_buffer(NULL, param->flags, param->size, 0);
-	buf->gpuaddr = param->gpuaddr;
+	set_gpuaddr(buf, param->gpuaddr);
 	buf->offset = param->gpuaddr;
 }
 
 static void kgsl_ioctl_gpumem_alloc_id_pre(int fd,
 		struct kgsl_gpumem_alloc_id *param)
 {
-	printf("\t\tflags:\t\t%08x\n", param->flags);
-	printf("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
+	trace("\t\tflags:\t\t%08x\n", param->flags);
+	trace("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
 	/* easier to force it not to USE_CPU_MAP than dealing with
 	 * the mmap dance:
 	 */
@@ -1061,29 +2464,37 @@ static void kgsl_ioctl_gpumem_alloc_id_post(int fd,
 
 	param->id = ++id;
 	param->mmapsize = ALIGN(param->size, 0x1000);
-	param->gpuaddr = alloc_gpuaddr(param->mmapsize);
+	/* a preset gpuaddr is honored, so that rdreplay can recreate buffers
+	 * at the addresses they were captured at:
+	 */
+	if (!param->gpuaddr)
+		param->gpuaddr = alloc_gpuaddr(param->mmapsize);
 #endif
 
 	log_gpuaddr(param->gpuaddr, param->size);
-	printf("\t\tid:\t%u\n", param->id);
-	printf("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
+	trace("\t\tid:\t%u\n", param->id);
+	trace("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
 	/* NOTE: host addr comes from mmap'ing w/ gpuaddr as offset */
 	buf = register_buffer(NULL, param->flags, param->size, 0);
-	buf->id = param->id;
-	buf->gpuaddr = param->gpuaddr;
+	set_id(buf, param->id);
+	set_gpuaddr(buf, param->gpuaddr);
 	buf->offset = param->gpuaddr;
 }
 
 static void kgsl_ioctl_gpumem_free_id_pre(int fd,
 		struct kgsl_gpumem_free_id *param)
 {
-	printf("\t\tid:\t%u\n", param->id);
+	trace("\t\tid:\t%u\n", param->id);
 }
 
 static void kgsl_ioctl_gpumem_free_id_post(int fd,
 		struct kgsl_gpumem_free_id *param)
 {
 	struct buffer *buf = find_buffer((void *)-1, 0, 0, 0, param->id);
+#ifdef FAKE
+	if (buf)
+		free_gpuaddr(buf->gpuaddr);
+#endif
 	unregister_buffer(buf);
 }
 
@@ -1092,8 +2503,8 @@ static void kgls_ioctl_perfcounter_get_post(int fd,
 {
 	char buf[128];
 
-	printf("\t\tgroupid:\t%u\n", param->groupid);
-	printf("\t\tcountable:\t%u\n", param->countable);
+	trace("\t\tgroupid:\t%u\n", param->groupid);
+	trace("\t\tcountable:\t%u\n", param->countable);
 #ifdef FAKE
 	int g = param->groupid % 128;
 	int c = param->countable % 128;
@@ -1117,8 +2528,8 @@ static void kgls_ioctl_perfcounter_get_post(int fd,
 	param->offset = cache[g][c].lo;
 	param->offset_hi = cache[g][c].hi;
 #endif
-	printf("\t\toffset_lo:\t0x%x\n", param->offset);
-	printf("\t\toffset_hi:\t0x%x\n", param->offset_hi);
+	trace("\t\toffset_lo:\t0x%x\n", param->offset);
+	trace("\t\toffset_hi:\t0x%x\n", param->offset_hi);
 
 	rd_write_section(RD_CMD, buf, snprintf(buf, sizeof(buf),
 			"perfcounter_get: groupid=%u, countable=%u, off_lo=0x%x, off_hi=0x%x",
@@ -1130,8 +2541,8 @@ static void kgls_ioctl_perfcounter_put_pre(int fd,
 {
 	char buf[128];
 
-	printf("\t\tgroupid:\t%u\n", param->groupid);
-	printf("\t\tcountable:\t%u\n", param->countable);
+	trace("\t\tgroupid:\t%u\n", param->groupid);
+	trace("\t\tcountable:\t%u\n", param->countable);
 
 	rd_write_section(RD_CMD, buf, snprintf(buf, sizeof(buf),
 			"perfcounter_put: groupid=%u, countable=%u",
@@ -1141,8 +2552,8 @@ static void kgls_ioctl_perfcounter_put_pre(int fd,
 static void kgls_ioctl_gpuobj_alloc_pre(int fd,
 		struct kgsl_gpuobj_alloc *param)
 {
-	printf("\t\tflags:\t\t%08x %08x\n", (uint32_t)(param->flags >> 32), (uint32_t)param->flags);
-	printf("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
+	trace("\t\tflags:\t\t%08x %08x\n", (uint32_t)(param->flags >> 32), (uint32_t)param->flags);
+	trace("\t\tsize:\t\t%08x\n", (uint32_t)param->size);
 	/* easier to force it not to USE_CPU_MAP than dealing with
 	 * the mmap dance:
 	 */
@@ -1159,29 +2570,33 @@ static void kgls_ioctl_gpuobj_alloc_post(int fd,
 	param->id = ++id;
 	param->mmapsize = ALIGN(param->size, 0x1000);
 #endif
-	printf("\t\tid:\t%u\n", param->id);
+	trace("\t\tid:\t%u\n", param->id);
 	/* NOTE: host addr comes from mmap'ing w/ gpuaddr as offset */
 	buf = register_buffer(NULL, param->flags, param->size, 0);
-	buf->id = param->id;
+	set_id(buf, param->id);
 }
 
 static void kgls_ioctl_gpuobj_free_pre(int fd,
 		struct kgsl_gpuobj_free *param)
 {
-	printf("\t\tid:\t%u\n", param->id);
+	trace("\t\tid:\t%u\n", param->id);
 }
 
 static void kgls_ioctl_gpuobj_free_post(int fd,
 		struct kgsl_gpuobj_free *param)
 {
 	struct buffer *buf = find_buffer((void *)-1, 0, 0, 0, param->id);
+#ifdef FAKE
+	if (buf && buf->gpuaddr)
+		free_gpuaddr(buf->gpuaddr);
+#endif
 	unregister_buffer(buf);
 }
 
 static void kgsl_ioclt_gpuobj_info_pre(int fd,
 		struct kgsl_gpuobj_info *param)
 {
-	printf("\t\tid:\t%u\n", param->id);
+	trace("\t\tid:\t%u\n", param->id);
 }
 
 static void kgsl_ioclt_gpuobj_info_post(int fd,
@@ -1190,15 +2605,19 @@ static void kgsl_ioclt_gpuobj_info_post(int fd,
 	struct buffer *buf = find_buffer((void *)-1, 0, 0, 0, param->id);
 #ifdef FAKE
 	param->size = buf->len;
-	param->gpuaddr = alloc_gpuaddr(ALIGN(buf->len, 0x1000));
+	/* the gpuaddr is assigned on first query, after that it is stable: */
+	if (!buf->gpuaddr)
+		param->gpuaddr = alloc_gpuaddr(ALIGN(buf->len, 0x1000));
+	else
+		param->gpuaddr = buf->gpuaddr;
 	param->va_addr = param->gpuaddr;
 	param->va_len = buf->len;
 #endif
 
 	log_gpuaddr(param->gpuaddr, param->size);
-	printf("\t\tid:\t%u\n", param->id);
-	printf("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
-	buf->gpuaddr = param->gpuaddr;
+	trace("\t\tid:\t%u\n", param->id);
+	trace("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
+	set_gpuaddr(buf, param->gpuaddr);
 	buf->offset = param->gpuaddr;
 }
 
@@ -1211,28 +2630,76 @@ static void kgls_ioctl_gpuobj_gpu_command_pre(int fd,
 	dump_ib_prep();
 
 	cmdobj = (struct kgsl_command_object *)param->cmdlist;
+	log_extra(cmdobj, param->numcmds * sizeof(*cmdobj));
 
-	printf("\t\tdrawctxt_id:\t%08x\n", param->context_id);
-	printf("\t\tflags:\t\t%08x %08x\n", (uint32_t)(param->flags >> 32), (uint32_t)param->flags);
-	printf("\t\tnumcmds:\t\t%08x\n", param->numcmds);
+	trace("\t\tdrawctxt_id:\t%08x\n", param->context_id);
+	trace("\t\tflags:\t\t%08x %08x\n", (uint32_t)(param->flags >> 32), (uint32_t)param->flags);
+	trace("\t\tnumcmds:\t\t%08x\n", param->numcmds);
 
 	for (i = 0; i < param->numcmds; i++) {
-		printf("\t\tcmd[%d].flags:\t\t%08x\n", i, cmdobj[i].flags);
-		printf("\t\tcmd[%d].sizedwords:\t%08x\n", i, (uint32_t)cmdobj[i].size / 4);
-		printf("\t\tcmd[%d].gpuaddr:\t%08x\n", i, cmdobj[i].gpuaddr);
+		trace("\t\tcmd[%d].flags:\t\t%08x\n", i, cmdobj[i].flags);
+		trace("\t\tcmd[%d].sizedwords:\t%08x\n", i, (uint32_t)cmdobj[i].size / 4);
+		trace("\t\tcmd[%d].gpuaddr:\t%08x\n", i, cmdobj[i].gpuaddr);
 		dump_cmd(&cmdobj[i]);
 	}
+
+	rd_capture_end();
 }
 
 static void kgls_ioctl_gpuobj_gpu_command_post(int fd,
 		struct kgsl_gpu_command *param)
 {
-	printf("\t\ttimestamp:\t%08x\n", param->timestamp);
+	trace("\t\ttimestamp:\t%08x\n", param->timestamp);
+}
+
+/* take the locks needed by the handlers for an ioctl, see above: */
+static void kgsl_ioctl_lock(unsigned long int request, int lock)
+{
+	int capture = 0, buffers = 0;
+
+	switch(_IOC_NR(request)) {
+	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
+	case _IOC_NR(IOCTL_KGSL_SUBMIT_COMMANDS):
+	case _IOC_NR(IOCTL_KGSL_GPU_COMMAND):
+		/* dumps buffers and cmdstream, staged until rd_capture_end(): */
+		buffers = 'r';
+		break;
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC):
+	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FREE):
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC):
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC_ID):
+	case _IOC_NR(IOCTL_KGSL_GPUMEM_FREE_ID):
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_ALLOC):
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_FREE):
+	case _IOC_NR(IOCTL_KGSL_GPUOBJ_INFO):
+		/* logs gpuaddr, and adds/removes/updates buffers: */
+		capture = 1;
+		buffers = 'w';
+		break;
+	case _IOC_NR(IOCTL_KGSL_DEVICE_GETPROPERTY):
+	case _IOC_NR(IOCTL_KGSL_PERFCOUNTER_GET):
+	case _IOC_NR(IOCTL_KGSL_PERFCOUNTER_PUT):
+		capture = 1;
+		break;
+	}
+
+	if (lock) {
+		if (buffers == 'r')
+			BUFFERS_RDLOCK();
+		else if (buffers == 'w')
+			BUFFERS_WRLOCK();
+		if (capture)
+			rd_lock();
+	} else {
+		if (capture)
+			rd_unlock();
+		if (buffers)
+			BUFFERS_UNLOCK();
+	}
 }
 
 static void kgsl_ioctl_pre(int fd, unsigned long int request, void *ptr)
 {
-	dump_ioctl(get_kgsl_info(fd), _IOC_WRITE, fd, request, ptr, 0);
 	switch(_IOC_NR(request)) {
 	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
 		kgsl_ioctl_ringbuffer_issueibcmds_pre(fd, ptr);
@@ -1278,7 +2745,6 @@ static void kgsl_ioctl_pre(int fd, unsigned long int request, void *ptr)
 
 static void kgsl_ioctl_post(int fd, unsigned long int request, void *ptr, int ret)
 {
-	dump_ioctl(get_kgsl_info(fd), _IOC_READ, fd, request, ptr, ret);
 	switch(_IOC_NR(request)) {
 	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
 		kgsl_ioctl_ringbuffer_issueibcmds_post(fd, ptr);
@@ -1322,11 +2788,26 @@ static void kgsl_ioctl_post(int fd, unsigned long int request, void *ptr, int re
 	}
 }
 
+/* a GPU hang or fault shows up as an error waiting on a timestamp, which
+ * triggers writing out the flight recorder ring (WRAP_RING):
+ */
+static void check_wait_error(unsigned long int request, int ret, int err)
+{
+	switch (_IOC_NR(request)) {
+	case _IOC_NR(IOCTL_KGSL_DEVICE_WAITTIMESTAMP):
+	case _IOC_NR(IOCTL_KGSL_DEVICE_WAITTIMESTAMP_CTXTID):
+		if ((ret < 0) && (err != ETIMEDOUT) && (err != EINTR) && (err != EAGAIN))
+			rd_ring_trigger("error waiting for timestamp");
+		break;
+	}
+}
+
 // XXX android/bionic has messed up ioctl signature:
 int ioctl(int fd, unsigned long request, ...)
 {
 	int ioc_size = _IOC_SIZE(request);
-	int ret;
+	uint64_t start = 0;
+	int ret, err;
 	PROLOG(ioctl);
 	void *ptr;
 
@@ -1343,8 +2824,6 @@ int ioctl(int fd, unsigned long request, ...)
 		ptr = NULL;
 	}
 
-	LOCK();
-
 	if (!get_kgsl_info(fd)) {
 		char path[64];
 		char buf[256];
@@ -1355,16 +2834,26 @@ int ioctl(int fd, unsigned long request, ...)
 		ret = readlink(path, buf, sizeof(buf));
 		if (ret > 0) {
 			buf[ret] = '\0';
+			FD_LOCK();
 			ret = install_fd(buf, fd);
+			FD_UNLOCK();
 			if (ret)
 				return ret;
 		}
 	}
 
-	if (get_kgsl_info(fd))
+	if (get_kgsl_info(fd)) {
+		dump_ioctl(get_kgsl_info(fd), _IOC_WRITE, fd, request, ptr, 0);
+		kgsl_ioctl_lock(request, 1);
 		kgsl_ioctl_pre(fd, request, ptr);
-	else
-		printf("> [%4d]         : <unknown> (%08lx)\n", fd, (long)request);
+		kgsl_ioctl_lock(request, 0);
+		if (wrap_evlog())
+			log_ioctl_end(ptr);
+	} else if (wrap_evlog()) {
+		log_ioctl(NULL, _IOC_WRITE, fd, request, ptr, 0);
+	} else {
+		trace("> [%4d]         : <unknown> (%08lx)\n", fd, (long)request);
+	}
 
 	if ((_IOC_NR(request) == _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS)) &&
 			get_kgsl_info(fd) && wrap_safe()) {
@@ -1372,7 +2861,8 @@ int ioctl(int fd, unsigned long request, ...)
 		sleep(1);
 	}
 
-	UNLOCK();
+	if (wrap_stats())
+		start = stats_time();
 
 #ifdef FAKE
 	if (file_table[fd].is_emulated) {
@@ -1392,14 +2882,26 @@ int ioctl(int fd, unsigned long request, ...)
 		ret = orig_ioctl(fd, request, ptr);
 	}
 
-	LOCK();
+	err = errno;
 
-	if (get_kgsl_info(fd))
-		kgsl_ioctl_post(fd, request, ptr, ret);
-	else
-		printf("< [%4d]         : <unknown> (%08lx) (%d)\n", fd, (long)request, ret);
+	if (wrap_ring() && get_kgsl_info(fd))
+		check_wait_error(request, ret, err);
 
-	UNLOCK();
+	if (wrap_stats() && get_kgsl_info(fd))
+		stats_ioctl(request, ptr, ret, stats_time() - start);
+
+	if (get_kgsl_info(fd)) {
+		dump_ioctl(get_kgsl_info(fd), _IOC_READ, fd, request, ptr, ret);
+		kgsl_ioctl_lock(request, 1);
+		kgsl_ioctl_post(fd, request, ptr, ret);
+		kgsl_ioctl_lock(request, 0);
+		if (wrap_evlog())
+			log_ioctl_end(ptr);
+	} else if (wrap_evlog()) {
+		log_ioctl(NULL, _IOC_READ, fd, request, ptr, ret);
+	} else {
+		trace("< [%4d]         : <unknown> (%08lx) (%d)\n", fd, (long)request, ret);
+	}
 
 	if ((_IOC_NR(request) == _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS)) &&
 			get_kgsl_info(fd) && wrap_safe()) {
@@ -1407,6 +2909,8 @@ int ioctl(int fd, unsigned long request, ...)
 		sleep(1);
 	}
 
+	errno = err;
+
 	return ret;
 }
 
@@ -1415,25 +2919,28 @@ void * mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset
 	void *ret = NULL;
 	PROLOG(mmap);
 
-	LOCK();
-
 	if ((fd >= 0) && get_kgsl_info(fd)) {
 		//struct buffer *buf = find_buffer(NULL, 0, offset, 0, 0);
-		struct buffer *buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
+		struct buffer *buf;
 
-		printf("< [%4d]         : mmap: addr=%p, length=%u, prot=%x, flags=%x, offset=%08lx\n",
-				fd, addr, (uint32_t)length, prot, flags, offset);
+		BUFFERS_RDLOCK();
+		buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
+
+		if (!wrap_stats())
+			printf("< [%4d]         : mmap: addr=%p, length=%u, prot=%x, flags=%x, offset=%08lx\n",
+					fd, addr, (uint32_t)length, prot, flags, offset);
 
 		if (buf && buf->hostptr) {
 			buf->munmap = 0;
 			ret = buf->hostptr;
 		}
+		BUFFERS_UNLOCK();
 	}
 
 	if (!ret) {
 #ifdef FAKE
 		if ((fd >= 0) && file_table[fd].is_emulated) {
-			ret = malloc(length);
+			ret = alloc_hostmem(length);
 		} else {
 			ret = orig_mmap(addr, length, prot, flags, fd, offset);
 		}
@@ -1444,9 +2951,12 @@ void * mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset
 
 	if ((fd >= 0) && get_kgsl_info(fd)) {
 		//struct buffer *buf = find_buffer(NULL, 0, offset, 0, 0);
-		struct buffer *buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
+		struct buffer *buf;
+
+		BUFFERS_WRLOCK();
+		buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
 		if (buf)
-			buf->hostptr = ret;
+			set_hostptr(buf, ret);
 		else {
 			/*
 			 * when a buffer is allocated using IOCTL_KGSL_GPUMEM_ALLOC_ID
@@ -1455,13 +2965,13 @@ void * mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset
 			 */
 			buf = find_buffer(NULL, 0, 0, 0, offset >> 12);
 			if (buf)
-				buf->hostptr = ret;
+				set_hostptr(buf, ret);
 		}
-		printf("< [%4d]         : mmap: -> (%p)\n", fd, ret);
+		BUFFERS_UNLOCK();
+		if (!wrap_stats())
+			printf("< [%4d]         : mmap: -> (%p)\n", fd, ret);
 	}
 
-	UNLOCK();
-
 	return ret;
 }
 
@@ -1470,26 +2980,30 @@ void *mmap64(void *addr, size_t length, int prot, int flags, int fd, int64_t off
 	void *ret = NULL;
 	PROLOG(mmap64);
 
-	LOCK();
-
 	if ((fd >= 0) && get_kgsl_info(fd)) {
 		//struct buffer *buf = find_buffer(NULL, 0, offset, 0, 0);
-		struct buffer *buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
+		struct buffer *buf;
 
-		printf("< [%4d]         : mmap64: addr=%p, length=%u, prot=%x, flags=%x, offset=%08lx\n",
-				fd, addr, (uint32_t)length, prot, flags, offset);
+		BUFFERS_RDLOCK();
+		buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
+
+		if (!wrap_stats())
+			printf("< [%4d]         : mmap64: addr=%p, length=%u, prot=%x, flags=%x, offset=%08lx\n",
+					fd, addr, (uint32_t)length, prot, flags, offset);
 
 		if (buf && buf->hostptr) {
-			printf("  [%4d]	    : (recycled from buf=%p)\n", fd, buf);
+			if (!wrap_stats())
+				printf("  [%4d]	    : (recycled from buf=%p)\n", fd, buf);
 			buf->munmap = 0;
 			ret = buf->hostptr;
 		}
+		BUFFERS_UNLOCK();
 	}
 
 	if (!ret) {
 #ifdef FAKE
 		if ((fd >= 0) && file_table[fd].is_emulated) {
-			ret = calloc(1, length);
+			ret = alloc_hostmem(length);
 		} else {
 			ret = orig_mmap64(addr, length, prot, flags, fd, offset);
 		}
@@ -1500,9 +3014,12 @@ void *mmap64(void *addr, size_t length, int prot, int flags, int fd, int64_t off
 
 	if ((fd >= 0) && get_kgsl_info(fd)) {
 		//struct buffer *buf = find_buffer(NULL, 0, offset, 0, 0);
-		struct buffer *buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
+		struct buffer *buf;
+
+		BUFFERS_WRLOCK();
+		buf = find_buffer(NULL, 0, 0, 0, offset >> 12); // XXX only id's are used now
 		if (buf)
-			buf->hostptr = ret;
+			set_hostptr(buf, ret);
 		else {
 			/*
 			 * when a buffer is allocated using IOCTL_KGSL_GPUMEM_ALLOC_ID
@@ -1511,35 +3028,41 @@ void *mmap64(void *addr, size_t length, int prot, int flags, int fd, int64_t off
 			 */
 			buf = find_buffer(NULL, 0, 0, 0, offset >> 12);
 			if (buf)
-				buf->hostptr = ret;
+				set_hostptr(buf, ret);
 		}
-		printf("< [%4d]         : mmap64: -> (%p), buf=%p\n", fd, ret, buf);
+		BUFFERS_UNLOCK();
+		if (!wrap_stats())
+			printf("< [%4d]         : mmap64: -> (%p), buf=%p\n", fd, ret, buf);
 	}
 
-	UNLOCK();
-
 	return ret;
 }
 
 int munmap(void *addr, size_t length)
 {
+	int locked = buffers_locked;
 	struct buffer *buf;
-	int ret;
 	PROLOG(munmap);
 
-	LOCK();
-
+	/* free() can end up here, while we already hold the lock: */
+	if (!locked)
+		BUFFERS_RDLOCK();
 	buf = find_buffer(addr, 0, 0, 0, 0);
-	if (buf) {
-		/* we need the contents at submit ioctl: */
-printf("fake munmap: buf=%p\n", buf);
+	/* we need the contents at submit ioctl: */
+	if (buf)
 		buf->munmap = 1;
-		ret = 0;
-		goto out;
-	}
+	if (!locked)
+		BUFFERS_UNLOCK();
 
-	ret = orig_munmap(addr, length);
-out:
-	UNLOCK();
-	return ret;
+	if (buf)
+		return 0;
+
+	rd_cow_release(addr, length);
+
+#ifdef FAKE
+	if (free_hostmem(addr, length))
+		return 0;
+#endif
+
+	return orig_munmap(addr, length);
 }
@@ -21,19 +21,83 @@
  * SOFTWARE.
  */
 
+#include <limits.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
 #include "wrap.h"
 
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
 static int fd = -1;
 static unsigned int gpu_id;
 
+/* 128b hash of buffer contents.  Wide enough that a collision, which would
+ * make a RD_BUFFER_REF point at the wrong contents, is not a concern, so the
+ * contents themselves need not be kept around to compare against:
+ */
+struct content_hash {
+	uint64_t lo, hi;
+};
+
+/* with WRAP_DEDUP, content hashes of the RD_BUFFER_CONTENTS sections already
+ * written to the current rd file, so identical contents can be written as a
+ * RD_BUFFER_REF to the earlier section instead:
+ */
+struct dedup_entry {
+	struct content_hash hash;
+	uint32_t len;          /* zero for empty slots */
+	uint32_t idx;          /* index of RD_BUFFER_CONTENTS section in file */
+};
+
+static struct dedup_entry *dedup_table;
+static unsigned int dedup_size, dedup_count;
+static uint32_t nbuffers;  /* # of RD_BUFFER_CONTENTS in current file */
+static unsigned int file_id;
+
+/* index of the sections written to the current rd file, appended as a
+ * RD_INDEX section when the file is closed:
+ */
+static struct rd_index_entry *index_entries;
+static unsigned int index_count, index_size;
+static uint64_t file_offset;     /* logical (uncompressed) write position */
+static uint64_t index_gpuaddr;   /* of the most recent RD_GPUADDR */
+static uint32_t index_len;
+static uint32_t submit;          /* # of submits so far, see rd_capture_end() */
+
+static int ring_flushing;        /* writing out the WRAP_RING, see rd_ring_flush() */
+static int rd_write_failed;      /* drop output until the next rd file */
+
 #ifdef USE_PTHREADS
 static pthread_mutex_t l = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
 #endif
 
+/* serializes writing to the rd file, see rd_lock(): */
+static pthread_mutex_t rd_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+
 char *getcwd(char *buf, size_t size);
 
 int __android_log_print(int prio, const char *tag,  const char *fmt, ...);
 
+static int rd_open(const char *path);
+static void rd_async_flush(void);
+static void rd_index_section(enum rd_sect_type type, uint32_t sz,
+		const struct iovec *iov);
+static void rd_write_index(void);
+static void rd_exit(void);
+static int rd_stage_sectionv(enum rd_sect_type type, const struct iovec *iov,
+		int iovcnt, int buffer, struct content_hash hash);
+static void rd_write_buffer_hashed(const void *buf, int sz,
+		struct content_hash hash);
+struct stage;
+static void rd_ring_push(struct stage *st);
+
 static char tracebuf[4096], *tracebufp = tracebuf;
 
 int wrap_printf(const char *format, ...)
@@ -75,8 +139,15 @@ void rd_start(const char *name, const char *fmt, ...)
 	static int cnt = 0;
 	int n = cnt++;
 	const char *testnum;
+	unsigned int i;
 	va_list  args;
 
+	rd_lock();
+
+	/* make sure anything still queued goes to the previous file: */
+	if (fd != -1)
+		rd_end();
+
 	testnum = getenv("TESTNUM");
 	if (testnum) {
 		n = strtol(testnum, NULL, 0);
@@ -85,7 +156,22 @@ void rd_start(const char *name, const char *fmt, ...)
 		sprintf(buf, "/sdcard/trace.rd");
 	}
 
-	fd = open(buf, O_WRONLY| O_TRUNC | O_CREAT, 0644);
+	fd = rd_open(buf);
+	file_id++;
+
+	if (file_id == 1)
+		atexit(rd_exit);
+
+	file_offset = 0;
+	index_count = 0;
+	index_gpuaddr = 0;
+	index_len = 0;
+
+	/* earlier contents are not visible to readers of the new file: */
+	nbuffers = 0;
+	dedup_count = 0;
+	if (dedup_table)
+		memset(dedup_table, 0, dedup_size * sizeof(dedup_table[0]));
 
 	va_start(args, fmt);
 	vsprintf(buf, fmt, args);
@@ -100,12 +186,37 @@ void rd_start(const char *name, const char *fmt, ...)
 		 */
 		rd_write_section(RD_GPU_ID, &gpu_id, sizeof(gpu_id));
 	}
+
+	rd_unlock();
 }
 
 void rd_end(void)
 {
-	close(fd);
-	fd = -1;
+	rd_lock();
+	if (fd != -1) {
+		/* no point in an index after a write error: */
+		if (!rd_write_failed)
+			rd_write_index();
+		rd_async_flush();
+		close(fd);
+		fd = -1;
+	}
+	rd_unlock();
+}
+
+/* Sections written by a single rd_write_section() are never interleaved
+ * with those from other threads, but callers which need a sequence of
+ * sections to stay together (ie. RD_GPUADDR followed by the buffer contents)
+ * should hold the lock around the whole sequence:
+ */
+void rd_lock(void)
+{
+	pthread_mutex_lock(&rd_mutex);
+}
+
+void rd_unlock(void)
+{
+	pthread_mutex_unlock(&rd_mutex);
 }
 
 #if 0
@@ -114,110 +225,1806 @@ volatile int*  __errno( void );
 #define errno (*__errno())
 #endif
 
+static int rd_streaming;         /* fd is a WRAP_STREAM socket */
+static int on_async_thread(void);
+
+/* the writer thread must not exit(), since the atexit handlers would wait
+ * for it to flush the ring.  So it gives up on the current file instead,
+ * as does everyone if the consumer of a stream went away.  Either way no
+ * more is written, so that rd_exit() does not hit the error again:
+ */
+static void rd_write_error(int err)
+{
+	int disconnected = rd_streaming &&
+			((err == EPIPE) || (err == ECONNRESET));
+
+	rd_write_failed = 1;
+	if (!disconnected && !on_async_thread())
+		exit(-1);
+	printf("dropping further output to the rd file\n");
+}
+
+/* write to a socket w/out raising SIGPIPE if the consumer went away: */
+static ssize_t fd_write(int fd, const void *buf, size_t sz)
+{
+	if (rd_streaming)
+		return send(fd, buf, sz, MSG_NOSIGNAL);
+	return write(fd, buf, sz);
+}
+
+static ssize_t fd_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (rd_streaming) {
+		struct msghdr msg = {
+				.msg_iov    = (struct iovec *)iov,
+				.msg_iovlen = iovcnt,
+		};
+		return sendmsg(fd, &msg, MSG_NOSIGNAL);
+	}
+	return writev(fd, iov, iovcnt);
+}
+
 static void rd_write(const void *buf, int sz)
 {
 	const uint8_t *cbuf = buf;
+
+	if (rd_write_failed)
+		return;
+
 	while (sz > 0) {
-		int ret = write(fd, cbuf, sz);
+		int ret = fd_write(fd, cbuf, sz);
 		if (ret < 0) {
-			printf("error: %d (%s)\n", ret, strerror(errno));
+			int err = errno;
+			printf("error: %d (%s)\n", ret, strerror(err));
 			printf("fd=%d, buf=%p, sz=%d\n", fd, buf, sz);
-			exit(-1);
+			rd_write_error(err);
+			return;
 		}
 		cbuf += ret;
 		sz -= ret;
 	}
 }
 
-void rd_write_section(enum rd_sect_type type, const void *buf, int sz)
+/*
+ * Asynchronous writer (WRAP_ASYNC):
+ *
+ * Rather than write()ing from the application's thread, sections are copied
+ * into a ring buffer, and a dedicated thread writes them out in large
+ * batches.  If the ring is full, the application blocks until there is space
+ * again.  With WRAP_ODIRECT the file is opened with O_DIRECT, in which case
+ * the writer only writes whole blocks until the ring is flushed by rd_end()
+ * (or at exit).
+ *
+ * With WRAP_COMPRESS, the writer thread also compresses the data in blocks
+ * before writing them (see RD_COMPRESSED_MAGIC), so the application's thread
+ * does not pay for that either.
+ *
+ * head and tail are running byte counts, so (head - tail) is the amount of
+ * data queued.  The writer thread drops the lock while writing, which is
+ * safe since producers never overwrite data between tail and head.
+ */
+
+#define ASYNC_BLOCK   0x1000     /* alignment/granularity for O_DIRECT */
+#define ASYNC_BATCH   0x40000    /* preferred minimum write size */
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;       /* data queued, or flush requested */
+	pthread_cond_t space;      /* data written */
+	uint8_t *buf;
+	uint64_t size;
+	uint64_t head, tail;
+	int flush;
+	int odirect;
+	int compress;
+	int running;
+	/* current compressed block, see rd_compress(): */
+	uint8_t *zin, *zout;
+	uint32_t zlen;
+} async = {
+	.lock  = PTHREAD_MUTEX_INITIALIZER,
+	.wake  = PTHREAD_COND_INITIALIZER,
+	.space = PTHREAD_COND_INITIALIZER,
+};
+
+static void rd_compress_block(void)
 {
-	uint32_t val = ~0;
+	uLongf zsz = compressBound(RD_COMPRESSED_BLOCK);
+	uint32_t hdr[2];
 
-	if (fd == -1) {
-		const char *name = getenv("TESTNAME");
-		if (!name)
-			name = "unknown";
-		rd_start(name, "");
-		printf("opened rd, %d\n", fd);
+	if (!async.zlen)
+		return;
+
+	if (compress2(async.zout, &zsz, async.zin, async.zlen,
+			async.compress) != Z_OK) {
+		printf("error: compression failed\n");
+		rd_write_error(0);
+		async.zlen = 0;
+		return;
 	}
 
-	if (type == RD_GPU_ID) {
-		gpu_id = *(unsigned int *)buf;
+	hdr[0] = zsz;
+	hdr[1] = async.zlen;
+	rd_write(hdr, sizeof(hdr));
+	rd_write(async.zout, zsz);
+
+	async.zlen = 0;
+}
+
+static void rd_compress(const void *buf, uint64_t sz)
+{
+	const uint8_t *cbuf = buf;
+
+	while (sz > 0) {
+		uint32_t n = min(sz, RD_COMPRESSED_BLOCK - async.zlen);
+
+		memcpy(async.zin + async.zlen, cbuf, n);
+		async.zlen += n;
+		cbuf += n;
+		sz -= n;
+
+		if (async.zlen == RD_COMPRESSED_BLOCK)
+			rd_compress_block();
 	}
+}
+
+/*
+ * Copy-on-write snapshots (WRAP_COW):
+ *
+ * Rather than copying large buffer snapshots into the ring, the pages lying
+ * entirely within the snapshot are write-protected and queued by reference,
+ * at their position in the stream.  The writer thread writes them straight
+ * from the application's memory, and then makes them writable again.  If
+ * the application writes to a page before that, rd_cow_fault() (called from
+ * the SIGSEGV handler) first saves a copy of the page for the writer.  So
+ * the application thread only pays for the pages that it actually modifies
+ * while the snapshot is in flight.
+ *
+ * rd_cow_fault() runs in the signal handler, so it neither takes locks nor
+ * allocates.  Each snapshot reserves room for a copy of all of its pages up
+ * front (only the pages actually copied are touched), and the pages are
+ * handed over between the faulting thread and the writer by their state:
+ *
+ *   COW_LIVE     to be written from the application's memory
+ *   COW_WRITING  being written from the application's memory
+ *   COW_COPYING  being copied
+ *   COW_SAVED    copied, the copy is written instead
+ *   COW_WRITTEN  written from the application's memory, no copy needed
+ *
+ * which only ever moves down the list, LIVE -> WRITING -> WRITTEN or LIVE ->
+ * COPYING -> SAVED.  A fault on a page that is being written waits for the
+ * writer, so the page cannot change underneath it.  A page is write-protected
+ * for as long as some queued snapshot covering it is not done with it.
+ *
+ * cow.lock serializes queueing, retiring and releasing snapshots.  The list
+ * of snapshots is modified with both async.lock and cow.lock held, in that
+ * order, but rd_cow_fault() walks it without either, so a snapshot is only
+ * freed once the faults in flight have drained.
+ */
 
-	rd_write(&val, 4);
-	rd_write(&val, 4);
+#define COW_MIN   0x10000    /* min payload size to snapshot by reference */
+#define COW_RUN   64         /* max # of pages written in one go */
 
-	rd_write(&type, 4);
-	val = ALIGN(sz, 4);
-	rd_write(&val, 4);
-	rd_write(buf, sz);
+enum {
+	COW_LIVE,
+	COW_WRITING,
+	COW_COPYING,
+	COW_SAVED,
+	COW_WRITTEN,
+};
 
-	val = 0;
-	rd_write(&val, ALIGN(sz, 4) - sz);
+struct cow_snap {
+	struct cow_snap *next;
+	uint8_t *ptr;
+	uint64_t len;
+	uint64_t pos;            /* stream position (async.head when queued) */
+	uint8_t *save;           /* room for a copy of each page */
+	int *state;              /* per page, COW_x */
+};
 
-	if (wrap_safe())
-		fsync(fd);
+static struct {
+	pthread_mutex_t lock;
+	struct cow_snap *first, **last;
+	uint64_t bytes;          /* total size of queued snapshots */
+	uintptr_t page_size;
+	int faults;              /* # of rd_cow_fault() calls in flight */
+} cow = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.last = &cow.first,
+};
+
+static void async_writev(const struct iovec *iov, int iovcnt);
+
+static void async_output(const void *buf, uint64_t sz)
+{
+	if (async.compress)
+		rd_compress(buf, sz);
+	else
+		rd_write(buf, sz);
 }
 
-unsigned int env2u(const char *name)
+static int cow_state(struct cow_snap *snap, uint64_t i)
 {
-	const char *str = getenv(name);
-	if (!str)
-		return 0;
-	return strtol(str, NULL, 0);
+	return __atomic_load_n(&snap->state[i], __ATOMIC_ACQUIRE);
 }
 
-/* in safe mode, sync log file frequently, and insert delays before/after
- * issueibcmds.. useful when we are crashing things and want to be sure to
- * capture as much of the log as possible
+static void cow_set_state(struct cow_snap *snap, uint64_t i, int state)
+{
+	__atomic_store_n(&snap->state[i], state, __ATOMIC_RELEASE);
+}
+
+static void cow_drain(void)
+{
+	while (__sync_fetch_and_add(&cow.faults, 0))
+		sched_yield();
+}
+
+/* save a copy of page i, unless the snapshot is already done with it.  Safe
+ * to call from the signal handler:
  */
-unsigned int wrap_safe(void)
+static void cow_save(struct cow_snap *snap, uint64_t i)
 {
-	static unsigned int val = -1;
-	if (val == -1) {
-		val = env2u("WRAP_SAFE");
+	for (;;) {
+		int state = cow_state(snap, i);
+
+		if ((state == COW_SAVED) || (state == COW_WRITTEN))
+			return;
+
+		if ((state == COW_LIVE) && __sync_bool_compare_and_swap(
+				&snap->state[i], COW_LIVE, COW_COPYING)) {
+			memcpy(snap->save + i * cow.page_size,
+					snap->ptr + i * cow.page_size, cow.page_size);
+			cow_set_state(snap, i, COW_SAVED);
+			return;
+		}
+
+		/* being written, or copied by another thread: */
+		sched_yield();
 	}
-	return val;
 }
 
-/* if non-zero, emulate a different gpu-id.  The issueibcmds will be stubbed
- * so we don't actually submit cmds to the gpu.  This is useful to generate
- * cmdstream dumps for different gpu versions for comparision.
+/* does a queued snapshot, other than skip, still need the page protected: */
+static int cow_protected(uint8_t *page, struct cow_snap *skip)
+{
+	struct cow_snap *snap;
+
+	for (snap = cow.first; snap; snap = snap->next) {
+		int state;
+
+		if ((snap == skip) || (page < snap->ptr) ||
+				(page >= (snap->ptr + snap->len)))
+			continue;
+
+		state = cow_state(snap, (page - snap->ptr) / cow.page_size);
+		if ((state != COW_SAVED) && (state != COW_WRITTEN))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* called from the writer thread, without async.lock held: */
+static void cow_write(struct cow_snap *snap)
+{
+	uint64_t i, j, k, npages = snap->len / cow.page_size;
+
+	for (i = 0; i < npages; i = j) {
+		/* claim a run of pages to write from the application's memory: */
+		for (j = i; (j < npages) && ((j - i) < COW_RUN); j++)
+			if (!__sync_bool_compare_and_swap(&snap->state[j],
+					COW_LIVE, COW_WRITING))
+				break;
+
+		if (j > i) {
+			async_output(snap->ptr + i * cow.page_size,
+					(j - i) * cow.page_size);
+			for (k = i; k < j; k++)
+				cow_set_state(snap, k, COW_WRITTEN);
+			continue;
+		}
+
+		/* otherwise the page is saved, or about to be: */
+		while (cow_state(snap, i) != COW_SAVED)
+			sched_yield();
+		async_output(snap->save + i * cow.page_size, cow.page_size);
+		j = i + 1;
+	}
+}
+
+/* remove a written snapshot, and unprotect the pages no longer needed by
+ * any other queued snapshot.  Called with async.lock held:
  */
-unsigned int wrap_gpu_id(void)
+static void cow_retire(struct cow_snap *snap)
 {
-	static unsigned int val = -1;
-	if (val == -1) {
-		val = env2u("WRAP_GPU_ID");
+	uint64_t i, run = 0, npages = snap->len / cow.page_size;
+
+	pthread_mutex_lock(&cow.lock);
+
+	/* unprotect before unlinking, so that a fault on one of the pages in
+	 * between still finds the snapshot:
+	 */
+	for (i = 0; i <= npages; i++) {
+		uint8_t *page = snap->ptr + i * cow.page_size;
+
+		if ((i < npages) && (cow_state(snap, i) == COW_WRITTEN) &&
+				!cow_protected(page, snap))
+			continue;
+
+		/* end of a run of pages to unprotect: */
+		if (run < i)
+			mprotect(snap->ptr + run * cow.page_size,
+					(i - run) * cow.page_size, PROT_READ | PROT_WRITE);
+		run = i + 1;
 	}
-	return val;
+
+	cow.first = snap->next;
+	if (!cow.first)
+		cow.last = &cow.first;
+	cow.bytes -= snap->len;
+
+	pthread_mutex_unlock(&cow.lock);
+
+	/* faults in flight could still be looking at it: */
+	cow_drain();
+
+	free(snap->save);
+	free(snap->state);
+	free(snap);
 }
 
-/* defaults to zero if $WRAP_GPU_ID does not end in a ".%d".. */
-unsigned int wrap_gpu_id_patchid(void)
+static void cow_queue(uint8_t *ptr, uint64_t len)
 {
-	static unsigned int val = -1;
-	if (val == -1) {
-		char *endptr = NULL;
-		const char *str = getenv("WRAP_GPU_ID");
-		if (str) {
-			unsigned int gpuid = strtol(str, &endptr, 0);
-			if (endptr[0] == '.') {
-				val = strtol(endptr + 1, NULL, 0);
+	struct cow_snap *snap = calloc(1, sizeof(*snap));
+	uint64_t i, npages = len / cow.page_size;
+
+	snap->ptr = ptr;
+	snap->len = len;
+	snap->state = calloc(npages, sizeof(snap->state[0]));
+	snap->save = malloc(len);
+
+	pthread_mutex_lock(&async.lock);
+
+	/* bound the memory that saved copies could take up: */
+	while (cow.bytes && ((cow.bytes + len) > async.size)) {
+		pthread_cond_signal(&async.wake);
+		pthread_cond_wait(&async.space, &async.lock);
+	}
+
+	pthread_mutex_lock(&cow.lock);
+	snap->pos = async.head;
+	__atomic_store_n(cow.last, snap, __ATOMIC_RELEASE);
+	cow.last = &snap->next;
+	cow.bytes += len;
+	/* a fault which started before the snapshot was queued could still
+	 * unprotect one of its pages, so let those finish first:
+	 */
+	cow_drain();
+	mprotect(ptr, len, PROT_READ);
+	/* and the pages saved by a fault in the meantime need no protection: */
+	for (i = 0; i < npages; i++)
+		if ((cow_state(snap, i) == COW_SAVED) &&
+				!cow_protected(ptr + i * cow.page_size, NULL))
+			mprotect(ptr + i * cow.page_size, cow.page_size,
+					PROT_READ | PROT_WRITE);
+	pthread_mutex_unlock(&cow.lock);
+
+	pthread_cond_signal(&async.wake);
+	pthread_mutex_unlock(&async.lock);
+}
+
+/* like async_writev(), but the page aligned part of large payloads is
+ * queued as a copy-on-write snapshot:
+ */
+static void cow_writev(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		uintptr_t base = (uintptr_t)iov[i].iov_base;
+		uintptr_t start = ALIGN(base, cow.page_size);
+		uintptr_t end = (base + iov[i].iov_len) & ~(cow.page_size - 1);
+		struct iovec part;
+
+		if ((iov[i].iov_len < COW_MIN) || (start >= end)) {
+			async_writev(&iov[i], 1);
+			continue;
+		}
+
+		part.iov_base = iov[i].iov_base;
+		part.iov_len  = start - base;
+		async_writev(&part, 1);
+
+		cow_queue((uint8_t *)start, end - start);
+
+		part.iov_base = (void *)end;
+		part.iov_len  = base + iov[i].iov_len - end;
+		async_writev(&part, 1);
+	}
+}
+
+/* handle a write fault on a page protected for a queued snapshot, returns
+ * non-zero if the access should be retried.  Called from the SIGSEGV
+ * handler, so no locking or allocation here:
+ */
+int rd_cow_fault(void *addr)
+{
+	static __thread void *last_fault;
+	uint8_t *page = (uint8_t *)((uintptr_t)addr & ~(cow.page_size - 1));
+	struct cow_snap *snap;
+	int found = 0;
+
+	if (!wrap_cow() || !cow.page_size)
+		return 0;
+
+	__sync_fetch_and_add(&cow.faults, 1);
+	for (snap = __atomic_load_n(&cow.first, __ATOMIC_ACQUIRE); snap;
+			snap = __atomic_load_n(&snap->next, __ATOMIC_ACQUIRE)) {
+		if ((page < snap->ptr) || (page >= (snap->ptr + snap->len)))
+			continue;
+
+		cow_save(snap, (page - snap->ptr) / cow.page_size);
+		found = 1;
+	}
+	if (found)
+		mprotect(page, cow.page_size, PROT_READ | PROT_WRITE);
+	__sync_fetch_and_sub(&cow.faults, 1);
+
+	if (found) {
+		last_fault = NULL;
+		return 1;
+	}
+
+	/* the writer could have unprotected the page before we looked, so
+	 * retry once before deciding that the fault is not ours:
+	 */
+	if (addr != last_fault) {
+		last_fault = addr;
+		return 1;
+	}
+
+	last_fault = NULL;
+	return 0;
+}
+
+/* called before memory that could be part of a queued snapshot is freed or
+ * unmapped, to save the pages still needed and unprotect them:
+ */
+void rd_cow_release(void *ptr, size_t len)
+{
+	uint8_t *start = ptr, *end = start + len;
+	struct cow_snap *snap;
+	int pass;
+
+	if (!wrap_cow() || !cow.page_size)
+		return;
+
+	pthread_mutex_lock(&cow.lock);
+	/* save copies for all the snapshots before unprotecting anything: */
+	for (pass = 0; pass < 2; pass++) {
+		for (snap = cow.first; snap; snap = snap->next) {
+			uint8_t *s = max(start, snap->ptr);
+			uint8_t *e = min(end, snap->ptr + snap->len);
+
+			if (s >= e)
+				continue;
+
+			s = (uint8_t *)((uintptr_t)s & ~(cow.page_size - 1));
+
+			if (pass) {
+				mprotect(s, e - s, PROT_READ | PROT_WRITE);
+				continue;
 			}
-		} else {
-			val = 0;
+
+			for (; s < e; s += cow.page_size)
+				cow_save(snap, (s - snap->ptr) / cow.page_size);
 		}
 	}
-	return val;
+	pthread_mutex_unlock(&cow.lock);
 }
 
-unsigned int wrap_gmem_size(void)
+static void * async_thread(void *arg)
 {
-	static unsigned int val = -1;
-	if (val == -1) {
-		val = env2u("WRAP_GMEM_SIZE");
+	pthread_mutex_lock(&async.lock);
+	for (;;) {
+		struct cow_snap *snap = cow.first;
+		uint64_t avail = (snap ? snap->pos : async.head) - async.tail;
+		uint64_t off, n;
+
+		if (snap && !avail) {
+			pthread_mutex_unlock(&async.lock);
+			cow_write(snap);
+			pthread_mutex_lock(&async.lock);
+			cow_retire(snap);
+			pthread_cond_broadcast(&async.space);
+			continue;
+		}
+
+		/* with a snapshot queued, write up to it without waiting: */
+		if ((avail < ASYNC_BATCH) && !async.flush && !snap) {
+			/* wait for a full batch, but don't let data linger: */
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			if (!pthread_cond_timedwait(&async.wake, &async.lock, &ts) ||
+					cow.first)
+				continue;
+			avail = async.head - async.tail;
+		}
+
+		if (async.odirect && !async.flush)
+			avail &= ~(uint64_t)(ASYNC_BLOCK - 1);
+
+		if (!avail) {
+			if (async.flush) {
+				if (async.compress) {
+					pthread_mutex_unlock(&async.lock);
+					rd_compress_block();
+					pthread_mutex_lock(&async.lock);
+				}
+				async.flush = 0;
+				pthread_cond_broadcast(&async.space);
+			}
+			continue;
+		}
+
+		if (async.odirect && (avail % ASYNC_BLOCK)) {
+			/* final partial block, can't be written w/ O_DIRECT: */
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			async.odirect = 0;
+		}
+
+		off = async.tail % async.size;
+		n = min(avail, async.size - off);
+
+		pthread_mutex_unlock(&async.lock);
+		async_output(async.buf + off, n);
+		pthread_mutex_lock(&async.lock);
+
+		async.tail += n;
+		pthread_cond_broadcast(&async.space);
+	}
+
+	return NULL;
+}
+
+static int on_async_thread(void)
+{
+	return async.running && pthread_equal(pthread_self(), async.thread);
+}
+
+static void async_writev(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	pthread_mutex_lock(&async.lock);
+	for (i = 0; i < iovcnt; i++) {
+		const uint8_t *cbuf = iov[i].iov_base;
+		uint64_t sz = iov[i].iov_len;
+
+		while (sz > 0) {
+			uint64_t off, n;
+
+			while ((async.head - async.tail) == async.size) {
+				pthread_cond_signal(&async.wake);
+				pthread_cond_wait(&async.space, &async.lock);
+			}
+
+			off = async.head % async.size;
+			n = min(sz, async.size - (async.head - async.tail));
+			n = min(n, async.size - off);
+
+			memcpy(async.buf + off, cbuf, n);
+			async.head += n;
+			cbuf += n;
+			sz -= n;
+		}
+	}
+
+	if ((async.head - async.tail) >= ASYNC_BATCH)
+		pthread_cond_signal(&async.wake);
+	pthread_mutex_unlock(&async.lock);
+}
+
+/* wait until everything queued has been written: */
+static void rd_async_flush(void)
+{
+	/* the writer thread can't wait for itself: */
+	if (!async.running || on_async_thread())
+		return;
+
+	/* the writer clears the flag once everything has been written, including
+	 * any partial compressed block:
+	 */
+	pthread_mutex_lock(&async.lock);
+	async.flush = 1;
+	pthread_cond_signal(&async.wake);
+	while (async.flush)
+		pthread_cond_wait(&async.space, &async.lock);
+	pthread_mutex_unlock(&async.lock);
+}
+
+static void rd_async_exit(void)
+{
+	rd_async_flush();
+	if (fd != -1)
+		fsync(fd);
+}
+
+/* starts the writer thread if needed, and returns extra flags to open the
+ * rd file with:
+ */
+static int rd_async_start(void)
+{
+	int flags = 0;
+
+	/* in safe mode, we want everything on disk asap: */
+	if (!(wrap_async() || wrap_compress() || wrap_cow()) || wrap_safe())
+		return 0;
+
+	if (!async.running) {
+		/* compression implies the writer thread, w/ a default size ring: */
+		async.size = ALIGN((uint64_t)(wrap_async() ? wrap_async() : 16) << 20,
+				ASYNC_BLOCK);
+		if (posix_memalign((void **)&async.buf, ASYNC_BLOCK, async.size)) {
+			printf("could not allocate %"PRIu64" byte ring\n", async.size);
+			return 0;
+		}
+		cow.page_size = sysconf(_SC_PAGESIZE);
+		pthread_create(&async.thread, NULL, async_thread, NULL);
+		atexit(rd_async_exit);
+		async.running = 1;
+	}
+
+	/* the previous file has been flushed, so the ring is empty.  Restart
+	 * it at a block boundary, since the final partial block of the previous
+	 * file leaves the tail unaligned for O_DIRECT:
+	 */
+	pthread_mutex_lock(&async.lock);
+	async.head = async.tail = 0;
+	async.odirect = 0;
+	pthread_mutex_unlock(&async.lock);
+
+	if (wrap_compress()) {
+		if (!async.zin) {
+			async.zin = malloc(RD_COMPRESSED_BLOCK);
+			async.zout = malloc(compressBound(RD_COMPRESSED_BLOCK));
+		}
+		async.compress = min(wrap_compress(), Z_BEST_COMPRESSION);
+		/* compressed blocks are not aligned, so no O_DIRECT: */
+		return 0;
+	}
+
+#ifdef O_DIRECT
+	/* snapshots are written from the application's memory, which need
+	 * not be suitably aligned for O_DIRECT:
+	 */
+	if (wrap_odirect() && !wrap_cow()) {
+		async.odirect = 1;
+		flags |= O_DIRECT;
+	}
+#endif
+
+	return flags;
+}
+
+/* connect to the consumer of a live stream (see util/rdrecv.c), a leading
+ * '@' meaning a socket in the abstract namespace:
+ */
+static int rd_connect(const char *path)
+{
+	struct sockaddr_un addr = {
+			.sun_family = AF_UNIX,
+	};
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("stream socket path too long: %s\n", path);
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	ret = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ret == -1)
+		return -1;
+
+	if (connect(ret, (struct sockaddr *)&addr,
+			offsetof(struct sockaddr_un, sun_path) + strlen(path))) {
+		printf("could not connect to %s: %s\n", path, strerror(errno));
+		close(ret);
+		return -1;
+	}
+
+	return ret;
+}
+
+static int rd_open(const char *path)
+{
+	int flags = rd_async_start();
+	int ret = -1;
+
+	rd_write_failed = 0;
+	rd_streaming = 0;
+
+	if (wrap_stream()) {
+		ret = rd_connect(wrap_stream());
+		if (ret != -1) {
+			/* O_DIRECT doesn't apply to sockets: */
+			async.odirect = 0;
+			rd_streaming = 1;
+		}
+	}
+
+	if (ret == -1)
+		ret = open(path, O_WRONLY| O_TRUNC | O_CREAT | flags, 0644);
+
+	if ((ret == -1) && flags) {
+		/* not all filesystems support O_DIRECT: */
+		async.odirect = 0;
+		ret = open(path, O_WRONLY| O_TRUNC | O_CREAT, 0644);
+	}
+
+	if ((ret != -1) && async.compress) {
+		uint32_t magic = RD_COMPRESSED_MAGIC;
+		fd_write(ret, &magic, sizeof(magic));
+	}
+
+	return ret;
+}
+
+static void rd_writev(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	if (async.running) {
+		async_writev(iov, iovcnt);
+		return;
+	}
+
+	if (rd_write_failed)
+		return;
+
+	/* otherwise, write everything with as few syscalls as possible: */
+	while (iovcnt > 0) {
+		struct iovec part[IOV_MAX];
+		int n = min(iovcnt, IOV_MAX);
+		ssize_t ret;
+
+		memcpy(part, iov, n * sizeof(iov[0]));
+		ret = fd_writev(fd, part, n);
+		if (ret < 0) {
+			int err = errno;
+			printf("error: %zd (%s)\n", ret, strerror(err));
+			printf("fd=%d, iovcnt=%d\n", fd, iovcnt);
+			rd_write_error(err);
+			return;
+		}
+
+		/* skip over what was written, and finish a partial iov: */
+		for (i = 0; (i < n) && (ret >= (ssize_t)iov[i].iov_len); i++)
+			ret -= iov[i].iov_len;
+		if (i < n) {
+			rd_write((uint8_t *)iov[i].iov_base + ret, iov[i].iov_len - ret);
+			i++;
+		}
+
+		iov += i;
+		iovcnt -= i;
+	}
+}
+
+/* write a section gathered from multiple pieces, so callers don't have to
+ * assemble the payload in a temporary buffer first:
+ */
+void rd_write_sectionv(enum rd_sect_type type, const struct iovec *iov, int iovcnt)
+{
+	uint32_t hdr[4] = { ~0, ~0 }, pad = 0;
+	struct iovec v[iovcnt + 2];
+	int i, sz = 0;
+
+	if (wrap_stats())
+		return;
+
+	if (rd_stage_sectionv(type, iov, iovcnt, 0, (struct content_hash){ 0 }))
+		return;
+
+	rd_lock();
+
+	if (wrap_ring() && !ring_flushing) {
+		/* only submits go in the flight recorder ring, but remember the
+		 * gpu-id for when the ring is written out:
+		 */
+		if (type == RD_GPU_ID)
+			gpu_id = *(unsigned int *)iov[0].iov_base;
+		rd_unlock();
+		return;
+	}
+
+	if (fd == -1) {
+		const char *name = getenv("TESTNAME");
+		if (!name)
+			name = "unknown";
+		rd_start(name, "");
+		printf("opened rd, %d\n", fd);
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		sz += iov[i].iov_len;
+
+	if (type == RD_GPU_ID) {
+		gpu_id = *(unsigned int *)iov[0].iov_base;
+	} else if (type == RD_BUFFER_CONTENTS) {
+		nbuffers++;
+	}
+
+	hdr[2] = type;
+	hdr[3] = ALIGN(sz, 4);
+
+	if (type != RD_INDEX)
+		rd_index_section(type, hdr[3], iov);
+	file_offset += sizeof(hdr) + hdr[3];
+
+	v[0].iov_base = hdr;
+	v[0].iov_len  = sizeof(hdr);
+	memcpy(&v[1], iov, iovcnt * sizeof(iov[0]));
+	v[iovcnt + 1].iov_base = &pad;
+	v[iovcnt + 1].iov_len  = ALIGN(sz, 4) - sz;
+
+	if ((type == RD_BUFFER_CONTENTS) && wrap_cow() && async.running)
+		cow_writev(v, iovcnt + 2);
+	else
+		rd_writev(v, iovcnt + 2);
+
+	if (wrap_safe())
+		fsync(fd);
+
+	rd_unlock();
+}
+
+static void rd_index_section(enum rd_sect_type type, uint32_t sz,
+		const struct iovec *iov)
+{
+	struct rd_index_entry *e;
+
+	if (index_count == index_size) {
+		unsigned int n = index_size ? index_size * 2 : 4096;
+		e = realloc(index_entries, n * sizeof(*e));
+		if (!e)
+			return;
+		index_entries = e;
+		index_size = n;
+	}
+
+	if ((type == RD_GPUADDR) || (type == RD_CMDSTREAM_ADDR)) {
+		const uint32_t *sect = iov[0].iov_base;
+		/* upper 32b of gpuaddr, if present, is after the len: */
+		index_gpuaddr = sect[0];
+		if (sz >= 12)
+			index_gpuaddr |= (uint64_t)sect[2] << 32;
+		index_len = sect[1];
+		/* for cmdstream, the len is in dwords: */
+		if (type == RD_CMDSTREAM_ADDR)
+			index_len *= 4;
+	}
+
+	e = &index_entries[index_count++];
+	e->offset = file_offset;
+	e->type = type;
+	e->size = sz;
+	e->submit = submit;
+
+	switch (type) {
+	case RD_GPUADDR:
+	case RD_CMDSTREAM_ADDR:
+	case RD_BUFFER_CONTENTS:
+	case RD_BUFFER_REF:
+	case RD_BUFFER_DELTA:
+		e->gpuaddr = index_gpuaddr;
+		e->len = index_len;
+		break;
+	default:
+		e->gpuaddr = 0;
+		e->len = 0;
+		break;
+	}
+}
+
+static void rd_write_index(void)
+{
+	struct rd_index_trailer trailer = {
+			.offset = file_offset,
+			.count  = index_count,
+			.magic  = RD_INDEX_MAGIC,
+	};
+	struct iovec iov[] = {
+			{ index_entries, index_count * sizeof(index_entries[0]) },
+			{ &trailer, sizeof(trailer) },
+	};
+	rd_write_sectionv(RD_INDEX, iov, ARRAY_SIZE(iov));
+}
+
+static void rd_exit(void)
+{
+	/* make sure the index gets written even if rd_end() is not called: */
+	rd_end();
+}
+
+void rd_write_section(enum rd_sect_type type, const void *buf, int sz)
+{
+	struct iovec iov = {
+			.iov_base = (void *)buf,
+			.iov_len  = sz,
+	};
+	rd_write_sectionv(type, &iov, 1);
+}
+
+/* each rd file started gets a new (non-zero) id, so callers can tell if
+ * something they wrote earlier is in the current file:
+ */
+unsigned int rd_file_id(void)
+{
+	return (fd == -1) ? 0 : file_id;
+}
+
+static struct content_hash hash_buffer(const void *buf, int sz)
+{
+	const uint8_t *p = buf;
+	uint64_t a = 0xcbf29ce484222325ull ^ sz;
+	uint64_t b = 0x84222325cbf29ce4ull + sz;
+
+	/* word at a time, the buffers can be many MB.  The two halves are
+	 * independent lanes, mixing in each word differently:
+	 */
+	while (sz >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		a = (a ^ v) * 0x9e3779b97f4a7c15ull;
+		a ^= a >> 32;
+		b = (b + v) * 0xc2b2ae3d27d4eb4full;
+		b ^= b >> 29;
+		p  += 8;
+		sz -= 8;
+	}
+
+	while (sz-- > 0) {
+		a = (a ^ *p) * 0x100000001b3ull;
+		b = (b + *p++) * 0xff51afd7ed558ccdull;
+	}
+
+	return (struct content_hash){ .lo = a, .hi = b };
+}
+
+static int hash_equal(struct content_hash a, struct content_hash b)
+{
+	return (a.lo == b.lo) && (a.hi == b.hi);
+}
+
+/* returns the entry for identical contents, or the empty slot to add it: */
+static struct dedup_entry * dedup_lookup(struct content_hash hash,
+		uint32_t len)
+{
+	unsigned int mask = dedup_size - 1;
+	unsigned int i = hash.lo & mask;
+
+	while (dedup_table[i].len) {
+		if (hash_equal(dedup_table[i].hash, hash) &&
+				(dedup_table[i].len == len))
+			break;
+		i = (i + 1) & mask;
+	}
+
+	return &dedup_table[i];
+}
+
+static void dedup_grow(void)
+{
+	struct dedup_entry *old = dedup_table;
+	unsigned int i, old_size = dedup_size;
+
+	dedup_size = old_size ? old_size * 2 : 1024;
+	dedup_table = calloc(dedup_size, sizeof(dedup_table[0]));
+
+	for (i = 0; i < old_size; i++)
+		if (old[i].len)
+			*dedup_lookup(old[i].hash, old[i].len) = old[i];
+
+	free(old);
+}
+
+/* write buffer snapshot, either as RD_BUFFER_CONTENTS or, with WRAP_DEDUP,
+ * as a RD_BUFFER_REF if identical contents are already in the file:
+ */
+void rd_write_buffer(const void *buf, int sz)
+{
+	struct iovec iov = {
+			.iov_base = (void *)buf,
+			.iov_len  = sz,
+	};
+	struct content_hash hash;
+
+	/* the flight recorder ring also dedups, by hash: */
+	if ((!wrap_dedup() && !wrap_ring()) || (sz <= 0)) {
+		rd_write_section(RD_BUFFER_CONTENTS, buf, sz);
+		return;
+	}
+
+	hash = hash_buffer(buf, sz);
+
+	/* if staged, the lookup happens when the submit is written: */
+	if (!rd_stage_sectionv(RD_BUFFER_CONTENTS, &iov, 1, 1, hash))
+		rd_write_buffer_hashed(buf, sz, hash);
+}
+
+static void rd_write_buffer_hashed(const void *buf, int sz,
+		struct content_hash hash)
+{
+	struct dedup_entry *e;
+
+	rd_lock();
+
+	if ((dedup_count + 1) * 2 > dedup_size)
+		dedup_grow();
+
+	e = dedup_lookup(hash, sz);
+
+	if (e->len && (fd != -1)) {
+		uint32_t ref[2] = { e->idx, e->len };
+		rd_write_section(RD_BUFFER_REF, ref, sizeof(ref));
+	} else {
+		rd_write_section(RD_BUFFER_CONTENTS, buf, sz);
+
+		/* note, writing the section could have (re)started the rd file: */
+		e = dedup_lookup(hash, sz);
+		e->hash = hash;
+		e->len  = sz;
+		e->idx  = nbuffers - 1;
+		dedup_count++;
+	}
+
+	rd_unlock();
+}
+
+/*
+ * Submit capture:
+ *
+ * Each submit is captured between rd_capture_begin() and rd_capture_end(),
+ * and starts with a RD_SUBMIT_SEQ section.  Sections written in between by
+ * the capturing thread are staged in a per-thread list, and only written to
+ * the file (in one go) by rd_capture_end().  So submitting threads only
+ * contend on the rd lock for the final write, rather than for the whole
+ * capture.  Submits are written in order of their sequence numbers, so
+ * that the order in the file is the order the submits started in.
+ *
+ * Small payloads (ie. RD_GPUADDR) are copied when staged, but larger ones
+ * (buffer contents and cmdstream) are only referenced, so they must stay
+ * valid until rd_capture_end().
+ *
+ * With WRAP_DIRTY, each delta depends on the previous snapshot in the file,
+ * so submits are captured one at a time, and written directly.
+ */
+
+#define STAGE_INLINE 64    /* max size of payloads copied when staged */
+
+struct stage_iov {
+	const void *ptr;
+	size_t len;
+	size_t off;              /* offset in data, if copied */
+	int copied;
+};
+
+struct stage_sect {
+	enum rd_sect_type type;
+	unsigned int iov, iovcnt;  /* range in iovs */
+	int buffer;              /* RD_BUFFER_CONTENTS, to be deduplicated */
+	struct content_hash hash;
+};
+
+struct stage {
+	int active;              /* between rd_capture_begin/end() */
+	int staging;             /* sections are staged, rather than written */
+	struct rd_submit_seq seq;
+	struct stage_sect *sects;
+	unsigned int nsects, maxsects;
+	struct stage_iov *iovs;
+	unsigned int niovs, maxiovs;
+	uint8_t *data;
+	size_t ndata, maxdata;
+};
+
+static pthread_key_t stage_key;
+static pthread_once_t stage_once = PTHREAD_ONCE_INIT;
+
+static uint64_t next_seqno;      /* next seqno to assign */
+static uint64_t commit_seqno;    /* next seqno to be written, under rd lock */
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+static void stage_free(void *ptr)
+{
+	struct stage *st = ptr;
+	free(st->sects);
+	free(st->iovs);
+	free(st->data);
+	free(st);
+}
+
+static void stage_init(void)
+{
+	pthread_key_create(&stage_key, stage_free);
+}
+
+static struct stage * get_stage(void)
+{
+	struct stage *st;
+
+	pthread_once(&stage_once, stage_init);
+
+	st = pthread_getspecific(stage_key);
+	if (!st) {
+		st = calloc(1, sizeof(*st));
+		pthread_setspecific(stage_key, st);
+	}
+
+	return st;
+}
+
+/* returns non-zero if the section was staged rather than written: */
+static int rd_stage_sectionv(enum rd_sect_type type, const struct iovec *iov,
+		int iovcnt, int buffer, struct content_hash hash)
+{
+	struct stage *st;
+	struct stage_sect *sect;
+	int i;
+
+	/* don't bother with thread specific data for threads that never
+	 * capture a submit:
+	 */
+	if (!next_seqno)
+		return 0;
+
+	st = get_stage();
+	if (!st->staging)
+		return 0;
+
+	if (st->nsects == st->maxsects) {
+		st->maxsects = max(64, st->maxsects * 2);
+		st->sects = realloc(st->sects, st->maxsects * sizeof(st->sects[0]));
+	}
+
+	if ((st->niovs + iovcnt) > st->maxiovs) {
+		st->maxiovs = max(st->niovs + iovcnt, max(256, st->maxiovs * 2));
+		st->iovs = realloc(st->iovs, st->maxiovs * sizeof(st->iovs[0]));
+	}
+
+	sect = &st->sects[st->nsects++];
+	sect->type   = type;
+	sect->iov    = st->niovs;
+	sect->iovcnt = iovcnt;
+	sect->buffer = buffer;
+	sect->hash   = hash;
+
+	for (i = 0; i < iovcnt; i++) {
+		struct stage_iov *siov = &st->iovs[st->niovs++];
+
+		siov->ptr = iov[i].iov_base;
+		siov->len = iov[i].iov_len;
+		siov->copied = 0;
+
+		if (siov->len <= STAGE_INLINE) {
+			if ((st->ndata + siov->len) > st->maxdata) {
+				st->maxdata = max(0x1000, st->maxdata * 2);
+				st->data = realloc(st->data, st->maxdata);
+			}
+			memcpy(st->data + st->ndata, siov->ptr, siov->len);
+			siov->off = st->ndata;
+			siov->copied = 1;
+			st->ndata += siov->len;
+		}
+	}
+
+	return 1;
+}
+
+/* wait until it is our turn to write, with the rd lock held: */
+static void rd_capture_wait(struct stage *st)
+{
+	rd_lock();
+	while (commit_seqno != st->seq.seqno)
+		pthread_cond_wait(&commit_cond, &rd_mutex);
+}
+
+static void rd_write_submit_seq(const struct rd_submit_seq *seq)
+{
+	submit++;
+	rd_write_section(RD_SUBMIT_SEQ, seq, sizeof(*seq));
+}
+
+static void stage_iovs(struct stage *st, struct stage_sect *sect,
+		struct iovec *iov)
+{
+	unsigned int j;
+
+	for (j = 0; j < sect->iovcnt; j++) {
+		struct stage_iov *siov = &st->iovs[sect->iov + j];
+		iov[j].iov_base = siov->copied ?
+				st->data + siov->off : (void *)siov->ptr;
+		iov[j].iov_len  = siov->len;
+	}
+}
+
+uint64_t rd_capture_begin(void)
+{
+	struct stage *st = get_stage();
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	st->seq.seqno = __sync_fetch_and_add(&next_seqno, 1);
+	st->seq.timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	st->seq.tid = syscall(SYS_gettid);
+	st->seq.pad = 0;
+
+	st->active = 1;
+	st->nsects = st->niovs = st->ndata = 0;
+
+	if (wrap_dirty()) {
+		rd_capture_wait(st);
+		rd_write_submit_seq(&st->seq);
+	} else {
+		st->staging = 1;
+	}
+
+	return st->seq.seqno;
+}
+
+void rd_capture_end(void)
+{
+	struct stage *st = get_stage();
+	unsigned int i;
+
+	if (!st->active)
+		return;
+
+	if (st->staging) {
+		st->staging = 0;
+		rd_capture_wait(st);
+
+		if (wrap_ring()) {
+			rd_ring_push(st);
+		} else {
+			rd_write_submit_seq(&st->seq);
+
+			for (i = 0; i < st->nsects; i++) {
+				struct stage_sect *sect = &st->sects[i];
+				struct iovec iov[sect->iovcnt];
+
+				stage_iovs(st, sect, iov);
+
+				if (sect->buffer)
+					rd_write_buffer_hashed(iov[0].iov_base, iov[0].iov_len, sect->hash);
+				else
+					rd_write_sectionv(sect->type, iov, sect->iovcnt);
+			}
+		}
+	}
+
+	st->active = 0;
+	commit_seqno++;
+	pthread_cond_broadcast(&commit_cond);
+	rd_unlock();
+}
+
+/*
+ * Flight recorder (WRAP_RING):
+ *
+ * Rather than writing submits to the rd file as they are captured, the
+ * last $WRAP_RING submits are kept in memory, and only written out when
+ * triggered, by SIGUSR1, an error from a wait on a timestamp (ie. GPU hang
+ * or fault), or (with $WRAP_RING_THRESHOLD) if more than that many ms pass
+ * between two submits.  Each trigger writes out the whole ring (preceded by
+ * a RD_CMD describing the trigger), and then starts again from empty.
+ *
+ * Identical buffer contents are shared between the submits in the ring,
+ * so memory use is bounded by the ring size times the memory used by the
+ * submits, but in practice only by what changes from submit to submit.
+ * Everything written outside of submits (except RD_GPU_ID) is dropped.
+ */
+
+struct ring_blob {
+	struct ring_blob *next;    /* in hash chain */
+	struct content_hash hash;
+	uint32_t len;
+	unsigned int refs;
+	uint8_t data[];
+};
+
+struct ring_sect {
+	enum rd_sect_type type;
+	uint32_t size;
+	void *data;                /* unless blob */
+	struct ring_blob *blob;    /* for buffer contents */
+};
+
+struct ring_submit {
+	struct rd_submit_seq seq;
+	struct ring_sect *sects;
+	unsigned int nsects;
+};
+
+#define RING_BLOB_BUCKETS 4096
+
+static struct ring_submit *ring;
+static unsigned int ring_first, ring_count;  /* oldest submit, # of submits */
+static struct ring_blob *ring_blobs[RING_BLOB_BUCKETS];
+static uint64_t ring_last_timestamp;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/* SIGUSR1 just wakes up ring_thread, which does the actual flushing: */
+static sem_t ring_sem;
+static pthread_t ring_thread;
+static struct sigaction old_usr1;
+
+static void rd_ring_flush(const char *reason);
+
+static void ring_signal(int sig, siginfo_t *info, void *ctx)
+{
+	sem_post(&ring_sem);
+
+	/* the application could be using SIGUSR1 too: */
+	if (old_usr1.sa_flags & SA_SIGINFO)
+		old_usr1.sa_sigaction(sig, info, ctx);
+	else if ((old_usr1.sa_handler != SIG_DFL) &&
+			(old_usr1.sa_handler != SIG_IGN))
+		old_usr1.sa_handler(sig);
+}
+
+static void * ring_thread_main(void *arg)
+{
+	for (;;) {
+		if (sem_wait(&ring_sem))
+			continue;   /* EINTR */
+		rd_ring_flush("signal");
+	}
+	return NULL;
+}
+
+static void ring_init(void)
+{
+	struct sigaction sa = {
+			.sa_sigaction = ring_signal,
+			.sa_flags = SA_SIGINFO | SA_RESTART,
+	};
+
+	ring = calloc(wrap_ring(), sizeof(ring[0]));
+
+	sem_init(&ring_sem, 0, 0);
+	pthread_create(&ring_thread, NULL, ring_thread_main, NULL);
+
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, &old_usr1);
+	if ((old_usr1.sa_flags & SA_SIGINFO) ||
+			((old_usr1.sa_handler != SIG_DFL) &&
+			 (old_usr1.sa_handler != SIG_IGN)))
+		printf("flight recorder: chaining to the application's SIGUSR1 handler\n");
+}
+
+static struct ring_blob * ring_blob_get(const void *buf, uint32_t len,
+		struct content_hash hash)
+{
+	struct ring_blob **head = &ring_blobs[hash.lo % RING_BLOB_BUCKETS];
+	struct ring_blob *blob;
+
+	for (blob = *head; blob; blob = blob->next) {
+		if (hash_equal(blob->hash, hash) && (blob->len == len)) {
+			blob->refs++;
+			return blob;
+		}
+	}
+
+	blob = malloc(sizeof(*blob) + len);
+	blob->hash = hash;
+	blob->len  = len;
+	blob->refs = 1;
+	memcpy(blob->data, buf, len);
+	blob->next = *head;
+	*head = blob;
+
+	return blob;
+}
+
+static void ring_blob_put(struct ring_blob *blob)
+{
+	struct ring_blob **p = &ring_blobs[blob->hash.lo % RING_BLOB_BUCKETS];
+
+	if (--blob->refs)
+		return;
+
+	while (*p != blob)
+		p = &(*p)->next;
+	*p = blob->next;
+
+	free(blob);
+}
+
+static void ring_evict(void)
+{
+	struct ring_submit *rs = &ring[ring_first];
+	unsigned int i;
+
+	for (i = 0; i < rs->nsects; i++) {
+		if (rs->sects[i].blob)
+			ring_blob_put(rs->sects[i].blob);
+		else
+			free(rs->sects[i].data);
+	}
+
+	free(rs->sects);
+	rs->sects = NULL;
+	rs->nsects = 0;
+
+	ring_first = (ring_first + 1) % wrap_ring();
+	ring_count--;
+}
+
+static void rd_ring_flush(const char *reason)
+{
+	char buf[128];
+
+	rd_lock();
+
+	ring_flushing = 1;
+
+	snprintf(buf, sizeof(buf), "flight recorder: %s, last %u submits",
+			reason, ring_count);
+	rd_write_section(RD_CMD, buf, strlen(buf));
+
+	while (ring_count > 0) {
+		struct ring_submit *rs = &ring[ring_first];
+		unsigned int i;
+
+		rd_write_submit_seq(&rs->seq);
+
+		for (i = 0; i < rs->nsects; i++) {
+			struct ring_sect *sect = &rs->sects[i];
+
+			if (!sect->blob)
+				rd_write_section(sect->type, sect->data, sect->size);
+			else if (wrap_dedup())
+				rd_write_buffer_hashed(sect->blob->data, sect->blob->len, sect->blob->hash);
+			else
+				rd_write_section(RD_BUFFER_CONTENTS, sect->blob->data, sect->blob->len);
+		}
+
+		ring_evict();
+	}
+
+	rd_async_flush();
+
+	ring_flushing = 0;
+
+	rd_unlock();
+}
+
+/* add a staged submit to the ring, called with the rd lock held: */
+static void rd_ring_push(struct stage *st)
+{
+	struct ring_submit *rs;
+	uint64_t interval = 0;
+	unsigned int i;
+
+	pthread_once(&ring_once, ring_init);
+
+	if (ring_count == wrap_ring())
+		ring_evict();
+
+	rs = &ring[(ring_first + ring_count++) % wrap_ring()];
+	rs->seq = st->seq;
+	rs->nsects = st->nsects;
+	rs->sects = calloc(st->nsects, sizeof(rs->sects[0]));
+
+	for (i = 0; i < st->nsects; i++) {
+		struct stage_sect *sect = &st->sects[i];
+		struct ring_sect *rsect = &rs->sects[i];
+		struct iovec iov[sect->iovcnt];
+		unsigned int j;
+
+		stage_iovs(st, sect, iov);
+
+		rsect->type = sect->type;
+
+		if (sect->buffer) {
+			rsect->blob = ring_blob_get(iov[0].iov_base, iov[0].iov_len, sect->hash);
+			continue;
+		}
+
+		for (j = 0; j < sect->iovcnt; j++)
+			rsect->size += iov[j].iov_len;
+
+		rsect->data = malloc(rsect->size);
+		for (j = 0, rsect->size = 0; j < sect->iovcnt; j++) {
+			memcpy((uint8_t *)rsect->data + rsect->size,
+					iov[j].iov_base, iov[j].iov_len);
+			rsect->size += iov[j].iov_len;
+		}
+	}
+
+	if (ring_last_timestamp && (st->seq.timestamp > ring_last_timestamp))
+		interval = st->seq.timestamp - ring_last_timestamp;
+	ring_last_timestamp = st->seq.timestamp;
+
+	if (wrap_ring_threshold() &&
+			(interval > (uint64_t)wrap_ring_threshold() * 1000000)) {
+		char reason[64];
+		snprintf(reason, sizeof(reason), "%"PRIu64"ms between submits",
+				interval / 1000000);
+		rd_ring_flush(reason);
+	}
+}
+
+/* write out the flight recorder ring, if enabled: */
+void rd_ring_trigger(const char *reason)
+{
+	if (!wrap_ring() || !ring)
+		return;
+	rd_ring_flush(reason);
+}
+
+unsigned int env2u(const char *name)
+{
+	const char *str = getenv(name);
+	if (!str)
+		return 0;
+	return strtol(str, NULL, 0);
+}
+
+/* in safe mode, sync log file frequently, and insert delays before/after
+ * issueibcmds.. useful when we are crashing things and want to be sure to
+ * capture as much of the log as possible
+ */
+unsigned int wrap_safe(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_SAFE");
+	}
+	return val;
+}
+
+/* if non-zero, emulate a different gpu-id.  The issueibcmds will be stubbed
+ * so we don't actually submit cmds to the gpu.  This is useful to generate
+ * cmdstream dumps for different gpu versions for comparision.
+ */
+unsigned int wrap_gpu_id(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_GPU_ID");
+	}
+	return val;
+}
+
+/* defaults to zero if $WRAP_GPU_ID does not end in a ".%d".. */
+unsigned int wrap_gpu_id_patchid(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		char *endptr = NULL;
+		const char *str = getenv("WRAP_GPU_ID");
+		if (str) {
+			unsigned int gpuid = strtol(str, &endptr, 0);
+			if (endptr[0] == '.') {
+				val = strtol(endptr + 1, NULL, 0);
+			}
+		} else {
+			val = 0;
+		}
+	}
+	return val;
+}
+
+unsigned int wrap_gmem_size(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_GMEM_SIZE");
+	}
+	return val;
+}
+
+/* if non-zero, buffer snapshots identical to one already in the rd file
+ * are written as a RD_BUFFER_REF to the earlier RD_BUFFER_CONTENTS rather
+ * than dumping the contents again.
+ */
+unsigned int wrap_dedup(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_DEDUP");
+	}
+	return val;
+}
+
+/* if non-zero, size in MiB of a ring buffer that sections are queued in,
+ * to be written out by a separate thread rather than by the application's
+ * thread.  Ignored in safe mode.
+ */
+unsigned int wrap_async(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_ASYNC");
+	}
+	return val;
+}
+
+/* if non-zero, zlib compression level (1-9) to compress the rd file with.
+ * Compression happens on the writer thread, as with WRAP_ASYNC.  Ignored in
+ * safe mode.
+ */
+unsigned int wrap_compress(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_COMPRESS");
+	}
+	return val;
+}
+
+/* if non-zero (and WRAP_ASYNC), bypass the page cache writing the rd file */
+unsigned int wrap_odirect(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_ODIRECT");
+	}
+	return val;
+}
+
+/* if non-zero, nothing is captured, instead per-ioctl counters and latency
+ * histograms are printed to stderr on exit.  Low enough overhead to leave
+ * enabled on long running workloads.
+ */
+unsigned int wrap_stats(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_STATS");
+	}
+	return val;
+}
+
+/* if non-zero, ioctls are logged to the rd file as RD_IOCTL sections rather
+ * than printed, to keep text formatting out of the application's way.  The
+ * rdlog tool prints them as text.
+ */
+unsigned int wrap_evlog(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_EVLOG");
+	}
+	return val;
+}
+
+/* capture window: only submits in the window have their cmdstream and
+ * buffers dumped, the rest are just passed through.  Submits are counted from
+ * zero.  Starting at submit $WRAP_CAPTURE_START, $WRAP_CAPTURE_COUNT submits
+ * are captured (or all of them, if zero).  If $WRAP_CAPTURE_EVERY is
+ * non-zero, the window repeats every that many submits, ie. with COUNT=1
+ * every Kth submit is captured.
+ */
+unsigned int wrap_capture_start(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_CAPTURE_START");
+	}
+	return val;
+}
+
+unsigned int wrap_capture_count(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_CAPTURE_COUNT");
+	}
+	return val;
+}
+
+unsigned int wrap_capture_every(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_CAPTURE_EVERY");
+	}
+	return val;
+}
+
+/* if non-zero, only dump the buffers referenced by the submitted cmdstream,
+ * rather than all of them, see scan_ib().
+ */
+unsigned int wrap_refonly(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_REFONLY");
+	}
+	return val;
+}
+
+/* if non-zero, write-protect buffers after they are snapshotted and track
+ * the pages the application writes, so that subsequent submits only need
+ * to dump the dirty pages as a RD_BUFFER_DELTA.  Note that writes by the
+ * GPU are not seen, and syscalls that write directly into a buffer would
+ * fail with EFAULT.
+ */
+unsigned int wrap_dirty(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_DIRTY") && !wrap_ring();
+	}
+	return val;
+}
+
+/* if set, path of a unix socket (or '@name' for the abstract namespace) to
+ * stream the rd file to, rather than writing it to storage.  See rdrecv for
+ * a consumer.  If the connection fails, the file is written as usual.
+ */
+const char * wrap_stream(void)
+{
+	static const char *val = (const char *)-1;
+	if (val == (const char *)-1) {
+		val = getenv("WRAP_STREAM");
+		if (val && !val[0])
+			val = NULL;
+	}
+	return val;
+}
+
+/* if non-zero, large buffer snapshots are queued to the writer thread by
+ * reference rather than copied, with the pages write-protected until they
+ * have been written out, see rd_cow_fault().  Implies the writer thread, as
+ * with WRAP_ASYNC, but not O_DIRECT.  Ignored with WRAP_DIRTY or WRAP_RING.
+ * As with WRAP_DIRTY, syscalls that write directly into a buffer could fail
+ * with EFAULT while it is being written out.
+ */
+unsigned int wrap_cow(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_COW") && !wrap_dirty() && !wrap_ring();
+	}
+	return val;
+}
+
+/* if non-zero, # of submits to keep in the flight recorder ring, which is
+ * only written to the rd file when triggered, see rd_ring_push().  Not
+ * compatible with WRAP_DIRTY, which is ignored.
+ */
+unsigned int wrap_ring(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_RING");
+	}
+	return val;
+}
+
+/* if non-zero (and WRAP_RING), more than this many ms between two submits
+ * triggers writing out the ring:
+ */
+unsigned int wrap_ring_threshold(void)
+{
+	static unsigned int val = -1;
+	if (val == -1) {
+		val = env2u("WRAP_RING_THRESHOLD");
 	}
 	return val;
 }
@@ -36,6 +36,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -43,6 +44,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #define __user
 #include "kgsl_drm.h"
@@ -70,6 +72,32 @@ unsigned int wrap_safe(void);
 unsigned int wrap_gpu_id(void);
 unsigned int wrap_gpu_id_patchid(void);
 unsigned int wrap_gmem_size(void);
+unsigned int wrap_dedup(void);
+unsigned int wrap_dirty(void);
+unsigned int wrap_async(void);
+unsigned int wrap_odirect(void);
+unsigned int wrap_compress(void);
+unsigned int wrap_stats(void);
+unsigned int wrap_evlog(void);
+unsigned int wrap_capture_start(void);
+unsigned int wrap_capture_count(void);
+unsigned int wrap_capture_every(void);
+unsigned int wrap_ring(void);
+unsigned int wrap_ring_threshold(void);
+unsigned int wrap_refonly(void);
+unsigned int wrap_cow(void);
+const char * wrap_stream(void);
+
+void rd_write_sectionv(enum rd_sect_type type, const struct iovec *iov, int iovcnt);
+void rd_write_buffer(const void *buf, int sz);
+unsigned int rd_file_id(void);
+uint64_t rd_capture_begin(void);
+void rd_capture_end(void);
+void rd_ring_trigger(const char *reason);
+int rd_cow_fault(void *addr);
+void rd_cow_release(void *ptr, size_t len);
+void rd_lock(void);
+void rd_unlock(void);
 
 #if 0
 #ifdef USE_PTHREADS
@@ -110,4 +138,9 @@ int pthread_mutex_timedlock(pthread_mutex_t *mutex, struct timespec*  ts);
 #include <pthread.h>
 #endif
 
+#if !defined(PTHREAD_RECURSIVE_MUTEX_INITIALIZER) && \
+		defined(PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP)
+#  define PTHREAD_RECURSIVE_MUTEX_INITIALIZER PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+#endif
+
 #endif /* WRAP_H_ */